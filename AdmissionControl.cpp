@@ -0,0 +1,142 @@
+// 
+// 
+// 
+
+#include "AdmissionControl.h"
+#include "HTTPError.h"
+#include <esp_heap_caps.h>
+#include <algorithm>
+
+srv::AdmissionControl::Ticket& srv::AdmissionControl::Ticket::operator=(Ticket&& other) noexcept
+{
+	if (this != &other)
+	{
+		reset();
+		m_control = other.m_control;
+		m_userID = other.m_userID;
+		m_transfer = other.m_transfer;
+		other.m_control = nullptr;
+	}
+	return *this;
+}
+
+void srv::AdmissionControl::Ticket::reset()
+{
+	if (!m_control)
+		return;
+
+	m_control->release(m_userID, m_transfer);
+	m_control = nullptr;
+}
+
+srv::AdmissionControl::AdmissionControl()
+	:m_inFlight{}, m_rejected(0)
+{
+	m_holders.reserve(8);
+	m_contenders.reserve(8);
+}
+
+srv::AdmissionControl::Ticket srv::AdmissionControl::admit(std::int64_t userID, Transfer transfer)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	// Forget users that stopped retrying
+	const std::uint32_t now = millis();
+	const std::uint32_t memory = m_limits.retryAfter * 2000;
+	m_contenders.erase(std::remove_if(m_contenders.begin(), m_contenders.end(),
+		[now, memory](const Contender& contender) { return now - contender.refusedAt > memory; }), m_contenders.end());
+
+	const size_t limit = m_limits.slots[index(transfer)];
+	if (m_inFlight[index(transfer)] >= limit)
+		refuse(userID, transfer, "Too many concurrent transfers, try again later");
+
+	if (heap_caps_get_free_size(MALLOC_CAP_INTERNAL) < m_limits.minFreeHeap
+		|| heap_caps_get_largest_free_block(MALLOC_CAP_INTERNAL) < m_limits.minFreeBlock)
+		refuse(userID, transfer, "Server low on memory, try again later");
+
+	Holder* holder = findHolder(userID);
+	const size_t held = holder ? holder->slots[index(transfer)] : 0;
+	const size_t contenders = countContenders(userID, transfer);
+	const size_t share = std::max<size_t>(1, (limit + contenders - 1) / contenders);
+	if (held >= share)
+		refuse(userID, transfer, "Transfer limit for this user reached, try again later");
+
+	if (!holder)
+	{
+		m_holders.push_back({ userID, {} });
+		holder = &m_holders.back();
+	}
+	++holder->slots[index(transfer)];
+	++m_inFlight[index(transfer)];
+
+	m_contenders.erase(std::remove_if(m_contenders.begin(), m_contenders.end(),
+		[userID, transfer](const Contender& contender) { return contender.userID == userID && contender.transfer == transfer; }), m_contenders.end());
+	return Ticket(*this, userID, transfer);
+}
+
+void srv::AdmissionControl::setLimits(const Limits& limits)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_limits = limits; // transfers already admitted run to completion
+}
+
+void srv::AdmissionControl::release(std::int64_t userID, Transfer transfer)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	--m_inFlight[index(transfer)];
+	Holder* holder = findHolder(userID);
+	if (!holder)
+		return;
+
+	--holder->slots[index(transfer)];
+	for (size_t slots : holder->slots)
+		if (slots)
+			return;
+
+	*holder = m_holders.back();
+	m_holders.pop_back();
+}
+
+size_t srv::AdmissionControl::countContenders(std::int64_t userID, Transfer transfer) const
+{
+	size_t count = 1; // the caller
+	for (const Holder& holder : m_holders)
+		if (holder.userID != userID && holder.slots[index(transfer)])
+			++count;
+
+	for (const Contender& contender : m_contenders)
+	{
+		if (contender.userID == userID || contender.transfer != transfer)
+			continue;
+
+		const bool isHolder = std::any_of(m_holders.begin(), m_holders.end(),
+			[&](const Holder& holder) { return holder.userID == contender.userID && holder.slots[index(transfer)]; });
+		if (!isHolder)
+			++count;
+	}
+	return count;
+}
+
+srv::AdmissionControl::Holder* srv::AdmissionControl::findHolder(std::int64_t userID)
+{
+	for (Holder& holder : m_holders)
+		if (holder.userID == userID)
+			return &holder;
+	return nullptr;
+}
+
+void srv::AdmissionControl::refuse(std::int64_t userID, Transfer transfer, const char* reason)
+{
+	++m_rejected;
+
+	const std::uint32_t now = millis();
+	auto contender = std::find_if(m_contenders.begin(), m_contenders.end(),
+		[userID, transfer](const Contender& contender) { return contender.userID == userID && contender.transfer == transfer; });
+	if (contender != m_contenders.end())
+		contender->refusedAt = now;
+	else
+		m_contenders.push_back({ userID, transfer, now });
+
+	throw HTTPError(503, reason, m_limits.retryAfter);
+}
@@ -0,0 +1,104 @@
+// AdmissionControl.h
+
+#ifndef _AdmissionControl_h
+#define _AdmissionControl_h
+
+#if defined(ARDUINO) && ARDUINO >= 100
+#include "arduino.h"
+#else
+#include "WProgram.h"
+#endif
+
+#include <array>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+namespace srv {
+	class AdmissionControl;
+}
+
+// Caps the transfers in flight per kind and refuses new ones while free internal heap, or its largest free
+// block, is below a floor (PSRAM cannot serve DMA or lwIP buffers, so it does not count), so bursts are
+// answered with 503 and Retry-After instead of exhausting memory mid-write. Slots are shared fairly: a user
+// may hold at most ceil(slots / contenders), where contenders are the users holding a slot of that kind or
+// refused one within the last two Retry-After periods. A lone user can therefore use every slot, and gives
+// them up one by one as others retry.
+class srv::AdmissionControl
+{
+public:
+	enum class Transfer : std::uint8_t
+	{
+		Download,
+		Upload,
+		Listing
+	};
+
+	static constexpr size_t TransferKinds = 3;
+
+	struct Limits
+	{
+		std::array<size_t, TransferKinds> slots = { 4, 2, 4 }; // indexed by Transfer
+		size_t minFreeHeap = 40 * 1024; // bytes of internal RAM
+		size_t minFreeBlock = 16 * 1024; // bytes; one pool block must still fit after fragmentation
+		std::uint32_t retryAfter = 2; // seconds
+	};
+
+	// Holds one slot until destroyed; owned by whatever object lives as long as the transfer
+	class Ticket
+	{
+	public:
+		Ticket() = default;
+		Ticket(AdmissionControl& control, std::int64_t userID, Transfer transfer) : m_control(&control), m_userID(userID), m_transfer(transfer) {}
+		~Ticket() { reset(); }
+
+		Ticket(Ticket&& other) noexcept : m_control(other.m_control), m_userID(other.m_userID), m_transfer(other.m_transfer) { other.m_control = nullptr; }
+		Ticket& operator=(Ticket&& other) noexcept;
+
+		void reset();
+
+	private:
+		AdmissionControl* m_control = nullptr;
+		std::int64_t m_userID = 0;
+		Transfer m_transfer = Transfer::Download;
+	};
+
+	AdmissionControl();
+
+	Ticket admit(std::int64_t userID, Transfer transfer); // throws HTTPError 503 with Retry-After
+
+	void setLimits(const Limits& limits);
+	const Limits& getLimits() const { return m_limits; }
+	size_t getInFlight(Transfer transfer) const { return m_inFlight[index(transfer)]; }
+	std::uint32_t getRejected() const { return m_rejected; }
+
+private:
+	struct Holder
+	{
+		std::int64_t userID;
+		std::array<size_t, TransferKinds> slots;
+	};
+
+	struct Contender
+	{
+		std::int64_t userID;
+		Transfer transfer;
+		std::uint32_t refusedAt; // millis()
+	};
+
+	std::mutex m_mutex;
+	Limits m_limits;
+	std::array<size_t, TransferKinds> m_inFlight;
+	std::vector<Holder> m_holders; // users with at least one slot
+	std::vector<Contender> m_contenders; // users recently refused
+	std::uint32_t m_rejected;
+
+	void release(std::int64_t userID, Transfer transfer);
+	size_t countContenders(std::int64_t userID, Transfer transfer) const;
+	Holder* findHolder(std::int64_t userID);
+	[[noreturn]] void refuse(std::int64_t userID, Transfer transfer, const char* reason);
+
+	static size_t index(Transfer transfer) { return static_cast<size_t>(transfer); }
+};
+
+#endif
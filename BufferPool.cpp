@@ -0,0 +1,67 @@
+// 
+// 
+// 
+
+#include "BufferPool.h"
+#include <stdexcept>
+
+srv::BufferPool::BufferPool(size_t blockSize, size_t maxBlocks)
+	:m_blockSize(blockSize), m_maxBlocks(maxBlocks), m_allocated(0)
+{
+	m_free.reserve(maxBlocks);
+}
+
+srv::BufferPool::~BufferPool()
+{
+	freeIdleBlocks();
+}
+
+uint8_t* srv::BufferPool::acquire()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	if (!m_free.empty())
+	{
+		uint8_t* block = m_free.back();
+		m_free.pop_back();
+		return block;
+	}
+
+	if (m_allocated >= m_maxBlocks)
+		return nullptr;
+
+	uint8_t* block = static_cast<uint8_t*>(malloc(m_blockSize));
+	if (block)
+		++m_allocated;
+	return block;
+}
+
+void srv::BufferPool::release(uint8_t* block)
+{
+	if (!block)
+		return;
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_free.push_back(block);
+}
+
+void srv::BufferPool::configure(size_t blockSize, size_t maxBlocks)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	if (m_free.size() != m_allocated)
+		throw std::logic_error("Cannot reconfigure a buffer pool with blocks in use");
+
+	freeIdleBlocks();
+	m_blockSize = blockSize;
+	m_maxBlocks = maxBlocks;
+	m_free.reserve(maxBlocks);
+}
+
+void srv::BufferPool::freeIdleBlocks()
+{
+	for (uint8_t* block : m_free)
+		free(block);
+	m_allocated -= m_free.size();
+	m_free.clear();
+}
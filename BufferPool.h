@@ -0,0 +1,49 @@
+// BufferPool.h
+
+#ifndef _BufferPool_h
+#define _BufferPool_h
+
+#if defined(ARDUINO) && ARDUINO >= 100
+#include "arduino.h"
+#else
+#include "WProgram.h"
+#endif
+
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+namespace srv {
+	class BufferPool;
+}
+
+// Fixed-size blocks recycled between transfers instead of being reallocated per request
+class srv::BufferPool
+{
+public:
+	BufferPool(size_t blockSize, size_t maxBlocks);
+	~BufferPool();
+
+	BufferPool(const BufferPool&) = delete;
+	BufferPool& operator=(const BufferPool&) = delete;
+
+	// Returns nullptr when every block is in use or the heap cannot supply a new one
+	uint8_t* acquire();
+	void release(uint8_t* block);
+
+	// Only allowed while no block is checked out
+	void configure(size_t blockSize, size_t maxBlocks);
+
+	size_t getBlockSize() const { return m_blockSize; }
+
+private:
+	std::mutex m_mutex;
+	size_t m_blockSize;
+	size_t m_maxBlocks;
+	size_t m_allocated;
+	std::vector<uint8_t*> m_free;
+
+	void freeIdleBlocks();
+};
+
+#endif
@@ -0,0 +1,155 @@
+// 
+// 
+// 
+
+#include "ChangeFeed.h"
+#include <ArduinoJson.h>
+#include <esp_random.h>
+#include <ESPAsyncWebServer.h>
+#include <algorithm>
+#include <cstring>
+
+srv::ChangeFeed::ChangeFeed(size_t capacity)
+	:m_capacity(capacity), m_head(0), m_seq(0), m_epoch(esp_random())
+{
+	m_ring.reserve(capacity);
+}
+
+void srv::ChangeFeed::onRowChange(const RowChange& change)
+{
+	if (!change.isTable("FileEntries"))
+		return;
+
+	switch (change.getOperation())
+	{
+	case RowChange::Operation::Insert:
+		return append(change.getNewRowID(), change.getNewValue<std::int64_t>(FileEntriesColumn::ParentID), Operation::Create);
+	case RowChange::Operation::Delete:
+		return append(change.getOldRowID(), change.getOldValue<std::int64_t>(FileEntriesColumn::ParentID), Operation::Delete);
+	case RowChange::Operation::Update:
+		// A move is reported under both parents so either side's watchers see it
+		if (change.hasColumnChanged<std::int64_t>(FileEntriesColumn::ParentID))
+			append(change.getOldRowID(), change.getOldValue<std::int64_t>(FileEntriesColumn::ParentID), Operation::Delete);
+		return append(change.getNewRowID(), change.getNewValue<std::int64_t>(FileEntriesColumn::ParentID),
+			change.hasColumnChanged<std::int64_t>(FileEntriesColumn::ParentID) ? Operation::Create : Operation::Update);
+	}
+}
+
+bool srv::ChangeFeed::read(std::uint64_t since, size_t limit, std::vector<Change>& changes) const
+{
+	const std::uint64_t oldest = m_seq - m_ring.size() + 1;
+	if (since + 1 < oldest)
+		return false;
+
+	// The ring is ordered by seq starting at m_head once it has wrapped
+	const size_t start = m_ring.size() < m_capacity ? 0 : m_head;
+	for (size_t i = static_cast<size_t>(since + 1 - oldest); i < m_ring.size() && changes.size() < limit; ++i)
+		changes.push_back(m_ring[(start + i) % m_ring.size()]);
+	return true;
+}
+
+const char* srv::ChangeFeed::toString(Operation operation)
+{
+	switch (operation)
+	{
+	case Operation::Create:
+		return "create";
+	case Operation::Update:
+		return "update";
+	default:
+		return "delete";
+	}
+}
+
+void srv::ChangeFeed::append(std::int64_t fileID, std::int64_t parentID, Operation operation)
+{
+	const Change change{ ++m_seq, fileID, parentID, operation };
+	if (m_ring.size() < m_capacity)
+		return m_ring.push_back(change);
+
+	m_ring[m_head] = change;
+	m_head = (m_head + 1) % m_capacity;
+}
+
+srv::ChangePoll::ChangePoll(StatementCache& statements, PermissionCache& permissions, ChangeFeed& feed, std::int64_t userID,
+	std::optional<std::uint32_t> epoch, std::uint64_t since, size_t limit, std::uint32_t waitMs)
+	:m_statements(statements), m_permissions(permissions), m_feed(feed), m_userID(userID), m_since(since), m_limit(limit),
+	m_start(millis()), m_waitMs(waitMs), m_isResync(epoch != feed.getEpoch()), m_isReady(false), m_offset(0)
+{
+	if (m_isResync)
+		m_since = feed.getLatest();
+}
+
+size_t srv::ChangePoll::read(uint8_t* buffer, size_t maxLen)
+{
+	if (!m_isReady)
+	{
+		try
+		{
+			DatabaseLock lock(m_statements.getMutex());
+			if (!poll())
+				return RESPONSE_TRY_AGAIN; // asked again on the connection's next ACK or poll
+		}
+		catch (const std::exception& e)
+		{
+			log_e("Change poll failed: %s", e.what());
+			return 0;
+		}
+		serialize();
+		m_isReady = true;
+	}
+
+	const size_t count = std::min(maxLen, m_body.size() - m_offset);
+	std::memcpy(buffer, m_body.data() + m_offset, count);
+	m_offset += count;
+	return count;
+}
+
+bool srv::ChangePoll::poll()
+{
+	if (m_isResync)
+		return true;
+
+	std::vector<ChangeFeed::Change> changes;
+	if (!m_feed.read(m_since, m_limit - m_visible.size(), changes))
+	{
+		m_isResync = true;
+		m_visible.clear();
+		m_since = m_feed.getLatest();
+		return true;
+	}
+
+	for (const ChangeFeed::Change& change : changes)
+	{
+		m_since = change.seq;
+		if (isVisible(change))
+			m_visible.push_back(change);
+	}
+
+	return !m_visible.empty() || millis() - m_start >= m_waitMs;
+}
+
+bool srv::ChangePoll::isVisible(const ChangeFeed::Change& change)
+{
+	// Deleted entries can no longer be resolved, so rights are judged on the directory they lived in
+	const std::int64_t fileID = change.operation == ChangeFeed::Operation::Delete && change.parentID ? change.parentID : change.fileID;
+	return m_permissions.hasPermission(m_userID, fileID, PermissionCache::Read);
+}
+
+void srv::ChangePoll::serialize()
+{
+	JsonDocument doc;
+	JsonArray data = doc["data"].to<JsonArray>();
+	for (const ChangeFeed::Change& change : m_visible)
+	{
+		JsonObject obj = data.add<JsonObject>();
+		obj["seq"] = change.seq;
+		obj["id"] = change.fileID;
+		obj["parentID"] = change.parentID;
+		obj["op"] = ChangeFeed::toString(change.operation);
+	}
+	doc["epoch"] = m_feed.getEpoch();
+	doc["next"] = m_since;
+	doc["resync"] = m_isResync;
+	serializeJson(doc, m_body);
+}
@@ -0,0 +1,101 @@
+// ChangeFeed.h
+
+#ifndef _ChangeFeed_h
+#define _ChangeFeed_h
+
+#if defined(ARDUINO) && ARDUINO >= 100
+#include "arduino.h"
+#else
+#include "WProgram.h"
+#endif
+
+#include "StatementCache.h"
+#include "PreupdateHook.h"
+#include "PermissionCache.h"
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace srv {
+	class ChangeFeed;
+	class ChangePoll;
+}
+
+// Bounded in-memory log of FileEntries changes with a monotonically increasing sequence number, fed by
+// the preupdate hook. Sequence numbers restart each boot under a new random epoch; a client whose cursor
+// predates the oldest retained change, or another epoch, is told to resync with a full listing.
+// Changes are logged before their transaction commits, so a rolled-back change can appear; clients
+// re-fetch the entry either way.
+class srv::ChangeFeed
+{
+public:
+	enum class Operation : std::uint8_t
+	{
+		Create,
+		Update,
+		Delete
+	};
+
+	struct Change
+	{
+		std::uint64_t seq;
+		std::int64_t fileID;
+		std::int64_t parentID; // the previous parent for deletes and moves
+		Operation operation;
+	};
+
+	static constexpr size_t DefaultCapacity = 512;
+
+	explicit ChangeFeed(size_t capacity = DefaultCapacity);
+
+	void onRowChange(const RowChange& change);
+
+	std::uint32_t getEpoch() const { return m_epoch; }
+	std::uint64_t getLatest() const { return m_seq; }
+	bool read(std::uint64_t since, size_t limit, std::vector<Change>& changes) const; // false if truncated
+
+	static const char* toString(Operation operation);
+
+private:
+	std::vector<Change> m_ring;
+	size_t m_capacity;
+	size_t m_head; // next slot to overwrite once full
+	std::uint64_t m_seq;
+	std::uint32_t m_epoch;
+
+	void append(std::int64_t fileID, std::int64_t parentID, Operation operation);
+};
+
+// One GET /api/changes request: waits until a change the user may see arrives or the deadline passes,
+// then produces {"data":[...],"epoch":..,"next":..,"resync":..}. AwsResponseFiller like DirectoryListing.
+class srv::ChangePoll
+{
+public:
+	ChangePoll(StatementCache& statements, PermissionCache& permissions, ChangeFeed& feed, std::int64_t userID,
+		std::optional<std::uint32_t> epoch, std::uint64_t since, size_t limit, std::uint32_t waitMs);
+
+	size_t read(uint8_t* buffer, size_t maxLen);
+
+private:
+	StatementCache& m_statements;
+	PermissionCache& m_permissions;
+	ChangeFeed& m_feed;
+	std::int64_t m_userID;
+	std::uint64_t m_since;
+	size_t m_limit;
+	std::uint32_t m_start;
+	std::uint32_t m_waitMs;
+	bool m_isResync;
+	bool m_isReady;
+	std::vector<ChangeFeed::Change> m_visible;
+
+	std::string m_body;
+	size_t m_offset;
+
+	bool poll(); // true once the response can be written
+	bool isVisible(const ChangeFeed::Change& change);
+	void serialize();
+};
+
+#endif
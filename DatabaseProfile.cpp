@@ -0,0 +1,28 @@
+// 
+// 
+// 
+
+#include "DatabaseProfile.h"
+#include <string>
+
+void applyDatabaseProfile(SQLite::DbConnection& db, DatabaseProfile profile)
+{
+	if (profile == DatabaseProfile::Default)
+		return;
+
+	// Exclusive locking lets WAL keep its index in heap memory, as there is no shared memory to map on the SD card.
+	// Only this process ever opens the database.
+	db.prepare("PRAGMA locking_mode = EXCLUSIVE").evaluate();
+
+	auto journalMode = db.prepare("PRAGMA journal_mode = WAL");
+	journalMode.evaluate();
+	if (journalMode.getColumnValue<std::string>(0) != "wal")
+	{
+		// WAL compiled out: truncating the journal still avoids a directory update per commit
+		db.prepare("PRAGMA journal_mode = TRUNCATE").evaluate();
+	}
+
+	db.prepare("PRAGMA synchronous = NORMAL").evaluate();
+	db.prepare("PRAGMA cache_size = -128").evaluate(); // KiB
+	db.prepare("PRAGMA temp_store = MEMORY").evaluate();
+}
@@ -0,0 +1,22 @@
+// DatabaseProfile.h
+
+#ifndef _DatabaseProfile_h
+#define _DatabaseProfile_h
+
+#if defined(ARDUINO) && ARDUINO >= 100
+#include "arduino.h"
+#else
+#include "WProgram.h"
+#endif
+
+#include "SQLiteError.h"
+
+enum class DatabaseProfile
+{
+	Default, // SQLite defaults: rollback journal, synchronous = FULL
+	SDCardPerformance // WAL under exclusive locking, synchronous = NORMAL, larger page cache, in-memory temp store
+};
+
+void applyDatabaseProfile(SQLite::DbConnection& db, DatabaseProfile profile);
+
+#endif
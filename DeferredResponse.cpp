@@ -0,0 +1,74 @@
+// 
+// 
+// 
+
+#include "DeferredResponse.h"
+#include "ServerError.h"
+
+void srv::DeferredResponse::Result::send(int code, const String& contentType, const String& content)
+{
+	m_code = code;
+	m_contentType = contentType;
+	m_content = content;
+	m_isReady = true;
+}
+
+void srv::DeferredResponse::Result::sendCurrentException()
+{
+	JsonDocument doc;
+	const int code = describeCurrentException(doc["error"].to<JsonObject>());
+	m_metrics.recordError(doc["error"]["domain"].as<const char*>());
+	doc.shrinkToFit();
+	String response;
+	serializeJson(doc, response);
+	send(code, "application/json", response);
+}
+
+void srv::DeferredResponse::Result::run(const std::function<void(Result&)>& job)
+{
+	try
+	{
+		job(*this);
+		if (!m_isReady)
+			send(200);
+	}
+	catch (...)
+	{
+		sendCurrentException();
+	}
+}
+
+srv::DeferredResponse::DeferredResponse(std::shared_ptr<Result> result)
+	:m_result(std::move(result)), m_response(nullptr)
+{
+}
+
+srv::DeferredResponse::~DeferredResponse()
+{
+	delete m_response;
+}
+
+void srv::DeferredResponse::_respond(AsyncWebServerRequest* request)
+{
+	startIfReady(request);
+}
+
+size_t srv::DeferredResponse::_ack(AsyncWebServerRequest* request, size_t len, uint32_t time)
+{
+	if (!m_response)
+	{
+		startIfReady(request);
+		return 0;
+	}
+	return m_response->_ack(request, len, time);
+}
+
+bool srv::DeferredResponse::startIfReady(AsyncWebServerRequest* request)
+{
+	if (m_response || !m_result->isReady())
+		return false;
+
+	m_response = request->beginResponse(m_result->m_code, m_result->m_contentType, m_result->m_content);
+	m_response->_respond(request);
+	return true;
+}
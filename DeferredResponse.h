@@ -0,0 +1,65 @@
+// DeferredResponse.h
+
+#ifndef _DeferredResponse_h
+#define _DeferredResponse_h
+
+#if defined(ARDUINO) && ARDUINO >= 100
+#include "arduino.h"
+#else
+#include "WProgram.h"
+#endif
+
+#include "Metrics.h"
+#include <ESPAsyncWebServer.h>
+#include <atomic>
+#include <functional>
+#include <memory>
+
+namespace srv {
+	class DeferredResponse;
+}
+
+// Response handed to AsyncWebServer immediately but filled in later by a worker job. Nothing is written
+// until the result is ready; the connection's next ACK or poll then sends it as a normal basic response.
+class srv::DeferredResponse : public AsyncWebServerResponse
+{
+public:
+	class Result
+	{
+	public:
+		explicit Result(Metrics& metrics) : m_metrics(metrics) {}
+
+		void send(int code, const String& contentType = String(), const String& content = String());
+		void sendCurrentException(); // only from inside a catch block
+		void run(const std::function<void(Result&)>& job);
+
+		bool isReady() const { return m_isReady; }
+
+	private:
+		friend class DeferredResponse;
+
+		Metrics& m_metrics; // errors are counted by domain as they would be for a synchronous handler
+		std::atomic<bool> m_isReady{ false };
+		int m_code = 500;
+		String m_contentType;
+		String m_content;
+	};
+
+	explicit DeferredResponse(std::shared_ptr<Result> result);
+	~DeferredResponse();
+
+	void _respond(AsyncWebServerRequest* request) override;
+	size_t _ack(AsyncWebServerRequest* request, size_t len, uint32_t time) override;
+	bool _started() const override { return true; }
+	bool _finished() const override { return m_response && m_response->_finished(); }
+	bool _failed() const override { return m_response && m_response->_failed(); }
+	bool _sourceValid() const override { return true; }
+
+private:
+	std::shared_ptr<Result> m_result;
+	AsyncWebServerResponse* m_response;
+
+	bool startIfReady(AsyncWebServerRequest* request);
+};
+
+#endif
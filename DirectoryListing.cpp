@@ -0,0 +1,159 @@
+// 
+// 
+// 
+
+#include "DirectoryListing.h"
+#include <ArduinoJson.h>
+#include <algorithm>
+
+srv::DirectoryListing::DirectoryListing(StatementCache& statements, InodeCache& inodes, std::int64_t directoryID, const std::string& after, size_t limit)
+	:m_statements(statements), m_inodes(inodes), m_directoryID(directoryID), m_cursor(after), m_remaining(limit), m_state(State::Header),
+	m_isFirstEntry(true), m_isExhausted(false), m_pageIndex(0), m_pendingOffset(0)
+{
+	m_page.reserve(PageSize);
+}
+
+size_t srv::DirectoryListing::read(uint8_t* buffer, size_t maxLen)
+{
+	DatabaseLock lock(m_statements.getMutex()); // the filler runs outside the router's locked dispatch
+	try
+	{
+		size_t written = 0;
+		while (written < maxLen)
+		{
+			if (m_pendingOffset == m_pending.size())
+			{
+				m_pending.clear();
+				m_pendingOffset = 0;
+				refill();
+				if (m_pending.empty())
+					break;
+			}
+
+			const size_t count = std::min(maxLen - written, m_pending.size() - m_pendingOffset);
+			std::memcpy(buffer + written, m_pending.data() + m_pendingOffset, count);
+			m_pendingOffset += count;
+			written += count;
+		}
+		return written;
+	}
+	catch (const std::exception& e)
+	{
+		// Headers are already on the wire; the truncated body is the only signal left to the client
+		log_e("Directory listing of %lld failed: %s", m_directoryID, e.what());
+		m_state = State::Done;
+		return 0;
+	}
+}
+
+void srv::DirectoryListing::refill()
+{
+	switch (m_state)
+	{
+	case State::Header:
+		m_pending = "{\"data\":[";
+		m_state = State::Entries;
+		return;
+
+	case State::Entries:
+		if (m_remaining && m_pageIndex == m_page.size() && !m_isExhausted)
+			m_isExhausted = !fetchPage();
+
+		if (m_remaining && m_pageIndex < m_page.size())
+		{
+			const Row& row = m_page[m_pageIndex++];
+			appendEntry(row);
+			m_cursor = row.name;
+			--m_remaining;
+			return;
+		}
+
+		m_state = State::Footer;
+		[[fallthrough]];
+
+	case State::Footer:
+	{
+		JsonDocument next;
+		if (!m_remaining && hasMore())
+			next.set(m_cursor);
+
+		m_pending = "],\"next\":";
+		serializeJson(next, m_pending);
+		m_pending += '}';
+		m_state = State::Done;
+		return;
+	}
+
+	case State::Done:
+		return;
+	}
+}
+
+bool srv::DirectoryListing::fetchPage()
+{
+	m_page.clear();
+	m_pageIndex = 0;
+
+	CachedStatement statement = m_statements.prepare(
+		"SELECT ID, Name, OwnerID, DiskID IS NULL, Size, MTime FROM FileEntries "
+		"WHERE ParentID = ? AND Name > ? "
+		"AND ID NOT IN (SELECT FileID FROM BackgroundJobs WHERE Type = 'delete' AND State = 'running') "
+		"ORDER BY Name LIMIT ?"
+	);
+	statement.bind(1, m_directoryID);
+	statement.bind(2, m_cursor);
+	statement.bind(3, static_cast<std::int64_t>(std::min(PageSize, m_remaining)));
+
+	while (statement.evaluate())
+		m_page.push_back({
+			statement.getColumnValue<std::int64_t>(0),
+			statement.getColumnValue<std::string>(1),
+			statement.getColumnValue<std::int64_t>(2),
+			statement.getColumnValue<std::int64_t>(3) != 0,
+			statement.getColumnValue<std::int64_t>(4),
+			statement.getColumnValue<std::int64_t>(5)
+			});
+
+	return m_page.size() == std::min(PageSize, m_remaining);
+}
+
+bool srv::DirectoryListing::hasMore()
+{
+	CachedStatement statement = m_statements.prepare(
+		"SELECT 1 FROM FileEntries WHERE ParentID = ? AND Name > ? "
+		"AND ID NOT IN (SELECT FileID FROM BackgroundJobs WHERE Type = 'delete' AND State = 'running') LIMIT 1"
+	);
+	statement.bind(1, m_directoryID);
+	statement.bind(2, m_cursor);
+	return statement.evaluate();
+}
+
+void srv::DirectoryListing::appendEntry(const Row& row)
+{
+	JsonDocument doc;
+	doc["id"] = row.id;
+	doc["name"] = row.name;
+	doc["ownerID"] = row.ownerID;
+
+	doc["isDirectory"] = row.isDirectory;
+	if (!row.isDirectory && row.size >= 0 && row.lastModified >= 0)
+	{
+		doc["size"] = row.size;
+		doc["lastModified"] = row.lastModified;
+	}
+	else if (!row.isDirectory)
+	{
+		const InodeCache::Inode& inode = m_inodes.get(row.id);
+		File file = inode.disk->getFS().open(inode.path.c_str());
+		if (file)
+		{
+			doc["size"] = file.size();
+			doc["lastModified"] = file.getLastWrite();
+		}
+	}
+
+	if (!m_isFirstEntry)
+		m_pending += ',';
+	m_isFirstEntry = false;
+	serializeJson(doc, m_pending);
+}
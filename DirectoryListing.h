@@ -0,0 +1,75 @@
+// DirectoryListing.h
+
+#ifndef _DirectoryListing_h
+#define _DirectoryListing_h
+
+#if defined(ARDUINO) && ARDUINO >= 100
+#include "arduino.h"
+#else
+#include "WProgram.h"
+#endif
+
+#include "VFS.h"
+#include "StatementCache.h"
+#include "InodeCache.h"
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace srv {
+	class DirectoryListing;
+}
+
+// Produces the JSON listing of a directory incrementally, a small page of FileEntries rows at a time.
+// Pages are fetched by (ParentID, Name) keyset so no statement is held open between TCP sends. Sizes and
+// write times come from the rows; only files not yet stamped by srv::UsageTracker are opened on the card.
+class srv::DirectoryListing
+{
+public:
+	DirectoryListing(StatementCache& statements, InodeCache& inodes, std::int64_t directoryID, const std::string& after, size_t limit);
+
+	size_t read(uint8_t* buffer, size_t maxLen); // AwsResponseFiller
+
+private:
+	struct Row
+	{
+		std::int64_t id;
+		std::string name;
+		std::int64_t ownerID;
+		bool isDirectory;
+		std::int64_t size; // below zero while unknown
+		std::int64_t lastModified; // likewise
+	};
+
+	enum class State
+	{
+		Header,
+		Entries,
+		Footer,
+		Done
+	};
+
+	static constexpr size_t PageSize = 16;
+
+	StatementCache& m_statements;
+	InodeCache& m_inodes;
+	std::int64_t m_directoryID;
+	std::string m_cursor; // Name of the last row emitted
+	size_t m_remaining;
+	State m_state;
+	bool m_isFirstEntry;
+	bool m_isExhausted;
+
+	std::vector<Row> m_page;
+	size_t m_pageIndex;
+
+	std::string m_pending; // serialised bytes not yet handed to the response
+	size_t m_pendingOffset;
+
+	bool fetchPage();
+	bool hasMore();
+	void appendEntry(const Row& row);
+	void refill();
+};
+
+#endif
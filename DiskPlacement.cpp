@@ -0,0 +1,241 @@
+// 
+// 
+// 
+
+#include "DiskPlacement.h"
+#include "HTTPError.h"
+#include <esp_random.h>
+#include <algorithm>
+#include <stdexcept>
+
+srv::DiskPlacement::DiskPlacement(StatementCache& statements, vfs::Filesystem& vfs, UsageTracker& usage, Policy policy)
+	:m_statements(statements), m_vfs(vfs), m_usage(usage), m_policy(policy), m_lastRefresh(0), m_lastCalibration(0), m_next(0)
+{
+}
+
+void srv::DiskPlacement::addDisk(std::int64_t diskID)
+{
+	m_vfs.getDiskMap().getDiskByID(diskID); // throws if not mounted
+	m_disks.push_back(diskID);
+	m_freeBytes.push_back(0);
+	m_overhead.push_back(std::nullopt);
+
+	refreshFreeSpace(); // so uploads arriving before the first maintenance pass can be placed
+}
+
+std::int64_t srv::DiskPlacement::choose(std::uint64_t size)
+{
+	if (m_disks.empty())
+		throw std::runtime_error("No disks mounted");
+
+	if (m_policy == Policy::RoundRobin)
+	{
+		for (size_t i = 0; i < m_disks.size(); ++i)
+		{
+			const size_t index = (m_next + i) % m_disks.size();
+			if (m_freeBytes[index] > size)
+			{
+				m_next = index + 1;
+				m_freeBytes[index] -= size;
+				return m_disks[index];
+			}
+		}
+		throw HTTPError(507, "Insufficient storage");
+	}
+
+	std::uint64_t totalFree = 0;
+	for (std::uint64_t freeBytes : m_freeBytes)
+		if (freeBytes > size)
+			totalFree += freeBytes;
+	if (!totalFree)
+		throw HTTPError(507, "Insufficient storage");
+
+	std::uint64_t pick = ((static_cast<std::uint64_t>(esp_random()) << 32) | esp_random()) % totalFree;
+	for (size_t index = 0; index < m_disks.size(); ++index)
+	{
+		if (m_freeBytes[index] <= size)
+			continue;
+		if (pick < m_freeBytes[index])
+		{
+			m_freeBytes[index] -= size; // keeps a burst of uploads from all landing on the same stale figure
+			return m_disks[index];
+		}
+		pick -= m_freeBytes[index];
+	}
+	return m_disks.back();
+}
+
+void srv::DiskPlacement::runMaintenance()
+{
+	if (m_disks.empty() || millis() - m_lastRefresh < FreeSpaceRefreshInterval)
+		return;
+
+	refreshFreeSpace();
+}
+
+File srv::DiskPlacement::create(std::int64_t parentID, const std::string& name, std::uint64_t size, std::int64_t userID, std::int64_t diskID)
+{
+	Transaction transaction(m_statements);
+	File file = m_vfs.openFile(parentID, name, size, userID);
+	const std::int64_t fileID = findEntry(parentID, name);
+	m_usage.setSize(fileID, size);
+
+	CachedStatement current = m_statements.prepare("SELECT DiskID FROM FileEntries WHERE ID = ?");
+	current.bind(1, fileID);
+	current.evaluate();
+	if (current.getColumnValue<std::int64_t>(0) == diskID)
+	{
+		transaction.commit();
+		return file;
+	}
+
+	file.close();
+	m_vfs.getDisk(fileID).getFS().remove(m_vfs.getInternalPath(fileID).c_str());
+	assign(fileID, diskID);
+
+	fs::FS& fs = m_vfs.getDisk(fileID).getFS();
+	const std::string path = m_vfs.getInternalPath(fileID);
+	createParents(fs, path);
+	file = fs.open(path.c_str(), FILE_WRITE);
+	if (!file)
+		throw std::runtime_error("Failed to create file on disk " + std::to_string(diskID));
+
+	transaction.commit();
+	return file;
+}
+
+std::int64_t srv::DiskPlacement::findEntry(std::int64_t parentID, const std::string& name)
+{
+	CachedStatement statement = m_statements.prepare(
+		"SELECT ID FROM FileEntries WHERE ParentID = ? AND Name = ?"
+	);
+	statement.bind(1, parentID);
+	statement.bind(2, name);
+	if (!statement.evaluate())
+		throw std::runtime_error("Created file entry not found");
+	return statement.getColumnValue<std::int64_t>(0);
+}
+
+void srv::DiskPlacement::assign(std::int64_t fileID, std::int64_t diskID)
+{
+	CachedStatement statement = m_statements.prepare("UPDATE FileEntries SET DiskID = ? WHERE ID = ?");
+	statement.bind(1, diskID);
+	statement.bind(2, fileID);
+	statement.evaluate();
+}
+
+void srv::DiskPlacement::rename(std::int64_t fileID, const std::string& newName, std::int64_t userID)
+{
+	const std::string oldPath = m_vfs.getInternalPath(fileID);
+	m_vfs.renameFileEntry(fileID, newName, userID);
+	const std::string newPath = m_vfs.getInternalPath(fileID);
+	try
+	{
+		renameOnDisks(oldPath, newPath); // the VFS only renames on the entry's own disk
+	}
+	catch (...)
+	{
+		// Takes the VFS's own rename back too, so the row the caller rolls back still matches every disk
+		try
+		{
+			renameOnDisks(newPath, oldPath);
+		}
+		catch (const std::exception& e)
+		{
+			log_e("Failed to restore %s: %s", oldPath.c_str(), e.what());
+		}
+		throw;
+	}
+}
+
+void srv::DiskPlacement::move(std::int64_t fileID, std::int64_t parentID, const std::string& name)
+{
+	const std::string oldPath = m_vfs.getInternalPath(fileID);
+
+	Transaction transaction(m_statements);
+	CachedStatement statement = m_statements.prepare("UPDATE FileEntries SET ParentID = ?, Name = ? WHERE ID = ?");
+	statement.bind(1, parentID);
+	statement.bind(2, name);
+	statement.bind(3, fileID);
+	statement.evaluate();
+
+	const std::string newPath = m_vfs.getInternalPath(fileID);
+	if (oldPath != newPath && !renameOnDisks(oldPath, newPath))
+		throw std::runtime_error("Failed to move file on disk");
+	transaction.commit();
+}
+
+bool srv::DiskPlacement::renameOnDisks(const std::string& oldPath, const std::string& newPath)
+{
+	std::vector<fs::FS*> visited;
+	std::vector<fs::FS*> renamed;
+	for (std::int64_t diskID : m_disks)
+	{
+		fs::FS& fs = m_vfs.getDiskMap().getDiskByID(diskID).getFS();
+		if (std::find(visited.begin(), visited.end(), &fs) != visited.end())
+			continue;
+		visited.push_back(&fs);
+
+		if (!fs.exists(oldPath.c_str()))
+			continue;
+
+		createParents(fs, newPath);
+		if (!fs.rename(oldPath.c_str(), newPath.c_str()))
+		{
+			// The disks already done are put back, since the caller's rollback only restores the row
+			for (fs::FS* done : renamed)
+				if (!done->rename(newPath.c_str(), oldPath.c_str()))
+					log_e("Failed to restore %s after a failed rename", oldPath.c_str());
+			throw std::runtime_error("Failed to rename " + oldPath + " on disk " + std::to_string(diskID));
+		}
+		renamed.push_back(&fs);
+	}
+	return !renamed.empty();
+}
+
+void srv::DiskPlacement::refreshFreeSpace()
+{
+	// Until every file has a known size the counters fall short, so the FAT is scanned as before
+	const bool isSettled = m_usage.isSettled();
+	const bool isCalibrating = !isSettled || millis() - m_lastCalibration >= OverheadRefreshInterval;
+
+	// The FAT scans can take seconds on a large card, so they run before the lock is taken and only the
+	// results are published under it. m_overhead is only written from this task.
+	std::vector<std::uint64_t> totals(m_disks.size());
+	std::vector<std::optional<std::uint64_t>> scanned(m_disks.size());
+	for (size_t i = 0; i < m_disks.size(); ++i)
+	{
+		const vfs::Disk& disk = m_vfs.getDiskMap().getDiskByID(m_disks[i]);
+		totals[i] = disk.getTotalBytes();
+		if (isCalibrating || !m_overhead[i])
+			scanned[i] = disk.getUsedBytes();
+	}
+
+	DatabaseLock lock(m_statements.getMutex());
+	for (size_t i = 0; i < m_disks.size(); ++i)
+	{
+		const std::uint64_t counted = m_usage.getDiskUsed(m_disks[i]);
+
+		std::uint64_t used;
+		if (scanned[i])
+		{
+			used = *scanned[i];
+			if (isSettled)
+				m_overhead[i] = used > counted ? used - counted : 0;
+		}
+		else
+			used = counted + *m_overhead[i];
+
+		m_freeBytes[i] = totals[i] > used ? totals[i] - used : 0;
+	}
+
+	if (isCalibrating && m_usage.isSettled())
+		m_lastCalibration = millis();
+	m_lastRefresh = millis();
+}
+
+void srv::DiskPlacement::createParents(fs::FS& fs, const std::string& path)
+{
+	for (size_t slash = path.find('/', 1); slash != std::string::npos; slash = path.find('/', slash + 1))
+		fs.mkdir(path.substr(0, slash).c_str());
+}
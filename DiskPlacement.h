@@ -0,0 +1,77 @@
+// DiskPlacement.h
+
+#ifndef _DiskPlacement_h
+#define _DiskPlacement_h
+
+#if defined(ARDUINO) && ARDUINO >= 100
+#include "arduino.h"
+#else
+#include "WProgram.h"
+#endif
+
+#include "VFS.h"
+#include "StatementCache.h"
+#include "UsageTracker.h"
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace srv {
+	class DiskPlacement;
+}
+
+// Chooses the disk for each new file among the mounted disks and points its FileEntries row there.
+// vfs::Filesystem::openFile always creates on the parent's disk, so a new entry is moved while still empty.
+// Internal paths follow the ParentID chain on every disk, so a directory holding files on several disks
+// exists on each of them; renames and moves go through here to keep those copies in step. Free space comes
+// from the usage counters plus a per-disk overhead for untracked data (the database, the web interface),
+// which is measured by a full FAT scan only every OverheadRefreshInterval. Figures are refreshed from loop(),
+// with the scans run outside the database lock, so choose() never touches a disk and only reads, then debits,
+// the cached free space.
+class srv::DiskPlacement
+{
+public:
+	enum class Policy
+	{
+		FreeSpaceWeighted, // spreads data in proportion to free space
+		RoundRobin // spreads concurrent transfers evenly across disks
+	};
+
+	static constexpr std::uint32_t FreeSpaceRefreshInterval = 5000; // ms
+	static constexpr std::uint32_t OverheadRefreshInterval = 10 * 60 * 1000; // ms; used bytes are a FAT scan on some cards
+
+	DiskPlacement(StatementCache& statements, vfs::Filesystem& vfs, UsageTracker& usage, Policy policy = Policy::FreeSpaceWeighted);
+
+	void addDisk(std::int64_t diskID);
+	void setPolicy(Policy policy) { m_policy = policy; }
+	const std::vector<std::int64_t>& getDisks() const { return m_disks; }
+
+	std::int64_t choose(std::uint64_t size); // throws HTTPError 507 when no disk has room
+	void runMaintenance(); // from loop(); refreshes free space once FreeSpaceRefreshInterval has passed
+	File create(std::int64_t parentID, const std::string& name, std::uint64_t size, std::int64_t userID, std::int64_t diskID); // size is recorded until the data is written
+	std::int64_t findEntry(std::int64_t parentID, const std::string& name);
+	void assign(std::int64_t fileID, std::int64_t diskID); // the caller moves any existing data
+
+	void rename(std::int64_t fileID, const std::string& newName, std::int64_t userID);
+	void move(std::int64_t fileID, std::int64_t parentID, const std::string& name); // name may be the current one
+
+	static void createParents(fs::FS& fs, const std::string& path);
+
+private:
+	StatementCache& m_statements;
+	vfs::Filesystem& m_vfs;
+	UsageTracker& m_usage;
+	Policy m_policy;
+	std::vector<std::int64_t> m_disks;
+	std::vector<std::uint64_t> m_freeBytes;
+	std::vector<std::optional<std::uint64_t>> m_overhead; // bytes on each disk outside tracked files
+	std::uint32_t m_lastRefresh;
+	std::uint32_t m_lastCalibration;
+	size_t m_next;
+
+	void refreshFreeSpace(); // takes the database lock itself, after any FAT scan
+	bool renameOnDisks(const std::string& oldPath, const std::string& newPath); // all or nothing; false when no disk holds oldPath
+};
+
+#endif
@@ -5,6 +5,7 @@
 */
 
 #include "ServerImpl.h"
+#include "DatabaseProfile.h"
 #include <WiFi.h>
 #include <SD.h>
 #include <ESPmDNS.h>
@@ -15,7 +16,10 @@ const std::string publicKeyPath = "/sd/jwt_key.pub.pem";
 
 std::unique_ptr<srv::Server> server;
 std::unique_ptr<vfs::Filesystem> filesystem;
+std::unique_ptr<srv::PreupdateHook> preupdateHook;
 std::unique_ptr<Authentication> auth;
+std::unique_ptr<srv::WorkerPool> workers;
+std::unique_ptr<srv::Metrics> metrics;
 std::unique_ptr<SQLite::DbConnection> db;
 
 // the setup function runs once when you press reset or power the board
@@ -28,9 +32,6 @@ void setup()
 		if (!SD.begin(SS, SPI, 80000000))
 			throw std::runtime_error("SD card initialization failed");
 
-		if (SD.exists("/nas.db"))
-			SD.remove("/nas.db");
-
 		if (!WiFi.softAP("ESP32_NAS"))
 			throw std::runtime_error("WiFi initialization failed");
 
@@ -38,21 +39,26 @@ void setup()
 			throw std::runtime_error("mDNS initialization failed");
 
 		db = std::make_unique<SQLite::DbConnection>("/sd/nas.db");
-		initialiseDatabase(*db);
+		initialiseDatabase(*db, DatabaseProfile::SDCardPerformance);
 
 		filesystem = std::make_unique<vfs::Filesystem>(*db);
-		db->beforeRowUpdate<vfs::Filesystem>(vfs::Filesystem::preupdateCallback, *filesystem);
+		preupdateHook = std::make_unique<srv::PreupdateHook>(*filesystem);
+		db->beforeRowUpdate<srv::PreupdateHook>(srv::PreupdateHook::callback, *preupdateHook);
 		vfs::Disk disk(SD, "/sd", std::bind(&SDFS::totalBytes, &SD), std::bind(&SDFS::usedBytes, &SD));
 		filesystem->getDiskMap().mountDisk(0, disk);
 
 		auth = std::make_unique<Authentication>(*db, std::bind(&vfs::Filesystem::createRootDirectoryEntry, filesystem.get(), std::placeholders::_1));
 
-		server = std::make_unique<srv::Server>(*filesystem, *auth, privateKeyPath, publicKeyPath);
+		metrics = std::make_unique<srv::Metrics>();
+		workers = std::make_unique<srv::WorkerPool>(*metrics, 2 /*tasks*/, 8 /*queued jobs*/);
+		server = std::make_unique<srv::Server>(*db, *filesystem, *auth, *preupdateHook, *workers, *metrics, privateKeyPath, publicKeyPath);
+		// Further disks are mounted in the VFS the same way, then registered with server->addDisk(id)
+		server->setPlacementPolicy(srv::DiskPlacement::Policy::FreeSpaceWeighted);
 
 		if (!MDNS.addService("http", "tcp", 80))
 			throw std::runtime_error("Failed to add mDNS service");
 
-		Serial.println("DOne");
+		Serial.printf("Ready for requests %lu ms after boot\n", millis());
 	}
 	catch (const std::exception& e)
 	{
@@ -63,11 +69,15 @@ void setup()
 // the loop function runs over and over again until power down or reset
 void loop()
 {
-
+	if (server)
+		server->runMaintenance();
+	delay(20);
 }
 
-void initialiseDatabase(SQLite::DbConnection& db)
+void initialiseDatabase(SQLite::DbConnection& db, DatabaseProfile profile)
 {
+	applyDatabaseProfile(db, profile);
+
 	db.prepare(
 		"PRAGMA foreign_keys = ON"
 	).evaluate();
@@ -113,4 +123,269 @@ void initialiseDatabase(SQLite::DbConnection& db)
 		"FOREIGN KEY (FileID) REFERENCES FileEntries(ID) ON DELETE CASCADE"
 		")"
 	).evaluate();
+
+	db.prepare(
+		"CREATE TABLE IF NOT EXISTS UploadSessions ("
+		"ID INTEGER PRIMARY KEY AUTOINCREMENT,"
+		"OwnerID INTEGER NOT NULL,"
+		"ParentID INTEGER NOT NULL,"
+		"Name TEXT NOT NULL,"
+		"Size INTEGER NOT NULL,"
+		"DiskID INTEGER NOT NULL,"
+
+		"FOREIGN KEY (OwnerID) REFERENCES Users(ID) ON DELETE CASCADE,"
+		"FOREIGN KEY (ParentID) REFERENCES FileEntries(ID) ON DELETE CASCADE"
+		")"
+	).evaluate();
+
+	db.prepare(
+		"CREATE TABLE IF NOT EXISTS UploadChunks ("
+		"SessionID INTEGER NOT NULL,"
+		"Offset INTEGER NOT NULL,"
+		"Length INTEGER NOT NULL,"
+
+		"PRIMARY KEY (SessionID, Offset),"
+		"FOREIGN KEY (SessionID) REFERENCES UploadSessions(ID) ON DELETE CASCADE"
+		")"
+	).evaluate();
+
+	db.prepare(
+		"CREATE TABLE IF NOT EXISTS BackgroundJobs ("
+		"ID INTEGER PRIMARY KEY AUTOINCREMENT,"
+		"Type TEXT NOT NULL,"
+		"OwnerID INTEGER NOT NULL,"
+		"FileID INTEGER NOT NULL,"
+		"TargetID INTEGER NOT NULL DEFAULT 0,"
+		"Total INTEGER NOT NULL,"
+		"Done INTEGER NOT NULL DEFAULT 0,"
+		"State TEXT NOT NULL,"
+		"Error TEXT NOT NULL DEFAULT '',"
+
+		"FOREIGN KEY (OwnerID) REFERENCES Users(ID) ON DELETE CASCADE"
+		")"
+	).evaluate();
+
+	db.prepare(
+		"CREATE INDEX IF NOT EXISTS BackgroundJobsFileID ON BackgroundJobs (FileID)"
+	).evaluate();
+
+	// Entries reached by a copy or relocate job; IsDirectory, Done and Cursor are added by the version 3 migration
+	db.prepare(
+		"CREATE TABLE IF NOT EXISTS CopyEntries ("
+		"JobID INTEGER NOT NULL,"
+		"SourceID INTEGER NOT NULL,"
+		"CopyID INTEGER NOT NULL,"
+		"DiskID INTEGER NOT NULL,"
+		"Size INTEGER NOT NULL DEFAULT 0,"
+		"Copied INTEGER NOT NULL DEFAULT 0,"
+
+		"PRIMARY KEY (JobID, SourceID),"
+		"FOREIGN KEY (JobID) REFERENCES BackgroundJobs(ID) ON DELETE CASCADE"
+		")"
+	).evaluate();
+
+	// Stack of directories a delete job is emptying, deepest on top
+	db.prepare(
+		"CREATE TABLE IF NOT EXISTS DeleteEntries ("
+		"JobID INTEGER NOT NULL,"
+		"Depth INTEGER NOT NULL,"
+		"FileID INTEGER NOT NULL,"
+
+		"PRIMARY KEY (JobID, Depth),"
+		"FOREIGN KEY (JobID) REFERENCES BackgroundJobs(ID) ON DELETE CASCADE"
+		") WITHOUT ROWID"
+	).evaluate();
+
+	// One row per directory that has had children; MTime and Size are -1 until first recorded
+	db.prepare(
+		"CREATE TABLE IF NOT EXISTS ScanCheckpoints ("
+		"FileID INTEGER PRIMARY KEY,"
+		"MTime INTEGER NOT NULL DEFAULT -1,"
+		"Size INTEGER NOT NULL DEFAULT -1,"
+		"Dirty INTEGER NOT NULL DEFAULT 1"
+		")"
+	).evaluate();
+
+	// No foreign key: a cascaded child delete would reference a parent already removed in the same statement
+	db.prepare(
+		"CREATE TRIGGER IF NOT EXISTS FileEntriesInsertCheckpoint AFTER INSERT ON FileEntries "
+		"BEGIN "
+		"INSERT OR IGNORE INTO ScanCheckpoints (FileID) SELECT ID FROM FileEntries WHERE ID = NEW.ParentID;"
+		"UPDATE ScanCheckpoints SET Dirty = 1 WHERE FileID = NEW.ParentID;"
+		"END"
+	).evaluate();
+
+	db.prepare(
+		"CREATE TRIGGER IF NOT EXISTS FileEntriesDeleteCheckpoint AFTER DELETE ON FileEntries "
+		"BEGIN "
+		"DELETE FROM ScanCheckpoints WHERE FileID = OLD.ID;"
+		"UPDATE ScanCheckpoints SET Dirty = 1 WHERE FileID = OLD.ParentID;"
+		"END"
+	).evaluate();
+
+	db.prepare(
+		"CREATE TRIGGER IF NOT EXISTS FileEntriesMoveCheckpoint AFTER UPDATE OF ParentID, Name ON FileEntries "
+		"BEGIN "
+		"INSERT OR IGNORE INTO ScanCheckpoints (FileID) SELECT ID FROM FileEntries WHERE ID = NEW.ParentID;"
+		"UPDATE ScanCheckpoints SET Dirty = 1 WHERE FileID IN (OLD.ParentID, NEW.ParentID);"
+		"END"
+	).evaluate();
+
+	// Filled and kept current by srv::SearchIndex; no foreign key for the same reason as ScanCheckpoints
+	db.prepare(
+		"CREATE TABLE IF NOT EXISTS FileNameTrigrams ("
+		"Trigram INTEGER NOT NULL,"
+		"FileID INTEGER NOT NULL,"
+
+		"PRIMARY KEY (Trigram, FileID)"
+		") WITHOUT ROWID"
+	).evaluate();
+
+	db.prepare(
+		"CREATE INDEX IF NOT EXISTS FileNameTrigramsFileID ON FileNameTrigrams (FileID)"
+	).evaluate();
+
+	// One row, the last FileEntries ID indexed by the initial build, or -1 once it has completed
+	db.prepare(
+		"CREATE TABLE IF NOT EXISTS SearchIndexRebuild ("
+		"Cursor INTEGER NOT NULL"
+		")"
+	).evaluate();
+
+	std::int64_t userVersion;
+	{
+		auto version = db.prepare("PRAGMA user_version");
+		version.evaluate();
+		userVersion = version.getColumnValue<std::int64_t>(0);
+	}
+
+	// Each step commits together with its user_version, so a reset part way through repeats the whole step
+	// on the next boot instead of finding a column already added
+	if (userVersion < 1)
+	{
+		// Databases created before checkpoints existed get every directory checked once
+		db.prepare("BEGIN").evaluate();
+		db.prepare(
+			"INSERT OR IGNORE INTO ScanCheckpoints (FileID) "
+			"SELECT DISTINCT ParentID FROM FileEntries WHERE ParentID IS NOT NULL"
+		).evaluate();
+		db.prepare("PRAGMA user_version = 1").evaluate();
+		db.prepare("COMMIT").evaluate();
+	}
+
+	if (userVersion < 2)
+	{
+		// Files stored before usage accounting are measured in the background by srv::UsageTracker
+		db.prepare("BEGIN").evaluate();
+		db.prepare(
+			"ALTER TABLE FileEntries ADD COLUMN Size INTEGER NOT NULL DEFAULT 0"
+		).evaluate();
+		db.prepare("UPDATE FileEntries SET Size = -1").evaluate();
+		db.prepare("PRAGMA user_version = 2").evaluate();
+		db.prepare("COMMIT").evaluate();
+	}
+
+	if (userVersion < 3)
+	{
+		// Copy jobs find pending rows by index; rows of jobs already running are classified from their source
+		db.prepare("BEGIN").evaluate();
+		db.prepare("ALTER TABLE CopyEntries ADD COLUMN IsDirectory INTEGER NOT NULL DEFAULT 0").evaluate();
+		db.prepare("ALTER TABLE CopyEntries ADD COLUMN Done INTEGER NOT NULL DEFAULT 0").evaluate();
+		db.prepare("ALTER TABLE CopyEntries ADD COLUMN Cursor TEXT NOT NULL DEFAULT ''").evaluate();
+		db.prepare(
+			"UPDATE CopyEntries SET IsDirectory = IFNULL((SELECT f.DiskID IS NULL FROM FileEntries f WHERE f.ID = SourceID), 0)"
+		).evaluate();
+		db.prepare("UPDATE CopyEntries SET Done = 1 WHERE IsDirectory = 0 AND Copied >= Size").evaluate();
+		db.prepare("PRAGMA user_version = 3").evaluate();
+		db.prepare("COMMIT").evaluate();
+	}
+
+	if (userVersion < 4)
+	{
+		// Last chunk received, in Unix seconds; sessions already open start their timeout now
+		db.prepare("BEGIN").evaluate();
+		db.prepare("ALTER TABLE UploadSessions ADD COLUMN UpdatedAt INTEGER NOT NULL DEFAULT 0").evaluate();
+		db.prepare("UPDATE UploadSessions SET UpdatedAt = strftime('%s', 'now')").evaluate();
+		db.prepare("PRAGMA user_version = 4").evaluate();
+		db.prepare("COMMIT").evaluate();
+	}
+
+	if (userVersion < 5)
+	{
+		// Last write in Unix seconds, so listings need not open every file; srv::UsageTracker stamps existing files
+		db.prepare("BEGIN").evaluate();
+		db.prepare("ALTER TABLE FileEntries ADD COLUMN MTime INTEGER NOT NULL DEFAULT -1").evaluate();
+		db.prepare("PRAGMA user_version = 5").evaluate();
+		db.prepare("COMMIT").evaluate();
+	}
+
+	db.prepare(
+		"CREATE INDEX IF NOT EXISTS CopyEntriesPending ON CopyEntries (JobID, Done, IsDirectory)"
+	).evaluate();
+
+	// Only holds files still waiting for srv::UsageTracker to measure them, so it is empty once the backfill is done
+	db.prepare(
+		"CREATE INDEX IF NOT EXISTS FileEntriesUnsized ON FileEntries (ID) WHERE Size < 0"
+	).evaluate();
+	db.prepare(
+		"CREATE INDEX IF NOT EXISTS FileEntriesUnstamped ON FileEntries (ID) WHERE MTime < 0 AND DiskID IS NOT NULL"
+	).evaluate();
+
+	// Running totals of FileEntries.Size; no foreign keys for the same reason as ScanCheckpoints
+	db.prepare(
+		"CREATE TABLE IF NOT EXISTS DiskUsage ("
+		"DiskID INTEGER PRIMARY KEY,"
+		"UsedBytes INTEGER NOT NULL DEFAULT 0"
+		")"
+	).evaluate();
+
+	// Quota is -1 for the server's default
+	db.prepare(
+		"CREATE TABLE IF NOT EXISTS UserUsage ("
+		"UserID INTEGER PRIMARY KEY,"
+		"UsedBytes INTEGER NOT NULL DEFAULT 0,"
+		"Quota INTEGER NOT NULL DEFAULT -1"
+		")"
+	).evaluate();
+
+	db.prepare(
+		"CREATE TRIGGER IF NOT EXISTS FileEntriesInsertUsage AFTER INSERT ON FileEntries "
+		"WHEN NEW.Size > 0 "
+		"BEGIN "
+		"INSERT OR IGNORE INTO DiskUsage (DiskID) SELECT NEW.DiskID WHERE NEW.DiskID IS NOT NULL;"
+		"UPDATE DiskUsage SET UsedBytes = UsedBytes + NEW.Size WHERE DiskID = NEW.DiskID;"
+		"INSERT OR IGNORE INTO UserUsage (UserID) VALUES (NEW.OwnerID);"
+		"UPDATE UserUsage SET UsedBytes = UsedBytes + NEW.Size WHERE UserID = NEW.OwnerID;"
+		"END"
+	).evaluate();
+
+	db.prepare(
+		"CREATE TRIGGER IF NOT EXISTS FileEntriesDeleteUsage AFTER DELETE ON FileEntries "
+		"WHEN OLD.Size > 0 "
+		"BEGIN "
+		"UPDATE DiskUsage SET UsedBytes = UsedBytes - OLD.Size WHERE DiskID = OLD.DiskID;"
+		"UPDATE UserUsage SET UsedBytes = UsedBytes - OLD.Size WHERE UserID = OLD.OwnerID;"
+		"END"
+	).evaluate();
+
+	// Sizes below zero are still unknown and count as nothing
+	db.prepare(
+		"CREATE TRIGGER IF NOT EXISTS FileEntriesUpdateUsage AFTER UPDATE OF Size, DiskID, OwnerID ON FileEntries "
+		"WHEN MAX(OLD.Size, 0) > 0 OR MAX(NEW.Size, 0) > 0 "
+		"BEGIN "
+		"UPDATE DiskUsage SET UsedBytes = UsedBytes - MAX(OLD.Size, 0) WHERE DiskID = OLD.DiskID;"
+		"UPDATE UserUsage SET UsedBytes = UsedBytes - MAX(OLD.Size, 0) WHERE UserID = OLD.OwnerID;"
+		"INSERT OR IGNORE INTO DiskUsage (DiskID) SELECT NEW.DiskID WHERE NEW.DiskID IS NOT NULL;"
+		"UPDATE DiskUsage SET UsedBytes = UsedBytes + MAX(NEW.Size, 0) WHERE DiskID = NEW.DiskID;"
+		"INSERT OR IGNORE INTO UserUsage (UserID) VALUES (NEW.OwnerID);"
+		"UPDATE UserUsage SET UsedBytes = UsedBytes + MAX(NEW.Size, 0) WHERE UserID = NEW.OwnerID;"
+		"END"
+	).evaluate();
+
+	db.prepare(
+		"CREATE TRIGGER IF NOT EXISTS UsersDeleteUsage AFTER DELETE ON Users "
+		"BEGIN "
+		"DELETE FROM UserUsage WHERE UserID = OLD.ID;"
+		"END"
+	).evaluate();
 }
@@ -0,0 +1,266 @@
+// 
+// 
+// 
+
+#include "FileCopy.h"
+#include <algorithm>
+#include <stdexcept>
+#include <vector>
+
+srv::FileCopy::FileCopy(StatementCache& statements, vfs::Filesystem& vfs, InodeCache& inodes, DiskPlacement& placement, UsageTracker& usage, BufferPool& buffers, JobManager& jobs, Metrics& metrics)
+	:m_statements(statements), m_vfs(vfs), m_inodes(inodes), m_placement(placement), m_usage(usage), m_buffers(buffers), m_jobs(jobs), m_metrics(metrics)
+{
+	m_jobs.registerType(CopyJobType, [this](JobManager::Job& job) { return step(job); });
+	m_jobs.registerType(RelocateJobType, [this](JobManager::Job& job) { return step(job); });
+}
+
+std::int64_t srv::FileCopy::copy(std::int64_t sourceID, std::int64_t parentID, const std::string& name, std::int64_t userID, std::optional<std::int64_t> diskID)
+{
+	if (diskID)
+		m_vfs.getDiskMap().getDiskByID(*diskID); // throws if not mounted
+
+	Transaction transaction(m_statements);
+	const Entry root = addEntry(CopyJobType, userID, sourceID, parentID, name, diskID.value_or(-1));
+	const std::int64_t jobID = m_jobs.start(CopyJobType, userID, sourceID, parentID, root.size);
+	record(jobID, sourceID, root);
+	transaction.commit();
+	return jobID;
+}
+
+std::int64_t srv::FileCopy::relocate(std::int64_t fileID, std::int64_t diskID, std::int64_t userID)
+{
+	m_vfs.getDiskMap().getDiskByID(diskID); // throws if not mounted
+
+	Transaction transaction(m_statements);
+	const Entry root = addEntry(RelocateJobType, userID, fileID, 0, std::string(), diskID);
+	const std::int64_t jobID = m_jobs.start(RelocateJobType, userID, fileID, diskID, root.size);
+	record(jobID, fileID, root);
+	transaction.commit();
+	return jobID;
+}
+
+bool srv::FileCopy::step(JobManager::Job& job)
+{
+	// The whole tree is reached before any data moves, so the byte total is settled early on
+	if (addEntries(job) || copyData(job))
+		return false;
+
+	CachedStatement cleanup = m_statements.prepare("DELETE FROM CopyEntries WHERE JobID = ?");
+	cleanup.bind(1, job.id);
+	cleanup.evaluate();
+	return true;
+}
+
+bool srv::FileCopy::addEntries(JobManager::Job& job)
+{
+	CachedStatement pending = m_statements.prepare(
+		"SELECT SourceID, CopyID, DiskID, Cursor FROM CopyEntries WHERE JobID = ? AND Done = 0 AND IsDirectory = 1 LIMIT 1"
+	);
+	pending.bind(1, job.id);
+	if (!pending.evaluate())
+		return false;
+
+	const std::int64_t directoryID = pending.getColumnValue<std::int64_t>(0);
+	const std::int64_t copyID = pending.getColumnValue<std::int64_t>(1);
+	const std::int64_t diskID = pending.getColumnValue<std::int64_t>(2);
+	std::string cursor = pending.getColumnValue<std::string>(3);
+
+	// The next children by name, skipping any already recorded and anything a running delete is reclaiming
+	CachedStatement statement = m_statements.prepare(
+		"SELECT f.ID, f.Name FROM FileEntries f "
+		"WHERE f.ParentID = ?1 AND f.Name > ?2 "
+		"AND NOT EXISTS (SELECT 1 FROM CopyEntries d WHERE d.JobID = ?3 AND d.SourceID = f.ID) "
+		"AND f.ID NOT IN (SELECT FileID FROM BackgroundJobs WHERE Type = 'delete' AND State = 'running') "
+		"ORDER BY f.Name LIMIT ?4"
+	);
+	statement.bind(1, directoryID);
+	statement.bind(2, cursor);
+	statement.bind(3, job.id);
+	statement.bind(4, BatchSize);
+
+	struct Child
+	{
+		std::int64_t sourceID;
+		std::string name;
+	};
+
+	std::vector<Child> children;
+	while (statement.evaluate())
+		children.push_back({ statement.getColumnValue<std::int64_t>(0), statement.getColumnValue<std::string>(1) });
+
+	for (const Child& child : children)
+	{
+		const Entry entry = addEntry(job.type, job.ownerID, child.sourceID, copyID, child.name, diskID);
+		record(job.id, child.sourceID, entry);
+		job.total += entry.size;
+	}
+	if (!children.empty())
+		cursor = children.back().name;
+
+	CachedStatement update = m_statements.prepare(
+		"UPDATE CopyEntries SET Cursor = ?, Done = ? WHERE JobID = ? AND SourceID = ?"
+	);
+	update.bind(1, cursor);
+	update.bind(2, static_cast<std::int64_t>(children.size() < static_cast<size_t>(BatchSize)));
+	update.bind(3, job.id);
+	update.bind(4, directoryID);
+	update.evaluate();
+	return true;
+}
+
+bool srv::FileCopy::copyData(JobManager::Job& job)
+{
+	CachedStatement pending = m_statements.prepare(
+		"SELECT SourceID, CopyID, DiskID, Size, Copied FROM CopyEntries WHERE JobID = ? AND Done = 0 AND IsDirectory = 0 LIMIT 1"
+	);
+	pending.bind(1, job.id);
+	if (!pending.evaluate())
+		return false;
+
+	const std::int64_t sourceID = pending.getColumnValue<std::int64_t>(0);
+	const std::int64_t copyID = pending.getColumnValue<std::int64_t>(1);
+	const std::int64_t diskID = pending.getColumnValue<std::int64_t>(2);
+	std::uint64_t size = pending.getColumnValue<std::int64_t>(3);
+	std::uint64_t copied = pending.getColumnValue<std::int64_t>(4);
+
+	uint8_t* block = m_buffers.acquire();
+	if (!block)
+		return true; // every block is carrying an upload; try again next step
+
+	try
+	{
+		const std::int64_t sourceDiskID = m_inodes.getDiskID(sourceID);
+		File source = m_inodes.getDisk(sourceID).getFS().open(m_inodes.getInternalPath(sourceID).c_str());
+		if (!source || !source.seek(copied))
+			throw std::runtime_error("Failed to open copy source");
+
+		// A step cut short by a reboot may have written past Copied; those bytes are simply written again
+		fs::FS& fs = m_vfs.getDiskMap().getDiskByID(diskID).getFS();
+		const std::string path = m_inodes.getInternalPath(copyID);
+		File destination;
+		if (copied)
+		{
+			destination = fs.open(path.c_str(), "r+");
+			if (destination && !destination.seek(copied))
+				destination.close();
+		}
+		else
+		{
+			DiskPlacement::createParents(fs, path);
+			destination = fs.open(path.c_str(), FILE_WRITE);
+		}
+		if (!destination)
+			throw std::runtime_error("Failed to open copy on disk " + std::to_string(diskID));
+
+		for (size_t i = 0; i < StepBlocks && copied < size; ++i)
+		{
+			const size_t length = std::min<std::uint64_t>(m_buffers.getBlockSize(), size - copied);
+			const int count = source.read(block, length);
+			if (count <= 0)
+			{
+				// The source shrank since it was reached; the copy ends where it does
+				job.total -= size - copied;
+				size = copied;
+				break;
+			}
+			m_metrics.addDiskRead(sourceDiskID, count);
+
+			if (destination.write(block, count) != static_cast<size_t>(count))
+				throw std::runtime_error("Failed to write copy on disk " + std::to_string(diskID));
+			m_metrics.addDiskWrite(diskID, count);
+
+			copied += count;
+			job.done += count;
+		}
+		destination.close();
+		source.close();
+	}
+	catch (...)
+	{
+		m_buffers.release(block);
+		throw;
+	}
+	m_buffers.release(block);
+
+	CachedStatement update = m_statements.prepare(
+		"UPDATE CopyEntries SET Size = ?, Copied = ?, Done = ? WHERE JobID = ? AND SourceID = ?"
+	);
+	update.bind(1, static_cast<std::int64_t>(size));
+	update.bind(2, static_cast<std::int64_t>(copied));
+	update.bind(3, static_cast<std::int64_t>(copied == size));
+	update.bind(4, job.id);
+	update.bind(5, sourceID);
+	update.evaluate();
+
+	if (copied == size && job.type == RelocateJobType)
+		finishRelocation(copyID, diskID);
+	else if (copied == size)
+		m_usage.setSize(copyID, size); // in case the source shrank
+	return true;
+}
+
+srv::FileCopy::Entry srv::FileCopy::addEntry(const std::string& type, std::int64_t ownerID, std::int64_t sourceID, std::int64_t parentID, const std::string& name, std::int64_t diskID)
+{
+	const InodeCache::Inode& inode = m_inodes.get(sourceID);
+	if (inode.isDirectory)
+	{
+		if (type == RelocateJobType)
+			return { sourceID, diskID, 0, true, false };
+
+		m_vfs.createNewDirectoryEntry(parentID, name, ownerID);
+		return { m_placement.findEntry(parentID, name), diskID, 0, true, false };
+	}
+
+	fs::FS& sourceFS = inode.disk->getFS();
+	File source = sourceFS.open(inode.path.c_str());
+	if (!source)
+		throw std::runtime_error("Failed to open " + inode.path);
+	const std::uint64_t size = source.size();
+	source.close();
+
+	if (type == RelocateJobType)
+	{
+		// Disk IDs sharing one filesystem already hold the data at the same path
+		fs::FS& targetFS = m_vfs.getDiskMap().getDiskByID(diskID).getFS();
+		if (inode.diskID == diskID)
+			return { sourceID, diskID, 0, false, true };
+		if (&targetFS == &sourceFS)
+		{
+			m_placement.assign(sourceID, diskID);
+			return { sourceID, diskID, 0, false, true };
+		}
+		return { sourceID, diskID, size, false, false }; // even when empty, the file still has to move
+	}
+
+	m_usage.requireQuota(ownerID, size);
+	if (diskID < 0)
+		diskID = m_placement.choose(size);
+	File copy = m_placement.create(parentID, name, size, ownerID, diskID);
+	copy.close();
+	return { m_placement.findEntry(parentID, name), diskID, size, false, size == 0 };
+}
+
+void srv::FileCopy::record(std::int64_t jobID, std::int64_t sourceID, const Entry& entry)
+{
+	CachedStatement insert = m_statements.prepare(
+		"INSERT INTO CopyEntries (JobID, SourceID, CopyID, DiskID, Size, IsDirectory, Done) VALUES (?, ?, ?, ?, ?, ?, ?)"
+	);
+	insert.bind(1, jobID);
+	insert.bind(2, sourceID);
+	insert.bind(3, entry.copyID);
+	insert.bind(4, entry.diskID);
+	insert.bind(5, static_cast<std::int64_t>(entry.size));
+	insert.bind(6, static_cast<std::int64_t>(entry.isDirectory));
+	insert.bind(7, static_cast<std::int64_t>(entry.isComplete));
+	insert.evaluate();
+}
+
+void srv::FileCopy::finishRelocation(std::int64_t fileID, std::int64_t diskID)
+{
+	fs::FS& oldFS = m_inodes.getDisk(fileID).getFS();
+	const std::string oldPath = m_inodes.getInternalPath(fileID);
+
+	m_placement.assign(fileID, diskID);
+	if (!oldFS.remove(oldPath.c_str()))
+		log_w("Relocated %s but failed to remove the old copy", oldPath.c_str());
+}
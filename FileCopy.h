@@ -0,0 +1,77 @@
+// FileCopy.h
+
+#ifndef _FileCopy_h
+#define _FileCopy_h
+
+#if defined(ARDUINO) && ARDUINO >= 100
+#include "arduino.h"
+#else
+#include "WProgram.h"
+#endif
+
+#include "VFS.h"
+#include "StatementCache.h"
+#include "InodeCache.h"
+#include "DiskPlacement.h"
+#include "UsageTracker.h"
+#include "BufferPool.h"
+#include "JobManager.h"
+#include "Metrics.h"
+#include <cstdint>
+#include <optional>
+#include <string>
+
+namespace srv {
+	class FileCopy;
+}
+
+// Server-side copies, and moves of file data between disks, as background jobs. Each job first recreates
+// the subtree's entries a batch at a time, recording them in CopyEntries, then streams the data file by file
+// through pooled buffer blocks, a bounded number per step. Rows stay pending until a directory's children have
+// all been reached (tracked by a name cursor) or a file's data is written, and each step finds its work through
+// the (JobID, Done, IsDirectory) index, so a step costs the same however large the job. A "copy" creates new entries under the destination;
+// a "relocate" keeps every entry and repoints DiskID once its data is on the target disk. Copied files count
+// against the copier's quota as they are reached. Job progress is in
+// bytes, and the total is final once every entry has been reached.
+class srv::FileCopy
+{
+public:
+	static constexpr const char* CopyJobType = "copy";
+	static constexpr const char* RelocateJobType = "relocate";
+	static constexpr std::int64_t BatchSize = 16; // entries created per job step
+	static constexpr size_t StepBlocks = 2; // buffer blocks copied per job step, all under the database lock
+
+	FileCopy(StatementCache& statements, vfs::Filesystem& vfs, InodeCache& inodes, DiskPlacement& placement, UsageTracker& usage, BufferPool& buffers, JobManager& jobs, Metrics& metrics);
+
+	// Both return the job ID; diskID picks the disk for copied data, otherwise each file is placed as an upload would be
+	std::int64_t copy(std::int64_t sourceID, std::int64_t parentID, const std::string& name, std::int64_t userID, std::optional<std::int64_t> diskID);
+	std::int64_t relocate(std::int64_t fileID, std::int64_t diskID, std::int64_t userID);
+
+private:
+	struct Entry
+	{
+		std::int64_t copyID;
+		std::int64_t diskID; // where file data goes; for directories the disk requested for their files, or -1
+		std::uint64_t size; // bytes still to copy
+		bool isDirectory;
+		bool isComplete; // nothing left to copy or expand
+	};
+
+	StatementCache& m_statements;
+	vfs::Filesystem& m_vfs;
+	InodeCache& m_inodes;
+	DiskPlacement& m_placement;
+	UsageTracker& m_usage;
+	BufferPool& m_buffers;
+	JobManager& m_jobs;
+	Metrics& m_metrics;
+
+	bool step(JobManager::Job& job);
+	bool addEntries(JobManager::Job& job); // expands one pending directory; false once the whole subtree has been reached
+	bool copyData(JobManager::Job& job); // false once every file is complete
+	Entry addEntry(const std::string& type, std::int64_t ownerID, std::int64_t sourceID, std::int64_t parentID, const std::string& name, std::int64_t diskID);
+	void record(std::int64_t jobID, std::int64_t sourceID, const Entry& entry);
+	void finishRelocation(std::int64_t fileID, std::int64_t diskID);
+};
+
+#endif
@@ -0,0 +1,290 @@
+// 
+// 
+// 
+
+#include "FileRangeResponse.h"
+#include <esp_random.h>
+#include <algorithm>
+#include <cstdlib>
+#include <limits>
+
+namespace {
+	bool isDigit(char c)
+	{
+		return c >= '0' && c <= '9';
+	}
+}
+
+AsyncWebServerResponse* srv::FileRangeResponse::create(AsyncWebServerRequest* request, File file, const String& contentType, Metrics& metrics,
+	std::int64_t diskID, AdmissionControl::Ticket ticket)
+{
+	const std::uint64_t size = file.size();
+	const std::time_t lastModified = file.getLastWrite();
+	const String eTag = makeETag(size, lastModified);
+	const String lastModifiedDate = makeHTTPDate(lastModified);
+
+	std::vector<Range> ranges;
+	bool isRangeRequest = request->hasHeader("Range");
+
+	if (isRangeRequest && request->hasHeader("If-Range"))
+	{
+		// A stale validator means the client's partial copy is outdated: send the whole file instead
+		const String& validator = request->header("If-Range");
+		isRangeRequest = validator == eTag || validator == lastModifiedDate;
+	}
+
+	if (isRangeRequest)
+	{
+		std::optional<std::vector<Range>> parsed = parseRangeHeader(request->header("Range"), size);
+		if (parsed && parsed->empty())
+		{
+			file.close();
+			AsyncWebServerResponse* response = request->beginResponse(416);
+			response->addHeader("Content-Range", String("bytes */") + String(size));
+			response->addHeader("Accept-Ranges", "bytes");
+			return response;
+		}
+		if (parsed)
+			ranges = std::move(*parsed);
+	}
+
+	FileRangeResponse* response = new FileRangeResponse(file, contentType, ranges, metrics, diskID);
+	if (response->_chunked && !request->version())
+	{
+		// HTTP/1.0 has no chunked encoding, and the length does not fit the response's size_t
+		delete response;
+		return request->beginResponse(505, "text/plain", "Responses over 4 GB need HTTP/1.1");
+	}
+	response->m_ticket = std::move(ticket);
+	response->addHeader("Accept-Ranges", "bytes");
+	response->addHeader("ETag", eTag);
+	response->addHeader("Last-Modified", lastModifiedDate);
+	return response;
+}
+
+srv::FileRangeResponse::FileRangeResponse(File file, const String& contentType, const std::vector<Range>& ranges, Metrics& metrics, std::int64_t diskID)
+	:m_file(file), m_metrics(metrics), m_diskID(diskID), m_isValid(static_cast<bool>(file)), m_size(file ? file.size() : 0), m_partContentType(contentType), m_ranges(ranges),
+	m_rangeIndex(0), m_rangePosition(0), m_needsSeek(false), m_pendingOffset(0)
+{
+	if (m_ranges.empty())
+	{
+		_code = 200;
+		if (m_size)
+			m_ranges.push_back({ 0, m_size - 1 });
+	}
+	else
+	{
+		_code = 206;
+		m_needsSeek = true;
+	}
+
+	if (isMultipart())
+	{
+		char boundary[24];
+		snprintf(boundary, sizeof(boundary), "%08x%08x", esp_random(), esp_random());
+		m_boundary = boundary;
+		_contentType = String("multipart/byteranges; boundary=") + m_boundary.c_str();
+		m_pending = makePartHeader(0);
+	}
+	else
+	{
+		_contentType = contentType;
+		if (_code == 206)
+			addHeader("Content-Range", String("bytes ") + String(m_ranges[0].first) + "-" + String(m_ranges[0].last) + "/" + String(m_size));
+	}
+
+	if (!m_ranges.empty())
+		m_rangePosition = m_ranges[0].first;
+
+	const std::uint64_t contentLength = computeContentLength();
+	if (contentLength > std::numeric_limits<size_t>::max())
+	{
+		// _contentLength is a size_t; larger bodies are sent chunked rather than with a truncated length
+		_contentLength = 0;
+		_sendContentLength = false;
+		_chunked = true;
+	}
+	else
+		_contentLength = static_cast<size_t>(contentLength);
+}
+
+srv::FileRangeResponse::~FileRangeResponse()
+{
+	if (m_file)
+		m_file.close();
+}
+
+size_t srv::FileRangeResponse::_fillBuffer(uint8_t* buffer, size_t maxLen)
+{
+	size_t written = 0;
+	while (written < maxLen)
+	{
+		if (m_pendingOffset < m_pending.size())
+		{
+			const size_t count = std::min(maxLen - written, m_pending.size() - m_pendingOffset);
+			std::memcpy(buffer + written, m_pending.data() + m_pendingOffset, count);
+			m_pendingOffset += count;
+			written += count;
+			continue;
+		}
+
+		if (m_rangeIndex >= m_ranges.size())
+			break;
+
+		const Range& range = m_ranges[m_rangeIndex];
+		if (m_rangePosition > range.last)
+		{
+			// Current range done: queue the next part header, or the closing delimiter after the last part
+			++m_rangeIndex;
+			m_pendingOffset = 0;
+			if (!isMultipart())
+				m_pending.clear();
+			else if (m_rangeIndex < m_ranges.size())
+				m_pending = makePartHeader(m_rangeIndex);
+			else
+				m_pending = makeClosingDelimiter();
+
+			if (m_rangeIndex < m_ranges.size())
+			{
+				m_rangePosition = m_ranges[m_rangeIndex].first;
+				m_needsSeek = true;
+			}
+			continue;
+		}
+
+		if (m_needsSeek)
+		{
+			if (!m_file.seek(m_rangePosition))
+				break;
+			m_needsSeek = false;
+		}
+
+		const size_t toRead = static_cast<size_t>(std::min<std::uint64_t>(maxLen - written, range.last - m_rangePosition + 1));
+		const size_t count = m_file.read(buffer + written, toRead);
+		if (!count)
+			break;
+
+		m_rangePosition += count;
+		written += count;
+		m_metrics.addDiskRead(m_diskID, count);
+	}
+	return written;
+}
+
+std::optional<std::vector<srv::FileRangeResponse::Range>> srv::FileRangeResponse::parseRangeHeader(const String& header, std::uint64_t size)
+{
+	const char* cursor = header.c_str();
+	if (strncmp(cursor, "bytes=", strlen("bytes=")) != 0)
+		return std::nullopt;
+	cursor += strlen("bytes=");
+
+	std::vector<Range> ranges;
+	size_t specCount = 0;
+	while (*cursor)
+	{
+		while (*cursor == ' ' || *cursor == '\t')
+			++cursor;
+
+		if (++specCount > MaxRanges)
+			return std::nullopt;
+
+		char* end = nullptr;
+		if (*cursor == '-')
+		{
+			// Suffix range: the last N bytes; strtoull alone would also take a sign or whitespace
+			if (!isDigit(cursor[1]))
+				return std::nullopt;
+			const unsigned long long suffix = strtoull(cursor + 1, &end, 10);
+			if (suffix && size)
+				ranges.push_back({ size - std::min<std::uint64_t>(suffix, size), size - 1 });
+		}
+		else
+		{
+			if (!isDigit(*cursor))
+				return std::nullopt;
+			const unsigned long long first = strtoull(cursor, &end, 10);
+			if (*end != '-')
+				return std::nullopt;
+
+			cursor = end + 1;
+			std::uint64_t last = size ? size - 1 : 0;
+			if (isDigit(*cursor))
+			{
+				last = strtoull(cursor, &end, 10);
+				if (last < first)
+					return std::nullopt;
+			}
+			else
+				end = const_cast<char*>(cursor);
+
+			if (first < size)
+				ranges.push_back({ first, std::min<std::uint64_t>(last, size - 1) });
+		}
+
+		cursor = end;
+		while (*cursor == ' ' || *cursor == '\t')
+			++cursor;
+		if (*cursor == ',')
+			++cursor;
+		else if (*cursor)
+			return std::nullopt;
+	}
+
+	if (!specCount)
+		return std::nullopt;
+
+	return ranges;
+}
+
+String srv::FileRangeResponse::makeETag(std::uint64_t size, std::time_t lastModified)
+{
+	char eTag[40];
+	snprintf(eTag, sizeof(eTag), "\"%llx-%llx\"", static_cast<unsigned long long>(size), static_cast<unsigned long long>(lastModified));
+	return eTag;
+}
+
+String srv::FileRangeResponse::makeHTTPDate(std::time_t time)
+{
+	std::tm tm;
+	gmtime_r(&time, &tm);
+	char date[32];
+	strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+	return date;
+}
+
+std::string srv::FileRangeResponse::makePartHeader(size_t index) const
+{
+	const Range& range = m_ranges[index];
+	char contentRange[80];
+	snprintf(contentRange, sizeof(contentRange), "Content-Range: bytes %llu-%llu/%llu\r\n\r\n",
+		static_cast<unsigned long long>(range.first), static_cast<unsigned long long>(range.last), static_cast<unsigned long long>(m_size));
+
+	std::string header = index ? "\r\n--" : "--";
+	header += m_boundary;
+	header += "\r\nContent-Type: ";
+	header += m_partContentType.c_str();
+	header += "\r\n";
+	header += contentRange;
+	return header;
+}
+
+std::string srv::FileRangeResponse::makeClosingDelimiter() const
+{
+	return "\r\n--" + m_boundary + "--\r\n";
+}
+
+std::uint64_t srv::FileRangeResponse::computeContentLength() const
+{
+	std::uint64_t length = 0;
+	for (size_t i = 0; i < m_ranges.size(); ++i)
+	{
+		length += m_ranges[i].last - m_ranges[i].first + 1;
+		if (isMultipart())
+			length += makePartHeader(i).size();
+	}
+
+	if (isMultipart())
+		length += makeClosingDelimiter().size();
+
+	return length;
+}
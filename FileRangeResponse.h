@@ -0,0 +1,78 @@
+// FileRangeResponse.h
+
+#ifndef _FileRangeResponse_h
+#define _FileRangeResponse_h
+
+#if defined(ARDUINO) && ARDUINO >= 100
+#include "arduino.h"
+#else
+#include "WProgram.h"
+#endif
+
+#include "AdmissionControl.h"
+#include "Metrics.h"
+#include <ESPAsyncWebServer.h>
+#include <FS.h>
+#include <cstdint>
+#include <ctime>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace srv {
+	class FileRangeResponse;
+}
+
+// Serves a file as a whole (200), a single byte range (206) or several byte ranges (206 multipart/byteranges),
+// seeking directly to each range on the disk.
+class srv::FileRangeResponse : public AsyncAbstractResponse
+{
+public:
+	struct Range
+	{
+		std::uint64_t first;
+		std::uint64_t last; // inclusive
+	};
+
+	static constexpr size_t MaxRanges = 16;
+
+	// Picks the response matching the Range/If-Range headers of the request; takes ownership of the file, and of
+	// the admission ticket for as long as data is being sent
+	static AsyncWebServerResponse* create(AsyncWebServerRequest* request, File file, const String& contentType, Metrics& metrics,
+		std::int64_t diskID = -1, AdmissionControl::Ticket ticket = {});
+
+	FileRangeResponse(File file, const String& contentType, const std::vector<Range>& ranges, Metrics& metrics, std::int64_t diskID = -1);
+	~FileRangeResponse();
+
+	bool _sourceValid() const override { return m_isValid; }
+	size_t _fillBuffer(uint8_t* buffer, size_t maxLen) override;
+
+	// Returns nullopt when the header is malformed and must be ignored; an empty vector when no range is satisfiable
+	static std::optional<std::vector<Range>> parseRangeHeader(const String& header, std::uint64_t size);
+	static String makeETag(std::uint64_t size, std::time_t lastModified);
+	static String makeHTTPDate(std::time_t time);
+
+private:
+	File m_file;
+	Metrics& m_metrics;
+	std::int64_t m_diskID; // for read accounting, -1 when unknown
+	AdmissionControl::Ticket m_ticket;
+	bool m_isValid;
+	std::uint64_t m_size;
+	String m_partContentType;
+	std::vector<Range> m_ranges;
+	std::string m_boundary;
+
+	size_t m_rangeIndex;
+	std::uint64_t m_rangePosition; // next byte of the current range to send
+	bool m_needsSeek;
+	std::string m_pending; // multipart delimiter and part headers
+	size_t m_pendingOffset;
+
+	bool isMultipart() const { return m_ranges.size() > 1; }
+	std::string makePartHeader(size_t index) const;
+	std::string makeClosingDelimiter() const;
+	std::uint64_t computeContentLength() const;
+};
+
+#endif
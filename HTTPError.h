@@ -0,0 +1,23 @@
+#pragma once
+
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+
+namespace srv {
+	class HTTPError;
+}
+
+// Request errors that map onto a specific HTTP status instead of a generic 500
+class srv::HTTPError : public std::runtime_error
+{
+public:
+	HTTPError(int code, const std::string& message, std::uint32_t retryAfter = 0) : std::runtime_error(message), m_code(code), m_retryAfter(retryAfter) {}
+
+	int getCode() const { return m_code; }
+	std::uint32_t getRetryAfter() const { return m_retryAfter; } // seconds, 0 for none
+
+private:
+	int m_code;
+	std::uint32_t m_retryAfter;
+};
@@ -0,0 +1,149 @@
+// 
+// 
+// 
+
+#include "InodeCache.h"
+#include <algorithm>
+#include <stdexcept>
+
+srv::InodeCache::InodeCache(StatementCache& statements, vfs::Filesystem& vfs, size_t capacity)
+	:m_statements(statements), m_vfs(vfs), m_capacity(capacity), m_hits(0), m_misses(0)
+{
+	m_index.reserve(capacity);
+}
+
+const srv::InodeCache::Inode& srv::InodeCache::get(std::int64_t id)
+{
+	auto it = m_index.find(id);
+	if (it != m_index.end())
+	{
+		++m_hits;
+		m_entries.splice(m_entries.begin(), m_entries, it->second);
+		return *it->second;
+	}
+
+	++m_misses;
+	Inode inode = load(id);
+
+	if (m_entries.size() >= m_capacity)
+	{
+		m_index.erase(m_entries.back().id);
+		m_entries.pop_back();
+	}
+
+	m_entries.push_front(std::move(inode));
+	m_index.emplace(id, m_entries.begin());
+	return m_entries.front();
+}
+
+vfs::Disk& srv::InodeCache::getDisk(std::int64_t id)
+{
+	const Inode& inode = get(id);
+	return inode.disk ? *inode.disk : m_vfs.getDisk(id);
+}
+
+std::int64_t srv::InodeCache::getDiskID(std::int64_t id)
+{
+	const Inode& inode = get(id);
+	if (inode.isDirectory)
+		throw std::invalid_argument("Directories are not stored on a disk");
+	return inode.diskID;
+}
+
+const std::string& srv::InodeCache::getInternalPath(std::int64_t id)
+{
+	const Inode& inode = get(id);
+	if (inode.isDirectory)
+		throw std::invalid_argument("Directories have no internal path");
+	return inode.path;
+}
+
+void srv::InodeCache::onRowChange(const RowChange& change)
+{
+	if (!change.isTable("FileEntries") || change.getOperation() == RowChange::Operation::Insert)
+		return;
+
+	const std::int64_t id = change.getOldRowID();
+	if (change.getOperation() == RowChange::Operation::Delete
+		|| change.hasColumnChanged<std::int64_t>(FileEntriesColumn::ParentID)
+		|| change.hasColumnChanged<std::string>(FileEntriesColumn::Name))
+		eraseSubtree(id); // every cached descendant path runs through this entry
+	else
+		erase(id);
+}
+
+void srv::InodeCache::clear()
+{
+	m_entries.clear();
+	m_index.clear();
+}
+
+srv::InodeCache::Inode srv::InodeCache::load(std::int64_t id)
+{
+	CachedStatement statement = m_statements.prepare(
+		"WITH RECURSIVE Ancestors(ID, ParentID, Name, DiskID, Depth) AS ("
+		"SELECT ID, ParentID, Name, DiskID, 0 FROM FileEntries WHERE ID = ? "
+		"UNION ALL "
+		"SELECT f.ID, f.ParentID, f.Name, f.DiskID, a.Depth + 1 FROM FileEntries f JOIN Ancestors a ON f.ID = a.ParentID"
+		") SELECT ID, ParentID, Name, "
+		"EXISTS (SELECT 1 FROM BackgroundJobs j WHERE j.FileID = a.ID AND j.Type = 'delete' AND j.State = 'running'), "
+		"DiskID, DiskID IS NULL FROM Ancestors a ORDER BY Depth"
+	);
+	statement.bind(1, id);
+	if (!statement.evaluate())
+		throw std::invalid_argument("File not found");
+
+	Inode inode;
+	inode.id = id;
+	inode.parentID = statement.getColumnValue<std::int64_t>(1);
+	inode.name = statement.getColumnValue<std::string>(2);
+	inode.diskID = statement.getColumnValue<std::int64_t>(4);
+	inode.isDirectory = statement.getColumnValue<std::int64_t>(5); // only files are placed on a disk
+	bool isDeleting = statement.getColumnValue<std::int64_t>(3);
+
+	// Names from the entry up to its root, which the internal path lists the other way round
+	std::vector<std::string> names{ inode.name };
+	while (statement.evaluate())
+	{
+		inode.ancestors.push_back(statement.getColumnValue<std::int64_t>(0));
+		names.push_back(statement.getColumnValue<std::string>(2));
+		isDeleting = isDeleting || statement.getColumnValue<std::int64_t>(3);
+	}
+	if (isDeleting)
+		throw std::invalid_argument("File not found"); // queued for background deletion
+
+	inode.disk = nullptr;
+	if (!inode.isDirectory)
+	{
+		inode.disk = &m_vfs.getDiskMap().getDiskByID(inode.diskID);
+		for (auto name = names.rbegin(); name != names.rend(); ++name)
+			inode.path += "/" + *name;
+	}
+	return inode;
+}
+
+void srv::InodeCache::erase(std::int64_t id)
+{
+	auto it = m_index.find(id);
+	if (it == m_index.end())
+		return;
+
+	m_entries.erase(it->second);
+	m_index.erase(it);
+}
+
+void srv::InodeCache::eraseSubtree(std::int64_t id)
+{
+	erase(id);
+	for (auto it = m_entries.begin(); it != m_entries.end();)
+	{
+		if (std::find(it->ancestors.begin(), it->ancestors.end(), id) == it->ancestors.end())
+		{
+			++it;
+			continue;
+		}
+
+		m_index.erase(it->id);
+		it = m_entries.erase(it);
+	}
+}
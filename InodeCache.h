@@ -0,0 +1,72 @@
+// InodeCache.h
+
+#ifndef _InodeCache_h
+#define _InodeCache_h
+
+#if defined(ARDUINO) && ARDUINO >= 100
+#include "arduino.h"
+#else
+#include "WProgram.h"
+#endif
+
+#include "VFS.h"
+#include "StatementCache.h"
+#include "PreupdateHook.h"
+#include <cstdint>
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace srv {
+	class InodeCache;
+}
+
+// Bounded LRU of FileEntries rows with their resolved internal path, so file requests skip the
+// per-level ParentID walk. Kept exact by the preupdate hook.
+class srv::InodeCache
+{
+public:
+	struct Inode
+	{
+		std::int64_t id;
+		std::int64_t parentID;
+		std::string name;
+		bool isDirectory;
+		vfs::Disk* disk; // files only
+		std::int64_t diskID; // files only
+		std::string path; // internal path on the disk, files only
+		std::vector<std::int64_t> ancestors; // parent first
+	};
+
+	InodeCache(StatementCache& statements, vfs::Filesystem& vfs, size_t capacity = 256);
+
+	const Inode& get(std::int64_t id);
+	bool isDirectory(std::int64_t id) { return get(id).isDirectory; }
+	vfs::Disk& getDisk(std::int64_t id);
+	std::int64_t getDiskID(std::int64_t id);
+	const std::string& getInternalPath(std::int64_t id);
+
+	void onRowChange(const RowChange& change);
+	void clear();
+
+	std::uint32_t getHits() const { return m_hits; }
+	std::uint32_t getMisses() const { return m_misses; }
+	size_t getSize() const { return m_entries.size(); }
+	size_t getCapacity() const { return m_capacity; }
+
+private:
+	StatementCache& m_statements;
+	vfs::Filesystem& m_vfs;
+	size_t m_capacity;
+	std::list<Inode> m_entries; // most recently used first
+	std::unordered_map<std::int64_t, std::list<Inode>::iterator> m_index;
+	std::uint32_t m_hits;
+	std::uint32_t m_misses;
+
+	Inode load(std::int64_t id);
+	void erase(std::int64_t id);
+	void eraseSubtree(std::int64_t id);
+};
+
+#endif
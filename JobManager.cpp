@@ -0,0 +1,153 @@
+// 
+// 
+// 
+
+#include "JobManager.h"
+#include "HTTPError.h"
+#include <freertos/task.h>
+#include <stdexcept>
+#include <vector>
+
+srv::JobManager::JobManager(StatementCache& statements, WorkerPool& workers)
+	:m_statements(statements), m_workers(workers)
+{
+}
+
+void srv::JobManager::registerType(const std::string& type, Step step)
+{
+	m_types[type] = std::move(step);
+}
+
+std::int64_t srv::JobManager::start(const std::string& type, std::int64_t ownerID, std::int64_t fileID, std::int64_t targetID, std::uint64_t total)
+{
+	if (m_types.find(type) == m_types.end())
+		throw std::invalid_argument("Unknown job type: " + type);
+
+	CachedStatement insert = m_statements.prepare(
+		"INSERT INTO BackgroundJobs (Type, OwnerID, FileID, TargetID, Total, Done, State) VALUES (?, ?, ?, ?, ?, 0, ?)"
+	);
+	insert.bind(1, type);
+	insert.bind(2, ownerID);
+	insert.bind(3, fileID);
+	insert.bind(4, targetID);
+	insert.bind(5, static_cast<std::int64_t>(total));
+	insert.bind(6, std::string(Running));
+	insert.evaluate();
+
+	CachedStatement lastID = m_statements.prepare("SELECT last_insert_rowid()");
+	lastID.evaluate();
+	const std::int64_t jobID = lastID.getColumnValue<std::int64_t>(0);
+
+	// The caller still holds the database lock, so the first step cannot run before its transaction commits
+	schedule(jobID);
+	return jobID;
+}
+
+srv::JobManager::Job srv::JobManager::get(std::int64_t jobID, std::int64_t ownerID)
+{
+	Job job;
+	if (!load(jobID, job) || job.ownerID != ownerID)
+		throw HTTPError(404, "Job not found");
+
+	return job;
+}
+
+void srv::JobManager::resume()
+{
+	std::vector<std::int64_t> jobIDs;
+	{
+		DatabaseLock lock(m_statements.getMutex());
+		CachedStatement statement = m_statements.prepare(
+			"SELECT ID FROM BackgroundJobs WHERE State = ? ORDER BY ID"
+		);
+		statement.bind(1, std::string(Running));
+		while (statement.evaluate())
+			jobIDs.push_back(statement.getColumnValue<std::int64_t>(0));
+	}
+
+	for (std::int64_t jobID : jobIDs)
+		schedule(jobID);
+}
+
+void srv::JobManager::schedule(std::int64_t jobID)
+{
+	if (!m_workers.post([this, jobID] { run(jobID); }))
+		log_w("Worker queue full, job %lld deferred", jobID);
+}
+
+void srv::JobManager::run(std::int64_t jobID)
+{
+	while (!runStep(jobID))
+	{
+		vTaskDelay(pdMS_TO_TICKS(StepInterval));
+
+		// Requeue behind other work where possible; with a full queue just keep going on this worker
+		if (m_workers.post([this, jobID] { run(jobID); }))
+			return;
+	}
+}
+
+bool srv::JobManager::runStep(std::int64_t jobID)
+{
+	DatabaseLock lock(m_statements.getMutex());
+
+	Job job;
+	if (!load(jobID, job) || job.state != Running)
+		return true;
+
+	auto type = m_types.find(job.type);
+	try
+	{
+		if (type == m_types.end())
+			throw std::runtime_error("Unknown job type: " + job.type);
+
+		Transaction transaction(m_statements);
+		if (type->second(job))
+			job.state = Completed;
+		save(job);
+		transaction.commit();
+	}
+	catch (const std::exception& e)
+	{
+		log_e("Job %lld failed: %s", jobID, e.what());
+		job.state = Failed;
+		job.error = e.what();
+		save(job);
+	}
+
+	return job.state != Running;
+}
+
+bool srv::JobManager::load(std::int64_t jobID, Job& job)
+{
+	CachedStatement statement = m_statements.prepare(
+		"SELECT Type, OwnerID, FileID, TargetID, Total, Done, State, Error FROM BackgroundJobs WHERE ID = ?"
+	);
+	statement.bind(1, jobID);
+	if (!statement.evaluate())
+		return false;
+
+	job.id = jobID;
+	job.type = statement.getColumnValue<std::string>(0);
+	job.ownerID = statement.getColumnValue<std::int64_t>(1);
+	job.fileID = statement.getColumnValue<std::int64_t>(2);
+	job.targetID = statement.getColumnValue<std::int64_t>(3);
+	job.total = statement.getColumnValue<std::int64_t>(4);
+	job.done = statement.getColumnValue<std::int64_t>(5);
+	job.state = statement.getColumnValue<std::string>(6);
+	job.error = statement.getColumnValue<std::string>(7);
+	return true;
+}
+
+void srv::JobManager::save(const Job& job)
+{
+	CachedStatement update = m_statements.prepare(
+		"UPDATE BackgroundJobs SET Total = ?, Done = ?, State = ?, Error = ? WHERE ID = ?"
+	);
+	update.bind(1, static_cast<std::int64_t>(job.total));
+	update.bind(2, static_cast<std::int64_t>(job.done));
+	update.bind(3, job.state);
+	update.bind(4, job.error);
+	update.bind(5, job.id);
+	update.evaluate();
+}
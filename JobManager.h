@@ -0,0 +1,69 @@
+// JobManager.h
+
+#ifndef _JobManager_h
+#define _JobManager_h
+
+#if defined(ARDUINO) && ARDUINO >= 100
+#include "arduino.h"
+#else
+#include "WProgram.h"
+#endif
+
+#include "StatementCache.h"
+#include "WorkerPool.h"
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <string>
+
+namespace srv {
+	class JobManager;
+}
+
+// Long-running operations persisted in the BackgroundJobs table and advanced one bounded step at a time on the
+// worker pool, yielding between steps. Jobs still running at boot are picked up again by resume().
+class srv::JobManager
+{
+public:
+	struct Job
+	{
+		std::int64_t id;
+		std::string type;
+		std::int64_t ownerID;
+		std::int64_t fileID;
+		std::int64_t targetID; // type-specific, e.g. a destination directory
+		std::uint64_t total;
+		std::uint64_t done;
+		std::string state;
+		std::string error;
+	};
+
+	// Runs one bounded batch inside a transaction, advancing job.done; returns true once the job is complete
+	using Step = std::function<bool(Job& job)>;
+
+	static constexpr const char* Running = "running";
+	static constexpr const char* Completed = "completed";
+	static constexpr const char* Failed = "failed";
+
+	static constexpr std::uint32_t StepInterval = 10; // ms between steps, so the TCP task and other jobs get the lock
+
+	JobManager(StatementCache& statements, WorkerPool& workers);
+
+	void registerType(const std::string& type, Step step);
+	std::int64_t start(const std::string& type, std::int64_t ownerID, std::int64_t fileID, std::int64_t targetID, std::uint64_t total);
+	Job get(std::int64_t jobID, std::int64_t ownerID);
+	void resume();
+
+private:
+	StatementCache& m_statements;
+	WorkerPool& m_workers;
+	std::map<std::string, Step> m_types;
+
+	void schedule(std::int64_t jobID);
+	void run(std::int64_t jobID);
+	bool runStep(std::int64_t jobID); // true when the job is no longer running
+	bool load(std::int64_t jobID, Job& job);
+	void save(const Job& job);
+};
+
+#endif
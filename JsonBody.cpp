@@ -0,0 +1,250 @@
+// 
+// 
+// 
+
+#include "JsonBody.h"
+#include "HTTPError.h"
+#include <algorithm>
+#include <cctype>
+#include <cstddef>
+#include <cstring>
+#include <stdexcept>
+
+namespace {
+	constexpr size_t Alignment = alignof(std::max_align_t);
+	constexpr size_t Header = Alignment; // holds the allocation size, keeps the payload aligned
+
+	size_t alignUp(size_t size)
+	{
+		return (size + Alignment - 1) & ~(Alignment - 1);
+	}
+
+	// ArduinoJson custom reader over the body; stops right after each element, so the caller sees the separators
+	struct MemoryReader
+	{
+		const char* position;
+		const char* end;
+
+		int read()
+		{
+			return position < end ? static_cast<unsigned char>(*position++) : -1;
+		}
+
+		size_t readBytes(char* buffer, size_t length)
+		{
+			const size_t count = std::min<size_t>(length, end - position);
+			std::memcpy(buffer, position, count);
+			position += count;
+			return count;
+		}
+
+		char peek()
+		{
+			while (position < end && std::isspace(static_cast<unsigned char>(*position)))
+				++position;
+			return position < end ? *position : '\0';
+		}
+	};
+}
+
+void srv::ArenaAllocator::reset(uint8_t* begin, uint8_t* end)
+{
+	m_begin = std::min(reinterpret_cast<uint8_t*>(alignUp(reinterpret_cast<std::uintptr_t>(begin))), end);
+	m_top = m_begin;
+	m_end = end;
+	m_last = nullptr;
+}
+
+void* srv::ArenaAllocator::allocate(size_t size)
+{
+	const size_t required = Header + alignUp(size);
+	if (static_cast<size_t>(m_end - m_top) < required)
+		return nullptr; // surfaces as DeserializationError::NoMemory
+
+	*reinterpret_cast<size_t*>(m_top) = size;
+	m_last = m_top + Header;
+	m_top += required;
+	return m_last;
+}
+
+void srv::ArenaAllocator::deallocate(void* ptr)
+{
+	if (!ptr || ptr != m_last)
+		return;
+
+	m_top = m_last - Header;
+	m_last = nullptr;
+}
+
+void* srv::ArenaAllocator::reallocate(void* ptr, size_t newSize)
+{
+	if (!ptr)
+		return allocate(newSize);
+
+	uint8_t* block = static_cast<uint8_t*>(ptr);
+	if (block == m_last)
+	{
+		if (static_cast<size_t>(m_end - block) < alignUp(newSize))
+			return nullptr;
+
+		*reinterpret_cast<size_t*>(block - Header) = newSize;
+		m_top = block + alignUp(newSize);
+		return block;
+	}
+
+	const size_t oldSize = *reinterpret_cast<size_t*>(block - Header);
+	void* moved = allocate(newSize);
+	if (moved)
+		std::memcpy(moved, block, std::min(oldSize, newSize));
+	return moved;
+}
+
+srv::JsonBodyPool::JsonBodyPool(size_t blockSize, size_t slots, size_t maxBodySize, Parsing parsing)
+	:m_pool(blockSize, std::min(slots, MaxSlots)), m_slotCount(std::min(slots, MaxSlots)), m_maxBodySize(maxBodySize), m_parsing(parsing)
+{
+	if (maxBodySize >= blockSize)
+		throw std::invalid_argument("JSON body limit must leave room for the document arena");
+}
+
+srv::JsonBody srv::JsonBodyPool::receive(AsyncWebServerRequest* request, uint8_t* data, size_t len, size_t index, size_t total)
+{
+	Slot* slot = find(request);
+	if (!index)
+	{
+		if (total > m_maxBodySize)
+			throw HTTPError(413, "Request body too large");
+
+		slot = &acquire(request);
+		request->onDisconnect([this, request]()
+			{
+				if (Slot* abandoned = find(request))
+					release(*abandoned);
+			});
+
+		// Common case: the whole body arrived in one segment and is parsed where it lies
+		if (len == total)
+		{
+			complete(*slot, data, len, slot->block);
+			return JsonBody(*this, *slot);
+		}
+	}
+
+	if (!slot)
+		return JsonBody(); // refused at the first fragment, the error response is already out
+
+	std::memcpy(slot->block + index, data, len);
+	slot->fill = index + len;
+	if (slot->fill < total)
+		return JsonBody();
+
+	complete(*slot, slot->block, total, slot->block + total);
+	return JsonBody(*this, *slot);
+}
+
+void srv::JsonBodyPool::complete(Slot& slot, const uint8_t* body, size_t len, uint8_t* arenaBegin)
+{
+	slot.arena.reset(arenaBegin, slot.block + m_pool.getBlockSize());
+	slot.arenaBegin = arenaBegin;
+	slot.body = body;
+	slot.length = len;
+	if (m_parsing == Parsing::Document)
+		parse(slot, body, len);
+}
+
+srv::JsonBodyPool::Slot* srv::JsonBodyPool::find(AsyncWebServerRequest* request)
+{
+	for (size_t i = 0; i < m_slotCount; ++i)
+		if (m_slots[i].request == request)
+			return &m_slots[i];
+	return nullptr;
+}
+
+srv::JsonBodyPool::Slot& srv::JsonBodyPool::acquire(AsyncWebServerRequest* request)
+{
+	if (Slot* stale = find(request))
+		release(*stale); // the address of a finished request was reused
+
+	Slot* slot = find(nullptr);
+	uint8_t* block = slot ? m_pool.acquire() : nullptr;
+	if (!block)
+		throw HTTPError(503, "Server busy, try again later", 1);
+
+	slot->request = request;
+	slot->block = block;
+	slot->fill = 0;
+	return *slot;
+}
+
+void srv::JsonBodyPool::release(Slot& slot)
+{
+	slot.doc.reset();
+	m_pool.release(slot.block);
+	slot.request = nullptr;
+	slot.block = nullptr;
+	slot.fill = 0;
+	slot.body = nullptr;
+	slot.length = 0;
+	slot.arenaBegin = nullptr;
+}
+
+void srv::JsonBodyPool::parse(Slot& slot, const uint8_t* body, size_t len)
+{
+	slot.doc.emplace(&slot.arena);
+	const DeserializationError error = deserializeJson(*slot.doc, reinterpret_cast<const char*>(body), len);
+	if (!error)
+		return;
+
+	release(slot);
+	if (error == DeserializationError::NoMemory)
+		throw HTTPError(413, "Request body too complex");
+	throw error;
+}
+
+srv::JsonBody::~JsonBody()
+{
+	if (m_slot)
+		m_pool->release(*m_slot);
+}
+
+size_t srv::JsonBody::forEachElement(size_t maxElements, const std::function<void(JsonVariant element)>& callback)
+{
+	JsonBodyPool::Slot& slot = *m_slot;
+	MemoryReader reader{ reinterpret_cast<const char*>(slot.body), reinterpret_cast<const char*>(slot.body + slot.length) };
+	if (reader.peek() != '[')
+		throw HTTPError(400, "Request body must be an array");
+	reader.read();
+
+	size_t count = 0;
+	if (reader.peek() == ']')
+		return count;
+
+	while (true)
+	{
+		if (++count > maxElements)
+			throw HTTPError(400, "Too many elements in request body");
+
+		// Each element reuses the arena from the start, so only the largest one has to fit
+		slot.doc.reset();
+		slot.arena.reset(slot.arenaBegin, slot.block + m_pool->m_pool.getBlockSize());
+		slot.doc.emplace(&slot.arena);
+		const DeserializationError error = deserializeJson(*slot.doc, reader);
+		if (error == DeserializationError::NoMemory)
+			throw HTTPError(413, "Request body element too complex");
+		if (error)
+			throw error;
+		callback(slot.doc->as<JsonVariant>());
+
+		const char separator = reader.peek();
+		reader.read();
+		if (separator == ']')
+			return count;
+		if (separator != ',')
+			throw HTTPError(400, "Malformed array in request body");
+	}
+}
+
+srv::JsonBody::JsonBody(JsonBody&& other) noexcept
+	:m_pool(other.m_pool), m_slot(other.m_slot)
+{
+	other.m_slot = nullptr;
+}
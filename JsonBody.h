@@ -0,0 +1,122 @@
+// JsonBody.h
+
+#ifndef _JsonBody_h
+#define _JsonBody_h
+
+#if defined(ARDUINO) && ARDUINO >= 100
+#include "arduino.h"
+#else
+#include "WProgram.h"
+#endif
+
+#include "BufferPool.h"
+#include <ESPAsyncWebServer.h>
+#include <ArduinoJson.h>
+#include <array>
+#include <cstdint>
+#include <functional>
+#include <optional>
+
+namespace srv {
+	class ArenaAllocator;
+	class JsonBodyPool;
+	class JsonBody;
+}
+
+// Bump allocator over the tail of a pooled block, so a request's JsonDocument never touches the heap.
+// Freed memory is only reclaimed when it is the most recent allocation; the arena is reset per request.
+class srv::ArenaAllocator : public ArduinoJson::Allocator
+{
+public:
+	void reset(uint8_t* begin, uint8_t* end);
+
+	void* allocate(size_t size) override;
+	void deallocate(void* ptr) override;
+	void* reallocate(void* ptr, size_t newSize) override;
+
+private:
+	uint8_t* m_begin = nullptr;
+	uint8_t* m_top = nullptr;
+	uint8_t* m_end = nullptr;
+	uint8_t* m_last = nullptr; // most recent allocation, the only one that can grow or shrink in place
+};
+
+// Accumulates the fragments of JSON request bodies into pooled blocks and parses each body once it is
+// complete. One slot per pool block; a body larger than the limit is refused with 413, and running out of
+// slots with 503. The first part of a block holds the body, the rest is the document's arena. Pools in
+// Elements mode leave a top-level array unparsed so it can be walked one element at a time, which bounds
+// the arena by the largest element rather than the whole body.
+class srv::JsonBodyPool
+{
+public:
+	enum class Parsing
+	{
+		Document,
+		Elements
+	};
+
+	static constexpr size_t MaxSlots = 8;
+
+	JsonBodyPool(size_t blockSize, size_t slots, size_t maxBodySize, Parsing parsing = Parsing::Document);
+
+	JsonBodyPool(const JsonBodyPool&) = delete;
+	JsonBodyPool& operator=(const JsonBodyPool&) = delete;
+
+	// Empty until the last fragment arrives; the returned body releases its slot when it goes out of scope
+	JsonBody receive(AsyncWebServerRequest* request, uint8_t* data, size_t len, size_t index, size_t total);
+
+	size_t getMaxBodySize() const { return m_maxBodySize; }
+
+private:
+	friend class JsonBody;
+
+	struct Slot
+	{
+		AsyncWebServerRequest* request = nullptr;
+		uint8_t* block = nullptr;
+		size_t fill = 0;
+		const uint8_t* body = nullptr; // the complete body, in the block or still in the request's buffer
+		size_t length = 0;
+		uint8_t* arenaBegin = nullptr;
+		ArenaAllocator arena;
+		std::optional<JsonDocument> doc;
+	};
+
+	BufferPool m_pool;
+	size_t m_slotCount;
+	size_t m_maxBodySize;
+	Parsing m_parsing;
+	std::array<Slot, MaxSlots> m_slots;
+
+	Slot* find(AsyncWebServerRequest* request);
+	Slot& acquire(AsyncWebServerRequest* request);
+	void release(Slot& slot);
+	void parse(Slot& slot, const uint8_t* body, size_t len);
+	void complete(Slot& slot, const uint8_t* body, size_t len, uint8_t* arenaBegin);
+};
+
+// A fully received and parsed request body, valid for the rest of the handler
+class srv::JsonBody
+{
+public:
+	JsonBody() = default;
+	JsonBody(JsonBodyPool& pool, JsonBodyPool::Slot& slot) : m_pool(&pool), m_slot(&slot) {}
+	~JsonBody();
+
+	JsonBody(JsonBody&& other) noexcept;
+	JsonBody& operator=(JsonBody&&) = delete;
+
+	explicit operator bool() const { return m_slot; }
+	JsonDocument& operator*() { return *m_slot->doc; }
+	JsonDocument* operator->() { return &*m_slot->doc; }
+
+	// Elements mode only: parses the body's top-level array one element at a time into the arena, handing each
+	// to callback; throws HTTPError 400 when the body is not an array or holds more than maxElements
+	size_t forEachElement(size_t maxElements, const std::function<void(JsonVariant element)>& callback);
+
+private:
+	JsonBodyPool* m_pool = nullptr;
+	JsonBodyPool::Slot* m_slot = nullptr;
+};
+
+#endif
@@ -0,0 +1,265 @@
+// 
+// 
+// 
+
+#include "Metrics.h"
+#include <esp_heap_caps.h>
+#include <algorithm>
+#include <cstring>
+
+void srv::Histogram::observe(std::uint32_t micros)
+{
+	size_t bucket = 0;
+	while (bucket < Bounds.size() && micros > Bounds[bucket])
+		++bucket;
+
+	m_buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+	m_sum.fetch_add(micros, std::memory_order_relaxed);
+	m_count.fetch_add(1, std::memory_order_relaxed);
+}
+
+void srv::Histogram::render(String& out, const char* name, const String& labels) const
+{
+	const String prefix = labels.length() ? labels + "," : String();
+	std::uint32_t cumulative = 0;
+	for (size_t i = 0; i <= Bounds.size(); ++i)
+	{
+		cumulative += m_buckets[i].load(std::memory_order_relaxed);
+		out += name;
+		out += "_bucket{";
+		out += prefix;
+		out += "le=\"";
+		out += i < Bounds.size() ? String(Bounds[i] / 1e6, 3) : String("+Inf");
+		out += "\"} ";
+		out += cumulative;
+		out += "\n";
+	}
+
+	const String braced = labels.length() ? "{" + labels + "}" : String();
+	out += name;
+	out += "_sum";
+	out += braced;
+	out += " ";
+	out += String(m_sum.load(std::memory_order_relaxed) / 1e6, 6);
+	out += "\n";
+	out += name;
+	out += "_count";
+	out += braced;
+	out += " ";
+	out += m_count.load(std::memory_order_relaxed);
+	out += "\n";
+}
+
+srv::Metrics::Metrics()
+{
+	// Calibrates the instrumentation overhead so it can be checked against handler latencies on /api/metrics
+	constexpr std::uint32_t Samples = 256;
+	Histogram scratch;
+	const std::uint32_t start = micros();
+	for (std::uint32_t i = 0; i < Samples; ++i)
+		scratch.observe(i * 997);
+	m_observeCost = (micros() - start) * 1000 / Samples;
+}
+
+srv::Metrics::Route& srv::Metrics::addRoute(const std::string& pattern, WebRequestMethodComposite method)
+{
+	std::lock_guard<std::mutex> lock(m_registration);
+	m_routes.emplace_back();
+	Route& route = m_routes.back();
+	route.pattern = pattern;
+	route.method = method;
+	return route;
+}
+
+void srv::Metrics::recordError(const char* domain)
+{
+	size_t index = Domains.size() - 1;
+	for (size_t i = 0; domain && i < Domains.size(); ++i)
+		if (std::strcmp(domain, Domains[i]) == 0)
+			index = i;
+
+	m_errors[index].fetch_add(1, std::memory_order_relaxed);
+}
+
+void srv::Metrics::addDiskRead(std::int64_t diskID, size_t bytes)
+{
+	if (DiskCounters* disk = findDisk(diskID))
+		disk->bytesRead.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+void srv::Metrics::addDiskWrite(std::int64_t diskID, size_t bytes)
+{
+	if (DiskCounters* disk = findDisk(diskID))
+		disk->bytesWritten.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+srv::Metrics::DiskCounters* srv::Metrics::findDisk(std::int64_t diskID)
+{
+	const std::int32_t id = static_cast<std::int32_t>(diskID);
+	for (DiskCounters& disk : m_disks)
+		if (disk.diskID.load(std::memory_order_relaxed) == id)
+			return &disk;
+
+	// First I/O on this disk claims a free slot; later disks beyond MaxDisks go uncounted
+	for (DiskCounters& disk : m_disks)
+	{
+		std::int32_t expected = -1;
+		if (disk.diskID.compare_exchange_strong(expected, id) || expected == id)
+			return &disk;
+	}
+	return nullptr;
+}
+
+srv::Metrics::Reader::Reader(const Metrics& metrics, std::function<void(String&)> trailer)
+	:m_metrics(metrics), m_trailer(std::move(trailer)), m_stage(Stage::Header), m_route(metrics.m_routes.begin()), m_pendingOffset(0)
+{
+}
+
+size_t srv::Metrics::Reader::read(uint8_t* buffer, size_t maxLen)
+{
+	while (m_pendingOffset >= m_pending.length())
+	{
+		m_pending = String();
+		m_pendingOffset = 0;
+		if (!fill())
+			return 0;
+	}
+
+	const size_t count = std::min<size_t>(maxLen, m_pending.length() - m_pendingOffset);
+	std::memcpy(buffer, m_pending.c_str() + m_pendingOffset, count);
+	m_pendingOffset += count;
+	return count;
+}
+
+bool srv::Metrics::Reader::fill()
+{
+	switch (m_stage)
+	{
+	case Stage::Header:
+		m_pending += "# TYPE nas_http_handler_seconds histogram\n";
+		m_stage = Stage::Routes;
+		return true;
+	case Stage::Routes:
+		if (m_route != m_metrics.m_routes.end())
+		{
+			m_metrics.renderRoute(*m_route++, m_pending); // may be empty; read() then asks again
+			return true;
+		}
+		m_metrics.renderTotals(m_pending);
+		m_stage = Stage::Trailer;
+		return true;
+	case Stage::Trailer:
+		if (m_trailer)
+			m_trailer(m_pending);
+		m_stage = Stage::Done;
+		return true;
+	default:
+		return false;
+	}
+}
+
+void srv::Metrics::renderRoute(const Route& route, String& out) const
+{
+	static const char* phases[] = { "request", "body", "upload" };
+	for (size_t phase = 0; phase < route.phases.size(); ++phase)
+	{
+		if (route.phases[phase].isEmpty())
+			continue; // body and upload phases of routes that take neither, and routes not yet requested
+
+		String labels = "route=\"";
+		labels += route.pattern.c_str();
+		labels += "\",method=\"";
+		labels += methodName(route.method);
+		labels += "\",phase=\"";
+		labels += phases[phase];
+		labels += "\"";
+		route.phases[phase].render(out, "nas_http_handler_seconds", labels);
+	}
+}
+
+void srv::Metrics::renderTotals(String& out) const
+{
+	out += "# TYPE nas_http_errors_total counter\n";
+	for (const Route& route : m_routes)
+	{
+		out += "nas_http_errors_total{route=\"";
+		out += route.pattern.c_str();
+		out += "\",method=\"";
+		out += methodName(route.method);
+		out += "\"} ";
+		out += route.errors.load(std::memory_order_relaxed);
+		out += "\n";
+	}
+
+	out += "# TYPE nas_errors_total counter\n";
+	for (size_t i = 0; i < Domains.size(); ++i)
+	{
+		out += "nas_errors_total{domain=\"";
+		out += Domains[i];
+		out += "\"} ";
+		out += m_errors[i].load(std::memory_order_relaxed);
+		out += "\n";
+	}
+
+	out += "# TYPE nas_disk_read_bytes_total counter\n# TYPE nas_disk_written_bytes_total counter\n";
+	for (const DiskCounters& disk : m_disks)
+	{
+		const std::int32_t diskID = disk.diskID.load(std::memory_order_relaxed);
+		if (diskID < 0)
+			continue;
+
+		const String label = "{disk=\"" + String(static_cast<long>(diskID)) + "\"} ";
+		out += "nas_disk_read_bytes_total" + label + String(static_cast<double>(disk.bytesRead.load(std::memory_order_relaxed)), 0) + "\n";
+		out += "nas_disk_written_bytes_total" + label + String(static_cast<double>(disk.bytesWritten.load(std::memory_order_relaxed)), 0) + "\n";
+	}
+
+	out += "# TYPE nas_sqlite_prepare_seconds histogram\n";
+	m_prepareTimes.render(out, "nas_sqlite_prepare_seconds", String());
+	out += "# TYPE nas_sqlite_statement_seconds histogram\n";
+	m_statementTimes.render(out, "nas_sqlite_statement_seconds", String());
+	out += "# TYPE nas_sqlite_statement_cache_hits_total counter\nnas_sqlite_statement_cache_hits_total ";
+	out += m_statementCacheHits.load(std::memory_order_relaxed);
+	out += "\n# TYPE nas_sqlite_transaction_seconds histogram\n";
+	m_transactionTimes.render(out, "nas_sqlite_transaction_seconds", String());
+
+	out += "# TYPE nas_worker_job_seconds histogram\n";
+	m_workerJobTimes.render(out, "nas_worker_job_seconds", String());
+	out += "# TYPE nas_worker_rejected_total counter\nnas_worker_rejected_total ";
+	out += m_workerRejections.load(std::memory_order_relaxed);
+	out += "\n";
+
+	out += "# TYPE nas_heap_free_bytes gauge\nnas_heap_free_bytes ";
+	out += heap_caps_get_free_size(MALLOC_CAP_INTERNAL); // PSRAM is reported on its own below
+	out += "\n# TYPE nas_heap_min_free_bytes gauge\nnas_heap_min_free_bytes ";
+	out += heap_caps_get_minimum_free_size(MALLOC_CAP_INTERNAL); // low-water mark since boot
+	out += "\n# TYPE nas_heap_largest_free_block_bytes gauge\nnas_heap_largest_free_block_bytes ";
+	out += heap_caps_get_largest_free_block(MALLOC_CAP_INTERNAL);
+	out += "\n# TYPE nas_psram_free_bytes gauge\nnas_psram_free_bytes ";
+	out += heap_caps_get_free_size(MALLOC_CAP_SPIRAM);
+	out += "\n";
+
+	out += "# TYPE nas_metrics_observe_seconds gauge\nnas_metrics_observe_seconds ";
+	out += String(m_observeCost / 1e9, 9);
+	out += "\n";
+}
+
+const char* srv::Metrics::methodName(WebRequestMethodComposite method)
+{
+	switch (method)
+	{
+	case HTTP_GET:
+		return "GET";
+	case HTTP_POST:
+		return "POST";
+	case HTTP_DELETE:
+		return "DELETE";
+	case HTTP_PUT:
+		return "PUT";
+	case HTTP_PATCH:
+		return "PATCH";
+	case HTTP_HEAD:
+		return "HEAD";
+	default:
+		return "OTHER";
+	}
+}
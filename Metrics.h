@@ -0,0 +1,141 @@
+// Metrics.h
+
+#ifndef _Metrics_h
+#define _Metrics_h
+
+#if defined(ARDUINO) && ARDUINO >= 100
+#include "arduino.h"
+#else
+#include "WProgram.h"
+#endif
+
+#include <ESPAsyncWebServer.h>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <string>
+
+namespace srv {
+	class Histogram;
+	class Metrics;
+}
+
+// Fixed-bucket latency histogram in microseconds. Observations are relaxed atomic increments, so
+// recording never takes a lock; 64-bit sums fall back to a short critical section on 32-bit cores.
+class srv::Histogram
+{
+public:
+	static constexpr std::array<std::uint32_t, 10> Bounds = { 1000, 5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000, 2500000 };
+
+	void observe(std::uint32_t micros);
+	void render(String& out, const char* name, const String& labels) const; // Prometheus text format
+	bool isEmpty() const { return !m_count.load(std::memory_order_relaxed); }
+
+private:
+	std::array<std::atomic<std::uint32_t>, Bounds.size() + 1> m_buckets{};
+	std::atomic<std::uint64_t> m_sum{ 0 };
+	std::atomic<std::uint32_t> m_count{ 0 };
+};
+
+// Counters behind GET /api/metrics, created once in setup() and handed by reference to whatever records into
+// them. Routes and disks are registered at startup; everything recorded afterwards is lock-free apart from the
+// 64-bit totals.
+class srv::Metrics
+{
+public:
+	enum class Phase
+	{
+		Request,
+		Body,
+		Upload
+	};
+
+	struct Route
+	{
+		std::string pattern;
+		WebRequestMethodComposite method;
+		std::atomic<std::uint32_t> errors{ 0 };
+		std::array<Histogram, 3> phases; // indexed by Phase; the Request count is the request count
+
+		void observe(Phase phase, std::uint32_t micros) { phases[static_cast<size_t>(phase)].observe(micros); }
+	};
+
+	// Produces the text format a route at a time for a chunked response, so the whole exposition, which grows
+	// with the route table, never has to sit in one String
+	class Reader
+	{
+	public:
+		Reader(const Metrics& metrics, std::function<void(String&)> trailer); // trailer appends the caller's own gauges
+		size_t read(uint8_t* buffer, size_t maxLen); // AwsResponseFiller
+
+	private:
+		enum class Stage
+		{
+			Header,
+			Routes, // then the totals
+			Trailer,
+			Done
+		};
+
+		const Metrics& m_metrics;
+		std::function<void(String&)> m_trailer;
+		Stage m_stage;
+		std::list<Route>::const_iterator m_route;
+		String m_pending;
+		size_t m_pendingOffset;
+
+		bool fill(); // false once everything is out
+	};
+
+	static constexpr size_t MaxDisks = 8;
+
+	Metrics();
+
+	Metrics(const Metrics&) = delete;
+	Metrics& operator=(const Metrics&) = delete;
+
+	Route& addRoute(const std::string& pattern, WebRequestMethodComposite method);
+	void recordError(const char* domain);
+
+	void addDiskRead(std::int64_t diskID, size_t bytes);
+	void addDiskWrite(std::int64_t diskID, size_t bytes);
+
+	Histogram& getPrepareTimes() { return m_prepareTimes; }
+	Histogram& getStatementTimes() { return m_statementTimes; } // first step to reset
+	Histogram& getTransactionTimes() { return m_transactionTimes; }
+	Histogram& getWorkerJobTimes() { return m_workerJobTimes; }
+	void countStatementCacheHit() { m_statementCacheHits.fetch_add(1, std::memory_order_relaxed); }
+	void countWorkerRejection() { m_workerRejections.fetch_add(1, std::memory_order_relaxed); }
+
+private:
+	struct DiskCounters
+	{
+		std::atomic<std::int32_t> diskID{ -1 }; // 32-bit so the slot lookup stays lock-free
+		std::atomic<std::uint64_t> bytesRead{ 0 };
+		std::atomic<std::uint64_t> bytesWritten{ 0 };
+	};
+
+	static constexpr std::array<const char*, 7> Domains = { "SQLite", "Disk", "File", "VFS", "JSON", "Server", "Unknown" };
+
+	std::mutex m_registration;
+	std::list<Route> m_routes; // stable addresses for the handlers holding them
+	std::array<std::atomic<std::uint32_t>, Domains.size()> m_errors{};
+	std::array<DiskCounters, MaxDisks> m_disks;
+	Histogram m_prepareTimes;
+	Histogram m_statementTimes;
+	Histogram m_transactionTimes;
+	Histogram m_workerJobTimes;
+	std::atomic<std::uint32_t> m_statementCacheHits{ 0 };
+	std::atomic<std::uint32_t> m_workerRejections{ 0 };
+	std::uint32_t m_observeCost; // nanoseconds per Histogram::observe, measured once at startup
+
+	DiskCounters* findDisk(std::int64_t diskID);
+	void renderRoute(const Route& route, String& out) const; // only the phases that have recorded anything
+	void renderTotals(String& out) const; // everything after the handler histograms
+	static const char* methodName(WebRequestMethodComposite method);
+};
+
+#endif
@@ -0,0 +1,140 @@
+// 
+// 
+// 
+
+#include "PermissionCache.h"
+#include "HTTPError.h"
+
+srv::PermissionCache::PermissionCache(StatementCache& statements, size_t capacity)
+	:m_statements(statements), m_capacity(capacity), m_size(0), m_hits(0), m_misses(0)
+{
+}
+
+std::uint8_t srv::PermissionCache::getPermissions(std::int64_t userID, std::int64_t fileID)
+{
+	auto& files = m_users[userID];
+	auto it = files.find(fileID);
+	if (it != files.end())
+	{
+		++m_hits;
+		return it->second;
+	}
+
+	++m_misses;
+	const std::uint8_t permissions = resolve(userID, fileID);
+
+	if (m_size >= m_capacity)
+	{
+		// Keep the requesting user's working set; other users are re-resolved on demand
+		for (auto user = m_users.begin(); user != m_users.end();)
+		{
+			if (user->first == userID)
+			{
+				++user;
+				continue;
+			}
+			m_size -= user->second.size();
+			user = m_users.erase(user);
+		}
+
+		if (m_size >= m_capacity)
+		{
+			m_size -= files.size();
+			files.clear();
+		}
+	}
+
+	files.emplace(fileID, permissions);
+	++m_size;
+	return permissions;
+}
+
+void srv::PermissionCache::require(std::int64_t userID, std::int64_t fileID, Permission permission)
+{
+	if (!hasPermission(userID, fileID, permission))
+		throw HTTPError(403, "Permission denied");
+}
+
+void srv::PermissionCache::onRowChange(const RowChange& change)
+{
+	const RowChange::Operation operation = change.getOperation();
+
+	if (change.isTable("UserFilePermissions"))
+	{
+		if (operation != RowChange::Operation::Insert)
+			eraseUser(change.getOldValue<std::int64_t>(UserFilePermissionsColumn::UserID));
+		if (operation != RowChange::Operation::Delete)
+			eraseUser(change.getNewValue<std::int64_t>(UserFilePermissionsColumn::UserID));
+		return;
+	}
+
+	if (!change.isTable("FileEntries") || operation == RowChange::Operation::Insert)
+		return;
+
+	if (operation == RowChange::Operation::Delete)
+		return eraseFile(change.getOldRowID()); // cascaded deletes of descendants arrive as their own changes
+
+	// Re-parenting or a new owner changes inherited rights of the whole subtree, for every user
+	if (change.hasColumnChanged<std::int64_t>(FileEntriesColumn::ParentID) || change.hasColumnChanged<std::int64_t>(FileEntriesColumn::OwnerID))
+		clear();
+}
+
+void srv::PermissionCache::clear()
+{
+	m_users.clear();
+	m_size = 0;
+}
+
+std::uint8_t srv::PermissionCache::resolve(std::int64_t userID, std::int64_t fileID)
+{
+	CachedStatement statement = m_statements.prepare(
+		"WITH RECURSIVE Ancestors(ID, ParentID, OwnerID) AS ("
+		"SELECT ID, ParentID, OwnerID FROM FileEntries WHERE ID = ?1 "
+		"UNION ALL "
+		"SELECT f.ID, f.ParentID, f.OwnerID FROM FileEntries f JOIN Ancestors a ON f.ID = a.ParentID"
+		") SELECT a.OwnerID = ?2, COALESCE(p.Permission, ''), "
+		"EXISTS (SELECT 1 FROM BackgroundJobs j WHERE j.FileID = a.ID AND j.Type = 'delete' AND j.State = 'running') "
+		"FROM Ancestors a "
+		"LEFT JOIN UserFilePermissions p ON p.FileID = a.ID AND p.UserID = ?2"
+	);
+	statement.bind(1, fileID);
+	statement.bind(2, userID);
+
+	std::uint8_t permissions = None;
+	while (statement.evaluate())
+	{
+		if (statement.getColumnValue<std::int64_t>(2))
+			return None; // inside a subtree being deleted in the background
+		if (statement.getColumnValue<std::int64_t>(0))
+			permissions |= All;
+		permissions |= parsePermission(statement.getColumnValue<std::string>(1));
+	}
+	return permissions;
+}
+
+void srv::PermissionCache::eraseUser(std::int64_t userID)
+{
+	auto user = m_users.find(userID);
+	if (user == m_users.end())
+		return;
+
+	m_size -= user->second.size();
+	m_users.erase(user);
+}
+
+void srv::PermissionCache::eraseFile(std::int64_t fileID)
+{
+	for (auto& [userID, files] : m_users)
+		m_size -= files.erase(fileID);
+}
+
+std::uint8_t srv::PermissionCache::parsePermission(const std::string& permission)
+{
+	if (permission == "read")
+		return Read;
+	if (permission == "write")
+		return Read | Write;
+	if (permission == "owner")
+		return All;
+	return None;
+}
@@ -0,0 +1,65 @@
+// PermissionCache.h
+
+#ifndef _PermissionCache_h
+#define _PermissionCache_h
+
+#if defined(ARDUINO) && ARDUINO >= 100
+#include "arduino.h"
+#else
+#include "WProgram.h"
+#endif
+
+#include "StatementCache.h"
+#include "PreupdateHook.h"
+#include <cstdint>
+#include <unordered_map>
+
+namespace srv {
+	class PermissionCache;
+}
+
+// Effective rights of a user on a file: ownership of, and UserFilePermissions grants on, the file or any
+// ancestor directory. Resolved with one query on a miss, kept per user and invalidated by the preupdate hook.
+class srv::PermissionCache
+{
+public:
+	enum Permission : std::uint8_t
+	{
+		None = 0,
+		Read = 1 << 0,
+		Write = 1 << 1,
+		Owner = 1 << 2,
+		All = Read | Write | Owner
+	};
+
+	PermissionCache(StatementCache& statements, size_t capacity = 512);
+
+	std::uint8_t getPermissions(std::int64_t userID, std::int64_t fileID);
+	bool hasPermission(std::int64_t userID, std::int64_t fileID, Permission permission)
+	{
+		return (getPermissions(userID, fileID) & permission) == permission;
+	}
+	void require(std::int64_t userID, std::int64_t fileID, Permission permission); // throws HTTPError 403
+
+	void onRowChange(const RowChange& change);
+	void clear();
+
+	std::uint32_t getHits() const { return m_hits; }
+	std::uint32_t getMisses() const { return m_misses; }
+	size_t getSize() const { return m_size; }
+
+private:
+	StatementCache& m_statements;
+	size_t m_capacity;
+	size_t m_size;
+	std::unordered_map<std::int64_t, std::unordered_map<std::int64_t, std::uint8_t>> m_users;
+	std::uint32_t m_hits;
+	std::uint32_t m_misses;
+
+	std::uint8_t resolve(std::int64_t userID, std::int64_t fileID);
+	void eraseUser(std::int64_t userID);
+	void eraseFile(std::int64_t fileID);
+	static std::uint8_t parsePermission(const std::string& permission);
+};
+
+#endif
@@ -0,0 +1,37 @@
+// 
+// 
+// 
+
+#include "PreupdateHook.h"
+#include <sqlite3.h>
+
+srv::RowChange::RowChange(PreupdateData data)
+	:m_data(data), m_table(m_data.tableName)
+{
+	switch (data.operation)
+	{
+	case SQLITE_INSERT:
+		m_operation = Operation::Insert;
+		break;
+	case SQLITE_DELETE:
+		m_operation = Operation::Delete;
+		break;
+	default:
+		m_operation = Operation::Update;
+		break;
+	}
+}
+
+srv::PreupdateHook::PreupdateHook(vfs::Filesystem& vfs)
+	:m_vfs(vfs)
+{
+}
+
+void srv::PreupdateHook::callback(PreupdateHook& hook, PreupdateData data)
+{
+	vfs::Filesystem::preupdateCallback(hook.m_vfs, data);
+
+	const RowChange change(data);
+	for (const Listener& listener : hook.m_listeners)
+		listener(change);
+}
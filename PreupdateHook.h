@@ -0,0 +1,102 @@
+// PreupdateHook.h
+
+#ifndef _PreupdateHook_h
+#define _PreupdateHook_h
+
+#if defined(ARDUINO) && ARDUINO >= 100
+#include "arduino.h"
+#else
+#include "WProgram.h"
+#endif
+
+#include "VFS.h"
+#include <cstdint>
+#include <functional>
+#include <string_view>
+#include <vector>
+
+namespace srv {
+	class PreupdateHook;
+	class RowChange;
+
+	namespace detail {
+		template<typename>
+		struct PreupdateCallbackTraits;
+
+		template<typename Context, typename Data>
+		struct PreupdateCallbackTraits<void(*)(Context&, Data)>
+		{
+			using DataType = Data;
+		};
+	}
+
+	// Whatever vfs::Filesystem::preupdateCallback receives, so both callbacks share the beforeRowUpdate signature
+	using PreupdateData = detail::PreupdateCallbackTraits<decltype(&vfs::Filesystem::preupdateCallback)>::DataType;
+
+	// Column indices as declared in initialiseDatabase(); Size is appended by the version 2 migration
+	struct FileEntriesColumn
+	{
+		enum { ID, OwnerID, DiskID, ParentID, Name, Size, MTime };
+	};
+
+	struct UserFilePermissionsColumn
+	{
+		enum { UserID, FileID, Permission };
+	};
+}
+
+// A row about to be inserted, updated or deleted, as seen by the SQLite preupdate hook
+class srv::RowChange
+{
+public:
+	enum class Operation
+	{
+		Insert,
+		Update,
+		Delete
+	};
+
+	explicit RowChange(PreupdateData data);
+
+	Operation getOperation() const { return m_operation; }
+	bool isTable(std::string_view table) const { return m_table == table; }
+	std::int64_t getOldRowID() const { return m_data.oldRowID; }
+	std::int64_t getNewRowID() const { return m_data.newRowID; }
+
+	// Only valid for Update/Delete and Insert/Update respectively
+	template<typename T>
+	T getOldValue(int column) const { return m_data.template getOldValue<T>(column); }
+	template<typename T>
+	T getNewValue(int column) const { return m_data.template getNewValue<T>(column); }
+
+	template<typename T>
+	bool hasColumnChanged(int column) const
+	{
+		return m_operation != Operation::Update || getOldValue<T>(column) != getNewValue<T>(column);
+	}
+
+private:
+	PreupdateData m_data;
+	Operation m_operation;
+	std::string_view m_table;
+};
+
+// Single registration point for the connection's preupdate hook: forwards to vfs::Filesystem first,
+// then to the server-side caches that must stay exact.
+class srv::PreupdateHook
+{
+public:
+	using Listener = std::function<void(const RowChange&)>;
+
+	explicit PreupdateHook(vfs::Filesystem& vfs);
+
+	void addListener(Listener listener) { m_listeners.push_back(std::move(listener)); }
+
+	static void callback(PreupdateHook& hook, PreupdateData data);
+
+private:
+	vfs::Filesystem& m_vfs;
+	std::vector<Listener> m_listeners;
+};
+
+#endif
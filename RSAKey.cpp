@@ -0,0 +1,105 @@
+// 
+// 
+// 
+
+#include "RSAKey.h"
+#include <mbedtls/sha256.h>
+#include <mbedtls/md.h>
+#include <esp_random.h>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+
+srv::RSAKey::RSAKey()
+	:m_isLoaded(false)
+{
+	mbedtls_pk_init(&m_context);
+}
+
+srv::RSAKey::~RSAKey()
+{
+	mbedtls_pk_free(&m_context);
+}
+
+void srv::RSAKey::loadPrivateKeyFile(const std::string& path)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	reset();
+	const std::string pem = readKeyFile(path);
+	const int result = mbedtls_pk_parse_key(&m_context, reinterpret_cast<const unsigned char*>(pem.c_str()), pem.size() + 1, nullptr, 0, &RSAKey::random, nullptr);
+	if (result != 0)
+		throw std::runtime_error("Failed to parse private key: " + path);
+
+	m_isLoaded = true;
+}
+
+void srv::RSAKey::loadPublicKeyFile(const std::string& path)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	reset();
+	const std::string pem = readKeyFile(path);
+	const int result = mbedtls_pk_parse_public_key(&m_context, reinterpret_cast<const unsigned char*>(pem.c_str()), pem.size() + 1);
+	if (result != 0)
+		throw std::runtime_error("Failed to parse public key: " + path);
+
+	m_isLoaded = true;
+}
+
+JWT::ByteData srv::RSAKey::sign(const JWT::ByteData& data)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (!m_isLoaded)
+		throw std::runtime_error("Private key not loaded");
+
+	unsigned char digest[32];
+	hash(data, digest);
+
+	JWT::ByteData signature(MBEDTLS_PK_SIGNATURE_MAX_SIZE);
+	size_t signatureLength = 0;
+	const int result = mbedtls_pk_sign(&m_context, MBEDTLS_MD_SHA256, digest, sizeof(digest), reinterpret_cast<unsigned char*>(signature.data()), signature.size(), &signatureLength, &RSAKey::random, nullptr);
+	if (result != 0)
+		throw std::runtime_error("Failed to sign JWT");
+
+	signature.resize(signatureLength);
+	return signature;
+}
+
+bool srv::RSAKey::verify(const JWT::ByteData& data, const JWT::ByteData& signature)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (!m_isLoaded)
+		throw std::runtime_error("Public key not loaded");
+
+	unsigned char digest[32];
+	hash(data, digest);
+
+	return mbedtls_pk_verify(&m_context, MBEDTLS_MD_SHA256, digest, sizeof(digest), reinterpret_cast<const unsigned char*>(signature.data()), signature.size()) == 0;
+}
+
+void srv::RSAKey::reset()
+{
+	mbedtls_pk_free(&m_context);
+	mbedtls_pk_init(&m_context);
+	m_isLoaded = false;
+}
+
+std::string srv::RSAKey::readKeyFile(const std::string& path)
+{
+	std::ifstream file(path, std::ios::binary);
+	if (!file)
+		throw std::runtime_error("Failed to open key file: " + path);
+
+	return { std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>() };
+}
+
+void srv::RSAKey::hash(const JWT::ByteData& data, unsigned char* digest)
+{
+	if (mbedtls_sha256(reinterpret_cast<const unsigned char*>(data.data()), data.size(), digest, 0) != 0)
+		throw std::runtime_error("Failed to hash JWT");
+}
+
+int srv::RSAKey::random(void*, unsigned char* output, size_t len)
+{
+	esp_fill_random(output, len);
+	return 0;
+}
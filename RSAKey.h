@@ -0,0 +1,50 @@
+// RSAKey.h
+
+#ifndef _RSAKey_h
+#define _RSAKey_h
+
+#if defined(ARDUINO) && ARDUINO >= 100
+#include "arduino.h"
+#else
+#include "WProgram.h"
+#endif
+
+#include "JWT.h"
+#include <mbedtls/pk.h>
+#include <mutex>
+#include <string>
+
+namespace srv {
+	class RSAKey;
+}
+
+// Parsed RS256 key, kept in memory so signing and verifying do not re-read the PEM file from the SD card
+class srv::RSAKey
+{
+public:
+	RSAKey();
+	~RSAKey();
+
+	RSAKey(const RSAKey&) = delete;
+	RSAKey& operator=(const RSAKey&) = delete;
+
+	void loadPrivateKeyFile(const std::string& path);
+	void loadPublicKeyFile(const std::string& path);
+
+	JWT::ByteData sign(const JWT::ByteData& data);
+	bool verify(const JWT::ByteData& data, const JWT::ByteData& signature);
+
+	bool isLoaded() const { return m_isLoaded; }
+
+private:
+	mbedtls_pk_context m_context;
+	bool m_isLoaded;
+	std::mutex m_mutex; // signing happens on worker tasks, verifying on the async TCP task
+
+	void reset();
+	static std::string readKeyFile(const std::string& path);
+	static void hash(const JWT::ByteData& data, unsigned char* digest);
+	static int random(void*, unsigned char* output, size_t len);
+};
+
+#endif
@@ -0,0 +1,273 @@
+// 
+// 
+// 
+
+#include "Reconciler.h"
+#include <algorithm>
+#include <string>
+#include <vector>
+
+srv::Reconciler::Reconciler(StatementCache& statements, vfs::Filesystem& vfs, DiskPlacement& placement)
+	:m_statements(statements), m_vfs(vfs), m_placement(placement), m_scanCursor(0), m_isScanComplete(false), m_lastFlush(0), m_flushCursor(0)
+{
+}
+
+srv::Reconciler::Writer::Writer(Reconciler& reconciler, std::int64_t directoryID)
+	:m_reconciler(&reconciler), m_directoryID(directoryID)
+{
+	std::lock_guard<std::mutex> lock(m_reconciler->m_writersMutex);
+	++m_reconciler->m_writers[m_directoryID];
+}
+
+srv::Reconciler::Writer::~Writer()
+{
+	if (!m_reconciler)
+		return;
+
+	std::lock_guard<std::mutex> lock(m_reconciler->m_writersMutex);
+	auto it = m_reconciler->m_writers.find(m_directoryID);
+	if (it != m_reconciler->m_writers.end() && !--it->second)
+		m_reconciler->m_writers.erase(it);
+}
+
+srv::Reconciler::Writer::Writer(Writer&& other) noexcept
+	:m_reconciler(other.m_reconciler), m_directoryID(other.m_directoryID)
+{
+	other.m_reconciler = nullptr;
+}
+
+srv::Reconciler::Writer& srv::Reconciler::Writer::operator=(Writer&& other) noexcept
+{
+	if (this != &other)
+	{
+		this->~Writer();
+		m_reconciler = other.m_reconciler;
+		m_directoryID = other.m_directoryID;
+		other.m_reconciler = nullptr;
+	}
+	return *this;
+}
+
+size_t srv::Reconciler::reconcileDirty()
+{
+	DatabaseLock lock(m_statements.getMutex());
+
+	std::vector<std::int64_t> directories;
+	CachedStatement statement = m_statements.prepare(
+		"SELECT FileID FROM ScanCheckpoints WHERE Dirty = 1"
+	);
+	while (statement.evaluate())
+		directories.push_back(statement.getColumnValue<std::int64_t>(0));
+
+	for (std::int64_t directoryID : directories)
+	{
+		reconcile(directoryID);
+		saveCheckpoint(directoryID);
+	}
+	return directories.size();
+}
+
+void srv::Reconciler::runMaintenance()
+{
+	if (millis() - m_lastFlush >= FlushInterval)
+	{
+		m_lastFlush = millis();
+		flushCheckpoints();
+	}
+
+	if (!m_isScanComplete)
+		scanBatch();
+}
+
+void srv::Reconciler::flushCheckpoints()
+{
+	DatabaseLock lock(m_statements.getMutex());
+
+	std::vector<std::int64_t> directories;
+	CachedStatement statement = m_statements.prepare(
+		"SELECT FileID FROM ScanCheckpoints WHERE Dirty = 1 AND FileID > ? ORDER BY FileID LIMIT ?"
+	);
+	statement.bind(1, m_flushCursor);
+	statement.bind(2, CheckpointBatch);
+	while (statement.evaluate())
+		directories.push_back(statement.getColumnValue<std::int64_t>(0));
+
+	m_flushCursor = directories.size() < static_cast<size_t>(CheckpointBatch) ? 0 : directories.back();
+
+	// Changes made this session went through the VFS, so the disk already matches; only the stats are recorded
+	Transaction transaction(m_statements);
+	for (std::int64_t directoryID : directories)
+		if (!isBusy(directoryID))
+			saveCheckpoint(directoryID);
+	transaction.commit();
+}
+
+bool srv::Reconciler::isBusy(std::int64_t directoryID)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_writersMutex);
+		if (m_writers.count(directoryID))
+			return true;
+	}
+
+	// A running delete, copy or relocation anywhere above still changes the directory
+	CachedStatement statement = m_statements.prepare(
+		"WITH RECURSIVE Ancestors(ID) AS ("
+		"SELECT ?1 "
+		"UNION ALL "
+		"SELECT f.ParentID FROM FileEntries f JOIN Ancestors a ON f.ID = a.ID WHERE f.ParentID IS NOT NULL"
+		") SELECT EXISTS (SELECT 1 FROM Ancestors a JOIN BackgroundJobs j "
+		"ON j.FileID = a.ID OR (j.Type = 'copy' AND j.TargetID = a.ID) WHERE j.State = 'running')"
+	);
+	statement.bind(1, directoryID);
+	statement.evaluate();
+	return statement.getColumnValue<std::int64_t>(0);
+}
+
+void srv::Reconciler::scanBatch()
+{
+	DatabaseLock lock(m_statements.getMutex());
+
+	struct Checkpoint
+	{
+		std::int64_t id;
+		std::int64_t mtime;
+		std::int64_t size;
+	};
+	std::vector<Checkpoint> checkpoints;
+
+	CachedStatement statement = m_statements.prepare(
+		"SELECT FileID, MTime, Size FROM ScanCheckpoints "
+		"WHERE FileID > ? AND Dirty = 0 "
+		"ORDER BY FileID LIMIT ?"
+	);
+	statement.bind(1, m_scanCursor);
+	statement.bind(2, ScanBatch);
+	while (statement.evaluate())
+		checkpoints.push_back({
+			statement.getColumnValue<std::int64_t>(0),
+			statement.getColumnValue<std::int64_t>(1),
+			statement.getColumnValue<std::int64_t>(2)
+			});
+
+	if (checkpoints.size() < static_cast<size_t>(ScanBatch))
+		m_isScanComplete = true;
+
+	for (const Checkpoint& checkpoint : checkpoints)
+	{
+		m_scanCursor = checkpoint.id;
+		const std::optional<Stat> current = stat(checkpoint.id);
+		if (current && current->mtime == checkpoint.mtime && current->size == checkpoint.size)
+			continue;
+
+		log_i("Directory %lld changed on disk, reconciling", checkpoint.id);
+		reconcile(checkpoint.id);
+		saveCheckpoint(checkpoint.id);
+	}
+}
+
+void srv::Reconciler::reconcile(std::int64_t directoryID)
+{
+	struct Child
+	{
+		std::int64_t id;
+		std::int64_t ownerID;
+	};
+	std::vector<Child> children;
+
+	CachedStatement statement = m_statements.prepare(
+		"SELECT ID, OwnerID FROM FileEntries WHERE ParentID = ?"
+	);
+	statement.bind(1, directoryID);
+	while (statement.evaluate())
+		children.push_back({ statement.getColumnValue<std::int64_t>(0), statement.getColumnValue<std::int64_t>(1) });
+
+	Transaction transaction(m_statements);
+	for (const Child& child : children)
+	{
+		try
+		{
+			const std::string path = m_vfs.getInternalPath(child.id);
+
+			// A missing directory is only reported; its own checkpoint drops the files that went with it
+			if (m_vfs.isDirectory(child.id))
+			{
+				if (!stat(child.id))
+					log_w("Directory %lld missing on every disk: %s", child.id, path.c_str());
+				continue;
+			}
+
+			if (m_vfs.getDisk(child.id).getFS().exists(path.c_str()))
+				continue;
+
+			log_w("File %lld missing on disk, removing entry: %s", child.id, path.c_str());
+			m_vfs.removeFileEntry(child.id, child.ownerID);
+		}
+		catch (const std::exception& e)
+		{
+			log_e("Failed to reconcile entry %lld: %s", child.id, e.what());
+		}
+	}
+	transaction.commit();
+}
+
+std::optional<srv::Reconciler::Stat> srv::Reconciler::stat(std::int64_t fileID)
+{
+	try
+	{
+		const std::string path = m_vfs.getInternalPath(fileID);
+		if (!m_vfs.isDirectory(fileID))
+			return stat(m_vfs.getDisk(fileID).getFS(), path);
+
+		// The newest mtime and the summed sizes, so a change on any disk shows
+		std::optional<Stat> combined;
+		std::vector<fs::FS*> visited;
+		for (std::int64_t diskID : m_placement.getDisks())
+		{
+			fs::FS& fs = m_vfs.getDiskMap().getDiskByID(diskID).getFS();
+			if (std::find(visited.begin(), visited.end(), &fs) != visited.end())
+				continue;
+			visited.push_back(&fs);
+
+			const std::optional<Stat> copy = stat(fs, path);
+			if (!copy)
+				continue;
+			if (!combined)
+				combined = copy;
+			else
+			{
+				combined->mtime = std::max(combined->mtime, copy->mtime);
+				combined->size += copy->size;
+			}
+		}
+		return combined;
+	}
+	catch (const std::exception&)
+	{
+		return std::nullopt;
+	}
+}
+
+std::optional<srv::Reconciler::Stat> srv::Reconciler::stat(fs::FS& fs, const std::string& path)
+{
+	File file = fs.open(path.c_str());
+	if (!file)
+		return std::nullopt;
+
+	const Stat result{ static_cast<std::int64_t>(file.getLastWrite()), static_cast<std::int64_t>(file.size()) };
+	file.close();
+	return result;
+}
+
+void srv::Reconciler::saveCheckpoint(std::int64_t directoryID)
+{
+	const std::optional<Stat> current = stat(directoryID);
+
+	CachedStatement update = m_statements.prepare(
+		"UPDATE ScanCheckpoints SET MTime = ?, Size = ?, Dirty = 0 WHERE FileID = ?"
+	);
+	update.bind(1, current ? current->mtime : -1);
+	update.bind(2, current ? current->size : -1);
+	update.bind(3, directoryID);
+	update.evaluate();
+}
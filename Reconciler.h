@@ -0,0 +1,91 @@
+// Reconciler.h
+
+#ifndef _Reconciler_h
+#define _Reconciler_h
+
+#if defined(ARDUINO) && ARDUINO >= 100
+#include "arduino.h"
+#else
+#include "WProgram.h"
+#endif
+
+#include "VFS.h"
+#include "StatementCache.h"
+#include "DiskPlacement.h"
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <unordered_map>
+
+namespace srv {
+	class Reconciler;
+}
+
+// Keeps the persistent FileEntries table in step with the disks without walking the whole tree at boot.
+// Triggers flag a directory's ScanCheckpoints row dirty in the same transaction that changes its children;
+// checkpoints are re-recorded from loop() once the disk work is done. A directory still dirty at boot was
+// interrupted and is checked before the server starts; clean ones are compared against their recorded
+// mtime and size in the background afterwards. A checkpoint is only re-recorded once no upload is writing
+// into the directory and no running job covers it, so it never captures a half-written state.
+// A directory exists on every disk holding files beneath it, so directories are checked on all of them.
+// Reconciliation is one-way: entries whose data is missing are dropped, while files found on a disk without an
+// entry are left alone, since nothing records which user they would belong to.
+class srv::Reconciler
+{
+public:
+	// Marks a directory as being written to for as long as it lives
+	class Writer
+	{
+	public:
+		Writer() = default;
+		Writer(Reconciler& reconciler, std::int64_t directoryID);
+		~Writer();
+
+		Writer(Writer&& other) noexcept;
+		Writer& operator=(Writer&& other) noexcept;
+		Writer(const Writer&) = delete;
+		Writer& operator=(const Writer&) = delete;
+
+	private:
+		Reconciler* m_reconciler = nullptr;
+		std::int64_t m_directoryID = 0;
+	};
+
+	static constexpr std::int64_t CheckpointBatch = 32; // dirty directories recorded per flush
+	static constexpr std::int64_t ScanBatch = 8; // clean directories compared per maintenance pass
+	static constexpr std::uint32_t FlushInterval = 1000; // ms
+
+	Reconciler(StatementCache& statements, vfs::Filesystem& vfs, DiskPlacement& placement);
+
+	size_t reconcileDirty(); // returns the number of directories checked
+	void runMaintenance();
+
+	bool isScanComplete() const { return m_isScanComplete; }
+
+private:
+	struct Stat
+	{
+		std::int64_t mtime;
+		std::int64_t size;
+	};
+
+	StatementCache& m_statements;
+	vfs::Filesystem& m_vfs;
+	DiskPlacement& m_placement;
+	std::int64_t m_scanCursor;
+	bool m_isScanComplete;
+	std::uint32_t m_lastFlush;
+	std::int64_t m_flushCursor; // so directories skipped as busy do not hold back the ones after them
+	std::mutex m_writersMutex; // uploads come and go on the async_tcp task
+	std::unordered_map<std::int64_t, size_t> m_writers; // directory ID to open uploads
+
+	void flushCheckpoints();
+	bool isBusy(std::int64_t directoryID);
+	void scanBatch();
+	void reconcile(std::int64_t directoryID);
+	std::optional<Stat> stat(std::int64_t fileID); // for a directory, combined over every disk it exists on
+	static std::optional<Stat> stat(fs::FS& fs, const std::string& path);
+	void saveCheckpoint(std::int64_t directoryID);
+};
+
+#endif
@@ -0,0 +1,139 @@
+// 
+// 
+// 
+
+#include "RecursiveDelete.h"
+#include <optional>
+#include <utility>
+#include <vector>
+
+srv::RecursiveDelete::RecursiveDelete(StatementCache& statements, vfs::Filesystem& vfs, DiskPlacement& placement, PermissionCache& permissions, JobManager& jobs)
+	:m_statements(statements), m_vfs(vfs), m_placement(placement), m_permissions(permissions), m_jobs(jobs)
+{
+	m_jobs.registerType(JobType, [this](JobManager::Job& job) { return step(job); });
+}
+
+std::optional<std::int64_t> srv::RecursiveDelete::remove(std::int64_t fileID, std::int64_t userID)
+{
+	if (countSubtree(fileID, InlineLimit + 1) <= InlineLimit)
+	{
+		m_vfs.removeFileEntry(fileID, userID);
+		return std::nullopt;
+	}
+
+	Transaction transaction(m_statements);
+	const std::int64_t jobID = m_jobs.start(JobType, userID, fileID, 0, 1 + countChildren(fileID));
+	push(jobID, 0, fileID);
+
+	// Frees the name for reuse at once; the running job row is what hides the subtree from lookups
+	m_placement.rename(fileID, ".trash-" + std::to_string(jobID), userID);
+	m_permissions.clear();
+	transaction.commit();
+	return jobID;
+}
+
+std::uint64_t srv::RecursiveDelete::countSubtree(std::int64_t fileID, std::uint64_t limit)
+{
+	// The LIMIT on the recursive part ends the walk once enough rows exist, however large the subtree
+	CachedStatement statement = m_statements.prepare(
+		"WITH RECURSIVE Subtree(ID) AS ("
+		"SELECT ?1 "
+		"UNION ALL "
+		"SELECT f.ID FROM FileEntries f JOIN Subtree s ON f.ParentID = s.ID LIMIT ?2"
+		") SELECT COUNT(*) FROM Subtree"
+	);
+	statement.bind(1, fileID);
+	statement.bind(2, static_cast<std::int64_t>(limit));
+	statement.evaluate();
+	return statement.getColumnValue<std::int64_t>(0);
+}
+
+std::uint64_t srv::RecursiveDelete::countChildren(std::int64_t fileID)
+{
+	CachedStatement statement = m_statements.prepare("SELECT COUNT(*) FROM FileEntries WHERE ParentID = ?");
+	statement.bind(1, fileID);
+	statement.evaluate();
+	return statement.getColumnValue<std::int64_t>(0);
+}
+
+void srv::RecursiveDelete::push(std::int64_t jobID, std::int64_t depth, std::int64_t fileID)
+{
+	CachedStatement insert = m_statements.prepare("INSERT INTO DeleteEntries (JobID, Depth, FileID) VALUES (?, ?, ?)");
+	insert.bind(1, jobID);
+	insert.bind(2, depth);
+	insert.bind(3, fileID);
+	insert.evaluate();
+}
+
+bool srv::RecursiveDelete::step(JobManager::Job& job)
+{
+	// Entries are removed as their owner, since the job's owner may hold no rights over files others created within
+	CachedStatement top = m_statements.prepare(
+		"SELECT d.Depth, d.FileID, COALESCE(f.OwnerID, ?2) FROM DeleteEntries d LEFT JOIN FileEntries f ON f.ID = d.FileID "
+		"WHERE d.JobID = ?1 ORDER BY d.Depth DESC LIMIT 1"
+	);
+	top.bind(1, job.id);
+	top.bind(2, job.ownerID);
+	if (!top.evaluate())
+	{
+		push(job.id, 0, job.fileID); // started before the stack existed
+		return false;
+	}
+	const std::int64_t depth = top.getColumnValue<std::int64_t>(0);
+	const std::int64_t directoryID = top.getColumnValue<std::int64_t>(1);
+	const std::int64_t directoryOwnerID = top.getColumnValue<std::int64_t>(2);
+
+	CachedStatement children = m_statements.prepare(
+		"SELECT f.ID, EXISTS (SELECT 1 FROM FileEntries c WHERE c.ParentID = f.ID), f.OwnerID "
+		"FROM FileEntries f WHERE f.ParentID = ? LIMIT ?"
+	);
+	children.bind(1, directoryID);
+	children.bind(2, BatchSize);
+
+	std::vector<std::pair<std::int64_t, std::int64_t>> leaves; // ID, OwnerID
+	std::optional<std::int64_t> subdirectory;
+	while (children.evaluate())
+	{
+		if (children.getColumnValue<std::int64_t>(1))
+		{
+			subdirectory = children.getColumnValue<std::int64_t>(0);
+			break;
+		}
+		leaves.emplace_back(children.getColumnValue<std::int64_t>(0), children.getColumnValue<std::int64_t>(2));
+	}
+
+	try
+	{
+		// Leaves only, so no row cascades and each step touches at most BatchSize files on the card
+		for (const auto& [leafID, ownerID] : leaves)
+		{
+			m_vfs.removeFileEntry(leafID, ownerID);
+			++job.done;
+		}
+
+		if (subdirectory)
+		{
+			// Descend; this directory is revisited once the subdirectory is gone
+			push(job.id, depth + 1, *subdirectory);
+			job.total += countChildren(*subdirectory);
+			return false;
+		}
+		if (!leaves.empty())
+			return false;
+
+		// Empty now, so the directory itself is a leaf
+		m_vfs.removeFileEntry(directoryID, directoryOwnerID);
+		++job.done;
+	}
+	catch (...)
+	{
+		m_permissions.clear(); // a failed job stops hiding the remainder, which may have cached no rights
+		throw;
+	}
+
+	CachedStatement pop = m_statements.prepare("DELETE FROM DeleteEntries WHERE JobID = ? AND Depth = ?");
+	pop.bind(1, job.id);
+	pop.bind(2, depth);
+	pop.evaluate();
+	return directoryID == job.fileID;
+}
@@ -0,0 +1,52 @@
+// RecursiveDelete.h
+
+#ifndef _RecursiveDelete_h
+#define _RecursiveDelete_h
+
+#if defined(ARDUINO) && ARDUINO >= 100
+#include "arduino.h"
+#else
+#include "WProgram.h"
+#endif
+
+#include "VFS.h"
+#include "StatementCache.h"
+#include "PermissionCache.h"
+#include "DiskPlacement.h"
+#include "JobManager.h"
+#include <cstdint>
+#include <optional>
+
+namespace srv {
+	class RecursiveDelete;
+}
+
+// Deletes small subtrees inline. Larger ones are renamed out of the way and hidden straight away, then
+// reclaimed leaves-first in bounded batches by a "delete" background job. The job walks the subtree depth-first
+// through a stack of directories persisted in DeleteEntries, so each step only reads the children of the
+// directory on top and survives a reboot. Job.total grows as directories are opened, reaching the full count.
+class srv::RecursiveDelete
+{
+public:
+	static constexpr const char* JobType = "delete";
+	static constexpr std::uint64_t InlineLimit = 64; // entries removed within the request
+	static constexpr std::int64_t BatchSize = 16; // entries removed per job step
+
+	RecursiveDelete(StatementCache& statements, vfs::Filesystem& vfs, DiskPlacement& placement, PermissionCache& permissions, JobManager& jobs);
+
+	std::optional<std::int64_t> remove(std::int64_t fileID, std::int64_t userID); // the job ID if deferred
+
+private:
+	StatementCache& m_statements;
+	vfs::Filesystem& m_vfs;
+	DiskPlacement& m_placement;
+	PermissionCache& m_permissions;
+	JobManager& m_jobs;
+
+	std::uint64_t countSubtree(std::int64_t fileID, std::uint64_t limit); // stops counting at limit
+	std::uint64_t countChildren(std::int64_t fileID);
+	void push(std::int64_t jobID, std::int64_t depth, std::int64_t fileID);
+	bool step(JobManager::Job& job);
+};
+
+#endif
@@ -0,0 +1,171 @@
+// 
+// 
+// 
+
+#include "Router.h"
+#include "HTTPError.h"
+#include "ServerError.h"
+#include <algorithm>
+
+void srv::Router::addRoute(const std::string& pattern, WebRequestMethodComposite method, ArRequestHandlerFunction onRequest,
+	ArUploadHandlerFunction onUpload, ArBodyHandlerFunction onBody)
+{
+	Node* node = &m_root;
+	size_t paramCount = 0;
+	size_t start = 1; // patterns begin with '/'
+	while (start <= pattern.size())
+	{
+		size_t end = pattern.find('/', start);
+		if (end == std::string::npos)
+			end = pattern.size();
+		const std::string segment = pattern.substr(start, end - start);
+		start = end + 1;
+
+		if (segment.size() > 2 && segment.front() == '{' && segment.back() == '}')
+		{
+			if (++paramCount > MaxParams)
+				throw std::invalid_argument("Too many parameters in route " + pattern);
+			if (!node->param)
+				node->param = std::make_unique<Node>();
+			node = node->param.get();
+			continue;
+		}
+
+		auto literal = std::find_if(node->literals.begin(), node->literals.end(), [&](const auto& child) { return child.first == segment; });
+		if (literal == node->literals.end())
+		{
+			node->literals.emplace_back(segment, std::make_unique<Node>());
+			literal = node->literals.end() - 1;
+		}
+		node = literal->second.get();
+	}
+
+	node->endpoints.push_back({ method, onRequest, onUpload, onBody });
+}
+
+srv::Router::Match srv::Router::match(const String& path, WebRequestMethodComposite method) const
+{
+	Match result;
+	const std::string_view url(path.c_str(), path.length());
+	if (url.empty() || url.front() != '/')
+		return result;
+
+	const Node* node = &m_root;
+	size_t start = 1;
+	while (node && start <= url.size())
+	{
+		size_t end = url.find('/', start);
+		if (end == std::string_view::npos)
+			end = url.size();
+		const std::string_view segment = url.substr(start, end - start);
+		start = end + 1;
+
+		const Node* next = nullptr;
+		for (const auto& [literal, child] : node->literals)
+			if (literal == segment)
+			{
+				next = child.get();
+				break;
+			}
+
+		if (!next && node->param && !segment.empty()) // "/api/files/" names no file, so it is not found
+		{
+			next = node->param.get();
+			if (result.paramCount < MaxParams && !parseInteger(segment, result.params[result.paramCount++]))
+				result.isMalformed = true;
+		}
+		node = next;
+	}
+
+	if (!node)
+		return result;
+
+	for (const Endpoint& endpoint : node->endpoints)
+		if (endpoint.method & method)
+		{
+			result.endpoint = &endpoint;
+			break;
+		}
+	return result;
+}
+
+std::int64_t srv::Router::getParam(AsyncWebServerRequest* request, size_t index)
+{
+	const Match result = find(request);
+	if (result.isMalformed || index >= result.paramCount)
+		throw HTTPError(400, "Malformed path parameter");
+	return result.params[index];
+}
+
+bool srv::Router::canHandle(AsyncWebServerRequest* request)
+{
+	const Match result = match(request->url(), request->method());
+	if (!result.endpoint)
+		return false;
+
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		Pending* slot = nullptr;
+		for (Pending& pending : m_pending)
+			if (pending.request == request || (!slot && !pending.request))
+				slot = &pending; // a stale entry for a reused address is overwritten
+		if (!slot)
+		{
+			slot = &m_pending[m_nextPending];
+			m_nextPending = (m_nextPending + 1) % MaxPending;
+		}
+		slot->request = request;
+		slot->match = result;
+	}
+
+	request->addInterestingHeader("ANY");
+	return true;
+}
+
+void srv::Router::handleRequest(AsyncWebServerRequest* request)
+{
+	const Match result = find(request);
+	if (result.isMalformed)
+	{
+		release(request);
+		ErrorWrapper([](AsyncWebServerRequest*) { throw HTTPError(400, "Malformed path parameter"); }, m_metrics)(request);
+		return;
+	}
+
+	if (result.endpoint && result.endpoint->onRequest)
+		result.endpoint->onRequest(request);
+	release(request);
+}
+
+void srv::Router::handleUpload(AsyncWebServerRequest* request, const String& filename, size_t index, uint8_t* data, size_t len, bool final)
+{
+	const Match result = find(request);
+	if (!result.isMalformed && result.endpoint && result.endpoint->onUpload)
+		result.endpoint->onUpload(request, filename, index, data, len, final);
+}
+
+void srv::Router::handleBody(AsyncWebServerRequest* request, uint8_t* data, size_t len, size_t index, size_t total)
+{
+	const Match result = find(request);
+	if (!result.isMalformed && result.endpoint && result.endpoint->onBody)
+		result.endpoint->onBody(request, data, len, index, total);
+}
+
+srv::Router::Match srv::Router::find(AsyncWebServerRequest* request)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		for (const Pending& pending : m_pending)
+			if (pending.request == request)
+				return pending.match;
+	}
+	return match(request->url(), request->method());
+}
+
+void srv::Router::release(AsyncWebServerRequest* request)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	for (Pending& pending : m_pending)
+		if (pending.request == request)
+			pending.request = nullptr;
+}
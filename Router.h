@@ -0,0 +1,102 @@
+// Router.h
+
+#ifndef _Router_h
+#define _Router_h
+
+#if defined(ARDUINO) && ARDUINO >= 100
+#include "arduino.h"
+#else
+#include "WProgram.h"
+#endif
+
+#include "Metrics.h"
+#include <ESPAsyncWebServer.h>
+#include <array>
+#include <charconv>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace srv {
+	class Router;
+}
+
+// Segment trie over route patterns such as "/api/files/{id}". Matches path and method in one pass and
+// parses "{...}" segments as integers in place, so dispatch needs neither regex nor heap allocation.
+// The match made in canHandle is kept in a small table until handleRequest, so body and upload fragments and
+// getParam reuse it; a request pushed out of the table by MaxPending newer ones is simply matched again.
+class srv::Router : public AsyncWebHandler
+{
+public:
+	static constexpr size_t MaxParams = 4;
+	static constexpr size_t MaxPending = 16; // requests between canHandle and handleRequest, about one per socket
+
+	struct Endpoint
+	{
+		WebRequestMethodComposite method;
+		ArRequestHandlerFunction onRequest;
+		ArUploadHandlerFunction onUpload;
+		ArBodyHandlerFunction onBody;
+	};
+
+	struct Match
+	{
+		const Endpoint* endpoint = nullptr;
+		std::int64_t params[MaxParams];
+		size_t paramCount = 0;
+		bool isMalformed = false; // a parameter segment is not a valid integer
+	};
+
+	explicit Router(Metrics& metrics) : m_metrics(metrics) {}
+
+	void addRoute(const std::string& pattern, WebRequestMethodComposite method, ArRequestHandlerFunction onRequest,
+		ArUploadHandlerFunction onUpload = nullptr, ArBodyHandlerFunction onBody = nullptr);
+
+	Match match(const String& path, WebRequestMethodComposite method) const;
+	std::int64_t getParam(AsyncWebServerRequest* request, size_t index); // throws HTTPError 400
+
+	bool canHandle(AsyncWebServerRequest* request) override;
+	void handleRequest(AsyncWebServerRequest* request) override;
+	void handleUpload(AsyncWebServerRequest* request, const String& filename, size_t index, uint8_t* data, size_t len, bool final) override;
+	void handleBody(AsyncWebServerRequest* request, uint8_t* data, size_t len, size_t index, size_t total) override;
+	bool isRequestHandlerTrivial() override { return false; }
+
+	template<typename T>
+	static bool parseInteger(std::string_view text, T& value)
+	{
+		if (text.empty() || text.front() == '-')
+			return false; // identifiers and sizes are never negative
+		const char* end = text.data() + text.size();
+		auto [position, error] = std::from_chars(text.data(), end, value);
+		return error == std::errc() && position == end;
+	}
+
+private:
+	struct Node
+	{
+		std::vector<std::pair<std::string, std::unique_ptr<Node>>> literals;
+		std::unique_ptr<Node> param;
+		std::vector<Endpoint> endpoints;
+	};
+
+	struct Pending
+	{
+		AsyncWebServerRequest* request = nullptr;
+		Match match;
+	};
+
+	Metrics& m_metrics;
+	Node m_root;
+	std::mutex m_mutex; // getParam may run from a deferred job
+	std::array<Pending, MaxPending> m_pending;
+	size_t m_nextPending = 0; // round-robin victim when every slot is taken
+
+	Match find(AsyncWebServerRequest* request);
+	void release(AsyncWebServerRequest* request);
+};
+
+#endif
@@ -0,0 +1,249 @@
+// 
+// 
+// 
+
+#include "SearchIndex.h"
+#include <algorithm>
+
+srv::SearchIndex::SearchIndex(StatementCache& statements)
+	:m_statements(statements)
+{
+}
+
+void srv::SearchIndex::onRowChange(const RowChange& change)
+{
+	if (!change.isTable("FileEntries"))
+		return;
+
+	switch (change.getOperation())
+	{
+	case RowChange::Operation::Insert:
+		m_dirty.insert(change.getNewRowID());
+		break;
+	case RowChange::Operation::Delete:
+		m_dirty.insert(change.getOldRowID());
+		break;
+	case RowChange::Operation::Update:
+		if (change.hasColumnChanged<std::string>(FileEntriesColumn::Name))
+			m_dirty.insert(change.getOldRowID());
+		break;
+	}
+}
+
+void srv::SearchIndex::flush()
+{
+	DatabaseLock lock(m_statements.getMutex());
+	if (m_dirty.empty())
+		return;
+
+	// Re-indexing writes FileNameTrigrams only, so the hook adds nothing while the set is walked
+	std::unordered_set<std::int64_t> dirty;
+	dirty.swap(m_dirty);
+
+	try
+	{
+		Transaction transaction(m_statements);
+		for (std::int64_t fileID : dirty)
+			reindex(fileID);
+		transaction.commit();
+	}
+	catch (...)
+	{
+		// Everything was rolled back, so every row is still dirty
+		m_dirty.insert(dirty.begin(), dirty.end());
+		throw;
+	}
+}
+
+size_t srv::SearchIndex::rebuild()
+{
+	DatabaseLock lock(m_statements.getMutex());
+
+	// No row yet means an index from before progress was recorded, or none at all; rows are inserted idempotently
+	std::int64_t cursor = 0;
+	{
+		CachedStatement progress = m_statements.prepare("SELECT Cursor FROM SearchIndexRebuild");
+		if (progress.evaluate())
+			cursor = progress.getColumnValue<std::int64_t>(0);
+	}
+	if (cursor < 0)
+		return 0;
+
+	struct Row
+	{
+		std::int64_t id;
+		std::string name;
+	};
+	std::vector<Row> rows;
+	size_t indexed = 0;
+	do
+	{
+		rows.clear();
+		CachedStatement statement = m_statements.prepare(
+			"SELECT ID, Name FROM FileEntries "
+			"WHERE ID > ? AND ParentID IS NOT NULL AND Name IS NOT NULL "
+			"ORDER BY ID LIMIT ?"
+		);
+		statement.bind(1, cursor);
+		statement.bind(2, static_cast<std::int64_t>(RebuildBatch));
+		while (statement.evaluate())
+			rows.push_back({ statement.getColumnValue<std::int64_t>(0), statement.getColumnValue<std::string>(1) });
+
+		if (!rows.empty())
+			cursor = rows.back().id;
+
+		Transaction transaction(m_statements);
+		for (const Row& row : rows)
+			insert(row.id, row.name);
+		saveRebuildCursor(rows.size() == RebuildBatch ? cursor : -1);
+		transaction.commit();
+
+		indexed += rows.size();
+	} while (rows.size() == RebuildBatch);
+
+	return indexed;
+}
+
+std::int64_t srv::SearchIndex::search(const std::string& query, Mode mode, std::int64_t after, size_t maxScanned, const std::function<bool(const Match&)>& onMatch)
+{
+	DatabaseLock lock(m_statements.getMutex());
+
+	const std::string needle = fold(query);
+	const std::int64_t gram = pickRarestGram(needle, mode);
+
+	std::vector<Match> candidates;
+	candidates.reserve(CandidateBatch);
+	std::int64_t cursor = after;
+	size_t scanned = 0;
+	while (scanned < maxScanned)
+	{
+		// Collected before the callback runs, which may prepare statements of its own
+		candidates.clear();
+		const size_t batch = std::min<size_t>(CandidateBatch, maxScanned - scanned);
+		CachedStatement statement = m_statements.prepare(
+			"SELECT t.FileID, f.ParentID, f.Name FROM FileNameTrigrams t JOIN FileEntries f ON f.ID = t.FileID "
+			"WHERE t.Trigram = ? AND t.FileID > ? AND f.Name IS NOT NULL "
+			"ORDER BY t.FileID LIMIT ?"
+		);
+		statement.bind(1, gram);
+		statement.bind(2, cursor);
+		statement.bind(3, static_cast<std::int64_t>(batch));
+		while (statement.evaluate())
+			candidates.push_back({
+				statement.getColumnValue<std::int64_t>(0),
+				statement.getColumnValue<std::int64_t>(1),
+				statement.getColumnValue<std::string>(2)
+				});
+
+		if (candidates.empty())
+			return 0;
+
+		for (const Match& candidate : candidates)
+		{
+			cursor = candidate.id;
+			++scanned;
+
+			const std::string name = fold(candidate.name);
+			const size_t position = name.find(needle);
+			const bool isMatch = mode == Mode::Prefix ? position == 0 : position != std::string::npos;
+			if (isMatch && !onMatch(candidate))
+				return cursor;
+		}
+
+		if (candidates.size() < batch)
+			return 0;
+	}
+	return cursor;
+}
+
+bool srv::SearchIndex::isSearchable(const std::string& query, Mode mode)
+{
+	return mode == Mode::Prefix ? !query.empty() : query.size() >= MinSubstringLength;
+}
+
+void srv::SearchIndex::reindex(std::int64_t fileID)
+{
+	CachedStatement erase = m_statements.prepare("DELETE FROM FileNameTrigrams WHERE FileID = ?");
+	erase.bind(1, fileID);
+	erase.evaluate();
+
+	// Roots carry no name worth finding; rows deleted or renamed back by a rollback resolve to their committed state
+	CachedStatement select = m_statements.prepare(
+		"SELECT Name FROM FileEntries WHERE ID = ? AND ParentID IS NOT NULL AND Name IS NOT NULL"
+	);
+	select.bind(1, fileID);
+	if (!select.evaluate())
+		return;
+
+	insert(fileID, select.getColumnValue<std::string>(0));
+}
+
+void srv::SearchIndex::saveRebuildCursor(std::int64_t cursor)
+{
+	m_statements.prepare("DELETE FROM SearchIndexRebuild").evaluate();
+	CachedStatement statement = m_statements.prepare("INSERT INTO SearchIndexRebuild (Cursor) VALUES (?)");
+	statement.bind(1, cursor);
+	statement.evaluate();
+}
+
+void srv::SearchIndex::insert(std::int64_t fileID, const std::string& name)
+{
+	for (std::int64_t gram : grams(fold(name), true))
+	{
+		CachedStatement statement = m_statements.prepare(
+			"INSERT OR IGNORE INTO FileNameTrigrams (Trigram, FileID) VALUES (?, ?)"
+		);
+		statement.bind(1, gram);
+		statement.bind(2, fileID);
+		statement.evaluate();
+	}
+}
+
+std::int64_t srv::SearchIndex::pickRarestGram(const std::string& needle, Mode mode)
+{
+	std::int64_t rarest = 0;
+	std::int64_t rarestCount = SelectivityProbe + 1;
+	for (std::int64_t gram : grams(needle, mode == Mode::Prefix))
+	{
+		CachedStatement statement = m_statements.prepare(
+			"SELECT COUNT(*) FROM (SELECT 1 FROM FileNameTrigrams WHERE Trigram = ? LIMIT ?)"
+		);
+		statement.bind(1, gram);
+		statement.bind(2, SelectivityProbe);
+		statement.evaluate();
+		const std::int64_t count = statement.getColumnValue<std::int64_t>(0);
+		if (count < rarestCount)
+		{
+			rarest = gram;
+			rarestCount = count;
+		}
+		if (!count)
+			break; // nothing can match
+	}
+	return rarest;
+}
+
+std::string srv::SearchIndex::fold(const std::string& name)
+{
+	std::string folded(name);
+	for (char& c : folded)
+		if (c >= 'A' && c <= 'Z')
+			c = c - 'A' + 'a';
+	return folded;
+}
+
+std::vector<std::int64_t> srv::SearchIndex::grams(const std::string& folded, bool isAnchored)
+{
+	const std::string text = isAnchored ? std::string(2, '\0') + folded : folded;
+
+	std::vector<std::int64_t> result;
+	for (size_t i = 0; i + 3 <= text.size(); ++i)
+		result.push_back(
+			static_cast<std::int64_t>(static_cast<std::uint8_t>(text[i])) << 16
+			| static_cast<std::int64_t>(static_cast<std::uint8_t>(text[i + 1])) << 8
+			| static_cast<std::uint8_t>(text[i + 2]));
+
+	std::sort(result.begin(), result.end());
+	result.erase(std::unique(result.begin(), result.end()), result.end());
+	return result;
+}
@@ -0,0 +1,77 @@
+// SearchIndex.h
+
+#ifndef _SearchIndex_h
+#define _SearchIndex_h
+
+#if defined(ARDUINO) && ARDUINO >= 100
+#include "arduino.h"
+#else
+#include "WProgram.h"
+#endif
+
+#include "StatementCache.h"
+#include "PreupdateHook.h"
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+namespace srv {
+	class SearchIndex;
+}
+
+// Trigram index over FileEntries.Name in the FileNameTrigrams table, case-folded for ASCII. Names are padded
+// with two leading NULs so the anchored grams also answer prefix queries shorter than three characters.
+// The preupdate hook only marks rows dirty, since SQL must not run from inside the hook; dirty rows are
+// re-indexed from their committed state before each search and from loop(), which also makes rolled-back
+// changes harmless. Candidates are always checked against the live name, so a row left dirty by a reset
+// can be missed by a search but never returned wrongly. The initial build over an existing FileEntries table
+// records its progress in SearchIndexRebuild, so a reboot resumes it rather than leaving the index partial.
+class srv::SearchIndex
+{
+public:
+	enum class Mode
+	{
+		Prefix,
+		Substring
+	};
+
+	struct Match
+	{
+		std::int64_t id;
+		std::int64_t parentID;
+		std::string name;
+	};
+
+	static constexpr size_t MinSubstringLength = 3;
+	static constexpr size_t RebuildBatch = 256; // rows indexed per transaction by rebuild()
+	static constexpr std::int64_t CandidateBatch = 64; // postings read per query while searching
+	static constexpr std::int64_t SelectivityProbe = 4096; // postings counted per gram when picking the rarest
+
+	explicit SearchIndex(StatementCache& statements);
+
+	void onRowChange(const RowChange& change);
+	void flush(); // re-indexes dirty rows
+	size_t rebuild(); // finishes the initial build if it has not completed; returns the rows indexed
+
+	// Candidates in FileID order after `after`, verified against the name; stops after `maxScanned` candidates.
+	// Returns the cursor to resume from, or 0 once the postings are exhausted.
+	std::int64_t search(const std::string& query, Mode mode, std::int64_t after, size_t maxScanned, const std::function<bool(const Match&)>& onMatch);
+
+	static bool isSearchable(const std::string& query, Mode mode);
+
+private:
+	StatementCache& m_statements;
+	std::unordered_set<std::int64_t> m_dirty;
+
+	void reindex(std::int64_t fileID);
+	void saveRebuildCursor(std::int64_t cursor);
+	void insert(std::int64_t fileID, const std::string& name);
+	std::int64_t pickRarestGram(const std::string& query, Mode mode);
+
+	static std::string fold(const std::string& name);
+	static std::vector<std::int64_t> grams(const std::string& folded, bool isAnchored);
+};
+
+#endif
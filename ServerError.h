@@ -6,123 +6,159 @@
 #include "VFSError.h"
 #include "FileError.h"
 #include "DiskError.h"
+#include "HTTPError.h"
+#include "Metrics.h"
 #include <functional>
 
+// Fills in the fields of an error response for the exception currently being handled and returns its HTTP code.
+// Must only be called from inside a catch block.
+inline int describeCurrentException(JsonObject error)
+{
+	try
+	{
+		throw;
+	}
+	catch (const SQLite::SQLiteError& e)
+	{
+		error["code"] = 500;
+		error["domain"] = "SQLite";
+		error["message"] = e.what();
+		return 500;
+	}
+	catch (vfs::DiskError& e)
+	{
+		error["code"] = 500;
+		error["domain"] = "Disk";
+		error["message"] = e.what();
+		if (e.hasDisk())
+		{
+			error["location"] = e.getDisk().getMountpoint();
+			error["locationType"] = "Disk Mount Point";
+		}
+		return 500;
+	}
+	catch (const vfs::FileError& e)
+	{
+		error["code"] = 500;
+		error["domain"] = "File";
+		error["message"] = e.what();
+		if (e.hasFile())
+		{
+			error["location"] = e.getFile().fileID;
+			error["locationType"] = "File ID";
+		}
+		return 500;
+	}
+	catch (const vfs::VFSError& e)
+	{
+		error["code"] = 500;
+		error["domain"] = "VFS";
+		error["message"] = e.what();
+		return 500;
+	}
+	catch (const DeserializationError& e)
+	{
+		error["code"] = 400;
+		error["domain"] = "JSON";
+		error["message"] = e.c_str();
+		return 400;
+	}
+	catch (const srv::HTTPError& e)
+	{
+		error["code"] = e.getCode();
+		error["domain"] = "Server";
+		error["message"] = e.what();
+		if (e.getRetryAfter())
+			error["retryAfter"] = e.getRetryAfter();
+		return e.getCode();
+	}
+	catch (const std::exception& e)
+	{
+		error["code"] = 500;
+		error["domain"] = "Unknown";
+		error["message"] = e.what();
+		return 500;
+	}
+	catch (...)
+	{
+		error["code"] = 500;
+		error["domain"] = "Unknown";
+		error["message"] = "Unknown error";
+		return 500;
+	}
+}
+
+// Also the instrumentation point: errors are counted by domain, and with a route attached every handler invocation is timed
 template<typename T>
 class ErrorWrapper
 {
 public:
-	ErrorWrapper(T requestHandler) : m_requestHandler(requestHandler) {}
+	ErrorWrapper(T requestHandler, srv::Metrics& metrics, srv::Metrics::Route* route = nullptr) : m_requestHandler(requestHandler), m_metrics(metrics), m_route(route) {}
 
 	template<typename... Args>
 	void operator()(AsyncWebServerRequest* request, Args&&... args)
 	{
+		const std::uint32_t start = micros();
 		try
 		{
 			m_requestHandler(request, std::forward<Args>(args)...);
 		}
-		catch (const SQLite::SQLiteError& e)
-		{
-			JsonDocument doc;
-			JsonObject error = doc["error"].to<JsonObject>();
-			error["code"] = 500;
-			error["domain"] = "SQLite";
-			error["message"] = e.what();
-			handleError(request, std::forward<Args>(args)..., 500, doc);
-		}
-		catch (vfs::DiskError& e)
-		{
-			JsonDocument doc;
-			JsonObject error = doc["error"].to<JsonObject>();
-			error["code"] = 500;
-			error["domain"] = "Disk";
-			error["message"] = e.what();
-			if (e.hasDisk())
-			{
-				error["location"] = e.getDisk().getMountpoint();
-				error["locationType"] = "Disk Mount Point";
-			}
-			handleError(request, std::forward<Args>(args)..., 500, doc);
-		}
-		catch (const vfs::FileError& e)
-		{
-			JsonDocument doc;
-			JsonObject error = doc["error"].to<JsonObject>();
-			error["code"] = 500;
-			error["domain"] = "File";
-			error["message"] = e.what();
-			if (e.hasFile())
-			{
-				error["location"] = e.getFile().fileID;
-				error["locationType"] = "File ID";
-			}
-			handleError(request, std::forward<Args>(args)..., 500, doc);
-		}
-		catch (const vfs::VFSError& e)
-		{
-			JsonDocument doc;
-			JsonObject error = doc["error"].to<JsonObject>();
-			error["code"] = 500;
-			error["domain"] = "VFS";
-			error["message"] = e.what();
-			handleError(request, std::forward<Args>(args)..., 500, doc);
-		}
-		catch (const DeserializationError& e)
-		{
-			JsonDocument doc;
-			JsonObject error = doc["error"].to<JsonObject>();
-			error["code"] = 400;
-			error["domain"] = "JSON";
-			error["message"] = e.c_str();
-			handleError(request, std::forward<Args>(args)..., 400, doc);
-		}
-		catch (const std::exception& e)
-		{
-			JsonDocument doc;
-			JsonObject error = doc["error"].to<JsonObject>();
-			error["code"] = 500;
-			error["domain"] = "Unknown";
-			error["message"] = e.what();
-			handleError(request, std::forward<Args>(args)..., 500, doc);
-		}
 		catch (...)
 		{
 			JsonDocument doc;
 			JsonObject error = doc["error"].to<JsonObject>();
-			error["code"] = 500;
-			error["domain"] = "Unknown";
-			error["message"] = "Unknown error";
-			handleError(request, std::forward<Args>(args)..., 500, doc);
+			const int code = describeCurrentException(error);
+			m_metrics.recordError(error["domain"].as<const char*>());
+			if (m_route)
+				m_route->errors.fetch_add(1, std::memory_order_relaxed);
+			handleError(request, std::forward<Args>(args)..., code, doc);
 		}
+
+		if (m_route)
+			m_route->observe(getPhase<Args...>(), micros() - start);
 	}
 
 private:
 	T m_requestHandler;
+	srv::Metrics& m_metrics;
+	srv::Metrics::Route* m_route;
+
+	template<typename... Args>
+	static constexpr srv::Metrics::Phase getPhase()
+	{
+		// Body handlers take (data, len, index, total), upload handlers (filename, index, data, len, final)
+		return sizeof...(Args) == 0 ? srv::Metrics::Phase::Request
+			: sizeof...(Args) == 4 ? srv::Metrics::Phase::Body
+			: srv::Metrics::Phase::Upload;
+	}
 
 	template<typename... Args>
 	void handleError(AsyncWebServerRequest* request, Args&&..., int code, JsonDocument& doc)
 	{
-		doc.shrinkToFit();
-		String response;
-		serializeJson(doc, response);
-		request->send(code, "application/json", response);
+		request->send(beginErrorResponse(request, code, doc));
 	}
 
 	template<typename... Args>
 	void handleError(AsyncWebServerRequest* request, uint8_t*, size_t, size_t, size_t, Args&&..., int code, JsonDocument& doc)
 	{
-		doc.shrinkToFit();
-		String response;
-		serializeJson(doc, response);
-		request->_tempObject = request->beginResponse(code, "application/json", response);
+		request->_tempObject = beginErrorResponse(request, code, doc);
 	}
 
 	template<typename... Args>
 	void handleError(AsyncWebServerRequest* request, const String&, size_t, uint8_t*, size_t, bool, Args&&..., int code, JsonDocument& doc)
 	{
+		request->send(beginErrorResponse(request, code, doc));
+	}
+
+	static AsyncWebServerResponse* beginErrorResponse(AsyncWebServerRequest* request, int code, JsonDocument& doc)
+	{
+		const std::uint32_t retryAfter = doc["error"]["retryAfter"] | 0u;
 		doc.shrinkToFit();
 		String response;
 		serializeJson(doc, response);
-		request->send(code, "application/json", response);
+		AsyncWebServerResponse* errorResponse = request->beginResponse(code, "application/json", response);
+		if (retryAfter)
+			errorResponse->addHeader("Retry-After", String(retryAfter));
+		return errorResponse;
 	}
 };
\ No newline at end of file
@@ -4,113 +4,198 @@
 
 #include "ServerImpl.h"
 #include "SQLiteError.h"
-#include "sstream"
 #include "JWT.h"
 #include <FileError.h>
 #include "ServerError.h"
-
-srv::Server::Server(vfs::Filesystem& vfs, Authentication& auth, const std::string& privateKeyPath, const std::string& publicKeyPath, std::uint16_t port)
-	:m_vfs(vfs), m_auth(auth), m_server(port), m_privateKeyFile(privateKeyPath), m_publicKeyFile(publicKeyPath)
+#include "DirectoryListing.h"
+#include "FileRangeResponse.h"
+#include "ZipStream.h"
+#include <algorithm>
+#include <memory>
+
+srv::Server::Server(SQLite::DbConnection& db, vfs::Filesystem& vfs, Authentication& auth, PreupdateHook& preupdateHook, WorkerPool& workers, Metrics& metrics, const std::string& privateKeyPath, const std::string& publicKeyPath, std::uint16_t port)
+	:m_metrics(metrics), m_statements(db, metrics), m_vfs(vfs), m_inodes(m_statements, vfs), m_permissions(m_statements), m_auth(auth), m_workers(workers), m_server(port), m_privateKeyFile(privateKeyPath), m_publicKeyFile(publicKeyPath),
+	m_uploadBuffers(DefaultUploadBlockSize, DefaultUploadBlockCount), m_jsonBodies(DefaultJsonBlockSize, DefaultJsonBlockCount, MaxJsonBodySize), m_batchBodies(BatchJsonBlockSize, BatchJsonBlockCount, MaxBatchBodySize, JsonBodyPool::Parsing::Elements), m_usage(m_statements, m_inodes), m_placement(m_statements, vfs, m_usage), m_uploadSessions(m_statements, vfs, m_placement),
+	m_jobs(m_statements, workers), m_deletes(m_statements, vfs, m_placement, m_permissions, m_jobs),
+	m_copies(m_statements, vfs, m_inodes, m_placement, m_usage, m_uploadBuffers, m_jobs, metrics), m_reconciler(m_statements, vfs, m_placement), m_search(m_statements)
 {
-	m_server
-		.serveStatic("/", m_vfs.getDiskMap().getDiskByID(0).getFS(), "/webpage/")
-		.setDefaultFile("index.html");
-
-	//m_server.on("/api/login", HTTP_POST, fn(&Server::placeholder), nullptr, ErrorWrapper(fn(&Server::handleLogin)));
-	//m_server.on("/api/users", HTTP_POST, fn(&Server::placeholder), nullptr, ErrorWrapper(fn(&Server::handleCreateUser)));
-	//m_server.on("^\\/api\\/users\\/(\\d+)$", HTTP_GET, ErrorWrapper(fn(&Server::handleGetUser)));
-	//m_server.on("^\\/api\\/users\\/(\\d+)$", HTTP_DELETE, ErrorWrapper(fn(&Server::handleDeleteUser)));
-	//m_server.on("^\\/api\\/users\\/(\\d+)$", HTTP_PATCH, fn(&Server::placeholder), nullptr, ErrorWrapper(fn(&Server::handleUpdateUser)));
+	reloadKeys();
+	addDisk(0); // also serves the web interface
+	ZipStream::removeSpools(m_vfs.getDiskMap().getDiskByID(0).getFS());
 
-	//m_server.on("^\\/api\\/files\\/(\\d+)$", HTTP_GET, ErrorWrapper(fn(&Server::handleGetFile)));
-	//m_server.on("^\\/api\\/files\\/(\\d+)$", HTTP_DELETE, ErrorWrapper(fn(&Server::handleDeleteFile)));
-	//m_server.on("^\\/api\\/files\\/(\\d+)$" /*parent directory*/, HTTP_PUT, fn(&Server::handleUploadEnd), ErrorWrapper(fn(&Server::handleUploadFile)));
-	//m_server.on("^\\/api\\/files\\/(\\d+)$", HTTP_POST, fn(&Server::placeholder), nullptr, ErrorWrapper(fn(&Server::handleCreateDirectory)));
-	//m_server.on("^\\/api\\/files\\/(\\d+)$", HTTP_PATCH, fn(&Server::placeholder), nullptr, ErrorWrapper(fn(&Server::handleRenameFile)));
+	preupdateHook.addListener([this](const RowChange& change) { m_inodes.onRowChange(change); });
+	preupdateHook.addListener([this](const RowChange& change) { m_permissions.onRowChange(change); });
+	preupdateHook.addListener([this](const RowChange& change) { m_changes.onRowChange(change); });
+	preupdateHook.addListener([this](const RowChange& change) { m_search.onRowChange(change); });
+	m_statements.addRollbackListener([this]() { m_inodes.clear(); }); // may hold rows the rollback undid
+	m_statements.addRollbackListener([this]() { m_permissions.clear(); });
 
 	std::vector<Route> routes = {
 		{"/api/login", HTTP_POST, &Server::placeholder, nullptr, &Server::handleLogin},
 		{"/api/users", HTTP_POST, &Server::placeholder, nullptr, &Server::handleCreateUser},
-		{"^\\/api\\/users\\/(\\d+)$", HTTP_GET, &Server::handleGetUser},
-		{"^\\/api\\/users\\/(\\d+)$", HTTP_DELETE, &Server::handleDeleteUser},
-		{"^\\/api\\/users\\/(\\d+)$", HTTP_PATCH, &Server::placeholder, nullptr, &Server::handleUpdateUser},
-
-		{"^\\/api\\/files\\/(\\d+)$", HTTP_GET, &Server::handleGetFile},
-		{"^\\/api\\/files\\/(\\d+)$", HTTP_DELETE, &Server::handleDeleteFile},
-		{"^\\/api\\/files\\/(\\d+)$", HTTP_PUT, &Server::handleUploadEnd, &Server::handleUploadFile},
-		{"^\\/api\\/files\\/(\\d+)$", HTTP_POST, &Server::placeholder, nullptr, &Server::handleCreateDirectory},
-		{"^\\/api\\/files\\/(\\d+)$", HTTP_PATCH, &Server::placeholder, nullptr, &Server::handleRenameFile}
+		{"/api/users/{id}", HTTP_GET, &Server::handleGetUser},
+		{"/api/users/{id}", HTTP_DELETE, &Server::handleDeleteUser},
+		{"/api/users/{id}", HTTP_PATCH, &Server::placeholder, nullptr, &Server::handleUpdateUser},
+
+		{"/api/files/batch", HTTP_POST, &Server::placeholder, nullptr, &Server::handleBatch},
+		{"/api/files/{id}", HTTP_GET, &Server::handleGetFile},
+		{"/api/files/{id}", HTTP_DELETE, &Server::handleDeleteFile},
+		{"/api/files/{id}" /*parent directory*/, HTTP_PUT, &Server::handleUploadEnd, &Server::handleUploadFile},
+		{"/api/files/{id}", HTTP_POST, &Server::placeholder, nullptr, &Server::handleCreateDirectory},
+		{"/api/files/{id}", HTTP_PATCH, &Server::placeholder, nullptr, &Server::handleRenameFile},
+		{"/api/files/{id}/archive", HTTP_GET, &Server::handleGetArchive},
+		{"/api/files/{id}/copy", HTTP_POST, &Server::placeholder, nullptr, &Server::handleCopyFile},
+
+		{"/api/jobs/{id}", HTTP_GET, &Server::handleGetJob},
+		{"/api/usage", HTTP_GET, &Server::handleGetUsage},
+		{"/api/changes", HTTP_GET, &Server::handleGetChanges},
+		{"/api/search", HTTP_GET, &Server::handleSearch},
+
+		{"/api/cache", HTTP_GET, &Server::handleGetCacheStats},
+		{"/api/metrics", HTTP_GET, &Server::handleGetMetrics},
+
+		{"/api/uploads", HTTP_POST, &Server::placeholder, nullptr, &Server::handleCreateUploadSession},
+		{"/api/uploads/{id}", HTTP_GET, &Server::handleGetUploadSession},
+		{"/api/uploads/{id}", HTTP_PUT, &Server::placeholder, nullptr, &Server::handleUploadChunk},
+		{"/api/uploads/{id}", HTTP_DELETE, &Server::handleAbortUploadSession},
+		{"/api/uploads/{id}/commit", HTTP_POST, &Server::handleCommitUploadSession}
 	};
 
+	m_router = new Router(m_metrics); // owned by m_server
 	for (const Route& route : routes)
-		m_server.on(
-			route.uri.c_str(),
+	{
+		Metrics::Route& timings = m_metrics.addRoute(route.uri, route.method);
+		m_router->addRoute(
+			route.uri,
 			route.method,
-			ErrorWrapper(fn(route.requestHandler)),
-			route.uploadHandler ? static_cast<ArUploadHandlerFunction>(ErrorWrapper(fn(route.uploadHandler))) : nullptr,
-			route.bodyHandler ? static_cast<ArBodyHandlerFunction>(ErrorWrapper(fn(route.bodyHandler))) : nullptr
+			ErrorWrapper(fn(route.requestHandler), m_metrics, &timings),
+			route.uploadHandler ? static_cast<ArUploadHandlerFunction>(ErrorWrapper(fn(route.uploadHandler), m_metrics, &timings)) : nullptr,
+			route.bodyHandler ? static_cast<ArBodyHandlerFunction>(ErrorWrapper(fn(route.bodyHandler), m_metrics, &timings)) : nullptr
 		);
+	}
+
+	// Ahead of the static handler so API requests never probe the SD card for a matching file
+	m_server.addHandler(m_router);
+
+	m_assets = new StaticAssetCache(m_vfs.getDiskMap().getDiskByID(0).getFS(), "/webpage/", DefaultAssetCacheBudget); // owned by m_server
+	m_server.addHandler(m_assets);
+
+	// Assets that did not fit the cache budget
+	m_server
+		.serveStatic("/", m_vfs.getDiskMap().getDiskByID(0).getFS(), "/webpage/")
+		.setDefaultFile("index.html");
 
 	m_server.onNotFound(fn(&Server::handleNotFound));
 
+	const size_t reconciled = m_reconciler.reconcileDirty();
+	log_i("Reconciled %u interrupted directories", reconciled);
+	const size_t indexed = m_search.rebuild();
+	if (indexed)
+		log_i("Indexed %u file names for search", indexed);
+
+	m_jobs.resume(); // deletes and copies interrupted by a reboot
 	m_server.begin();
 }
 
+void srv::Server::addDisk(std::int64_t diskID)
+{
+	m_placement.addDisk(diskID);
+	UploadWriter::startWriterTask(diskID); // transfers to different disks proceed in parallel
+}
+
+void srv::Server::runMaintenance()
+{
+	m_reconciler.runMaintenance();
+	m_search.flush();
+	m_usage.runMaintenance();
+	m_placement.runMaintenance();
+	m_uploadSessions.runMaintenance();
+}
+
 void srv::Server::handleGetFile(AsyncWebServerRequest* request)
 {
 	std::int64_t id = getRequestItemId(request);
+	const std::int64_t clientKey = getAdmissionKey(request);
 
-	if (m_vfs.isDirectory(id))
+	if (m_inodes.isDirectory(id))
 	{
-		std::vector<vfs::Filesystem::FileMetadata> entries = m_vfs.listDirectory(id);
-		JsonDocument doc;
-		JsonArray data = doc["data"].to<JsonArray>();
-		for (const auto& entry : entries)
+		size_t limit = SIZE_MAX;
+		if (request->hasParam("limit"))
 		{
-			JsonObject obj = data.add<JsonObject>();
-			obj["id"] = entry.fileID;
-			obj["name"] = entry.name;
-			obj["isDirectory"] = entry.isDirectory;
-			obj["ownerID"] = entry.ownerID;
-			if (entry.isDirectory)
-				continue;
-			obj["size"] = entry.size;
-			obj["lastModified"] = entry.lastModified;
+			const long value = request->getParam("limit")->value().toInt();
+			if (value <= 0)
+				throw std::invalid_argument("Invalid limit parameter");
+			limit = value;
 		}
-		doc.shrinkToFit();
-		String response;
-		serializeJson(doc, response);
-		return request->send(200, "application/json", response);
+
+		std::string after;
+		if (request->hasParam("after"))
+			after = request->getParam("after")->value().c_str();
+
+		auto ticket = std::make_shared<AdmissionControl::Ticket>(m_admission.admit(clientKey, AdmissionControl::Transfer::Listing));
+		auto listing = std::make_shared<DirectoryListing>(m_statements, m_inodes, id, after, limit);
+		return request->send(request->beginChunkedResponse("application/json",
+			[listing, ticket](uint8_t* buffer, size_t maxLen, size_t index) { return listing->read(buffer, maxLen); }));
 	}
 
-	FS& fs = m_vfs.getDisk(id).getFS();
-	std::string path = m_vfs.getInternalPath(id);
-	request->send(fs, path.c_str(), "application/octet-stream"); // TODO: Determine MIME type
+	AdmissionControl::Ticket ticket = m_admission.admit(clientKey, AdmissionControl::Transfer::Download);
+	FS& fs = m_inodes.getDisk(id).getFS();
+	const std::string& path = m_inodes.getInternalPath(id);
+	File file = fs.open(path.c_str());
+	if (!file)
+		throw std::runtime_error("Failed to open file");
+
+	request->send(FileRangeResponse::create(request, file, "application/octet-stream", m_metrics, m_inodes.getDiskID(id), std::move(ticket))); // TODO: Determine MIME type
+}
+
+void srv::Server::handleGetArchive(AsyncWebServerRequest* request)
+{
+	std::int64_t id = getRequestItemId(request);
+
+	std::int64_t userID = getUserId(request);
+	m_permissions.require(userID, id, PermissionCache::Read);
+
+	const InodeCache::Inode& inode = m_inodes.get(id);
+	if (!inode.isDirectory)
+		throw HTTPError(400, "Not a directory");
+
+	std::string name = inode.name.empty() ? "archive" : inode.name;
+	std::replace(name.begin(), name.end(), '"', '_');
+
+	auto ticket = std::make_shared<AdmissionControl::Ticket>(m_admission.admit(userID, AdmissionControl::Transfer::Download));
+	auto archive = std::make_shared<ZipStream>(m_statements, m_inodes, m_metrics, m_vfs.getDiskMap().getDiskByID(0).getFS(), id, name);
+	AsyncWebServerResponse* response = request->beginChunkedResponse("application/zip",
+		[archive, ticket](uint8_t* buffer, size_t maxLen, size_t index) { return archive->read(buffer, maxLen); });
+	response->addHeader("Content-Disposition", ("attachment; filename=\"" + name + ".zip\"").c_str());
+	request->send(response);
 }
 
 void srv::Server::handleUploadFile(AsyncWebServerRequest* request, const String& filename, size_t index, uint8_t* data, size_t len, bool final)
 {
 	if (!index)
 	{
-		if (!request->hasParam("size"))
-			throw std::invalid_argument("Missing size parameter");
-
-		const String& sizeStr = request->getParam("size")->value();
-		std::uint64_t size;
-		std::istringstream(sizeStr.c_str()) >> size;
+		std::uint64_t size = getRequestSizeParam(request, "size");
 
 		std::int64_t parentID = getRequestItemId(request);
 
 		std::int64_t userID = getUserId(request);
+		m_permissions.require(userID, parentID, PermissionCache::Write);
+		m_usage.requireQuota(userID, size);
 
-		request->_tempFile = m_vfs.openFile(parentID, filename.c_str(), size, userID);
+		AdmissionControl::Ticket ticket = m_admission.admit(userID, AdmissionControl::Transfer::Upload);
+		const std::int64_t diskID = m_placement.choose(size);
+		File file = m_placement.create(parentID, filename.c_str(), size, userID, diskID);
+		beginUpload(request, file, diskID, size, std::move(ticket), userID, m_placement.findEntry(parentID, filename.c_str()));
 	}
 
-	if (len)
-		request->_tempFile.write(data, len);
+	if (!writeUpload(request, data, len))
+		return; // the upload already failed and its error response has been sent
 
 	if (final)
+	{
+		finishUpload(request);
 		request->_tempObject = request->beginResponse(200);
+	}
 }
 
 void srv::Server::handleUploadEnd(AsyncWebServerRequest* request)
@@ -128,13 +213,21 @@ void srv::Server::handleDeleteFile(AsyncWebServerRequest* request)
 	std::int64_t id = getRequestItemId(request);
 
 	std::int64_t userID = getUserId(request);
-	m_vfs.removeFileEntry(id, userID);
-	return request->send(200);
+	m_permissions.require(userID, id, PermissionCache::Owner);
+
+	std::optional<std::int64_t> jobID = m_deletes.remove(id, userID);
+	if (!jobID)
+		return request->send(200);
+
+	request->send(beginJobResponse(request, *jobID));
 }
 
 void srv::Server::handleCreateDirectory(AsyncWebServerRequest* request, uint8_t* data, size_t len, size_t index, size_t total)
 {
-	JsonDocument doc = parseJson(data, len);
+	JsonBody body = m_jsonBodies.receive(request, data, len, index, total);
+	if (!body)
+		return;
+	JsonDocument& doc = *body;
 	if (!doc.containsKey("name"))
 		throw std::invalid_argument("Missing name field in request body");
 
@@ -143,6 +236,8 @@ void srv::Server::handleCreateDirectory(AsyncWebServerRequest* request, uint8_t*
 	std::int64_t parentID = getRequestItemId(request);
 
 	std::int64_t userID = getUserId(request);
+	m_permissions.require(userID, parentID, PermissionCache::Write);
+	requireFreeName(parentID, name);
 	m_vfs.createNewDirectoryEntry(parentID, name, userID);
 
 	request->_tempObject = request->beginResponse(200);
@@ -150,23 +245,233 @@ void srv::Server::handleCreateDirectory(AsyncWebServerRequest* request, uint8_t*
 
 void srv::Server::handleRenameFile(AsyncWebServerRequest* request, uint8_t* data, size_t len, size_t index, size_t total)
 {
-	JsonDocument doc = parseJson(data, len);
-	if (!doc.containsKey("newName"))
-		throw std::invalid_argument("Missing newName field in request body");
+	JsonBody body = m_jsonBodies.receive(request, data, len, index, total);
+	if (!body)
+		return;
+	JsonDocument& doc = *body;
+	if (!doc.containsKey("newName") && !doc.containsKey("parentID") && !doc.containsKey("diskID"))
+		throw std::invalid_argument("Missing newName, parentID or diskID field in request body");
+
+	std::int64_t id = getRequestItemId(request);
+
+	std::int64_t userID = getUserId(request);
+	m_permissions.require(userID, id, PermissionCache::Owner);
 
-	std::string newName = doc["newName"];
+	const InodeCache::Inode& inode = m_inodes.get(id);
+	std::int64_t parentID = inode.parentID;
+	std::string name = inode.name;
+	if (doc.containsKey("parentID"))
+	{
+		parentID = doc["parentID"];
+		requireMovable(id, parentID, userID);
+	}
+	if (doc.containsKey("newName"))
+		name = doc["newName"].as<std::string>();
+
+	// Everything that can refuse the request is checked before the first change on disk, which no rollback undoes
+	requireNotRelocating(id);
+	if (doc.containsKey("parentID") || doc.containsKey("newName"))
+		requireFreeName(parentID, name, id);
+	if (doc.containsKey("diskID"))
+		m_vfs.getDiskMap().getDiskByID(doc["diskID"]); // throws if not mounted
+
+	Transaction transaction(m_statements);
+	std::optional<std::int64_t> jobID;
+	if (doc.containsKey("diskID"))
+		jobID = m_copies.relocate(id, doc["diskID"], userID); // only queues the data, which crosses disks in later steps
+	if (doc.containsKey("parentID"))
+		m_placement.move(id, parentID, name); // metadata only, the data stays on its disks
+	else if (doc.containsKey("newName"))
+		m_placement.rename(id, name, userID);
+	transaction.commit();
+
+	request->_tempObject = jobID ? beginJobResponse(request, *jobID) : request->beginResponse(200);
+}
+
+void srv::Server::handleCopyFile(AsyncWebServerRequest* request, uint8_t* data, size_t len, size_t index, size_t total)
+{
+	JsonBody body = m_jsonBodies.receive(request, data, len, index, total);
+	if (!body)
+		return;
+	JsonDocument& doc = *body;
+	if (!doc.containsKey("parentID"))
+		throw std::invalid_argument("Missing parentID field in request body");
+
+	std::int64_t parentID = doc["parentID"];
 
 	std::int64_t id = getRequestItemId(request);
 
 	std::int64_t userID = getUserId(request);
-	m_vfs.renameFileEntry(id, newName, userID);
+	m_permissions.require(userID, id, PermissionCache::Read);
+	m_permissions.require(userID, parentID, PermissionCache::Write);
 
-	request->_tempObject = request->beginResponse(200);
+	if (!m_inodes.isDirectory(parentID))
+		throw HTTPError(400, "Destination is not a directory");
+	if (isWithin(parentID, id))
+		throw HTTPError(400, "Cannot copy a directory into itself");
+
+	const std::string name = doc.containsKey("name") ? doc["name"].as<std::string>() : m_inodes.get(id).name;
+	std::optional<std::int64_t> diskID;
+	if (doc.containsKey("diskID"))
+		diskID = doc["diskID"].as<std::int64_t>();
+
+	const std::int64_t jobID = m_copies.copy(id, parentID, name, userID, diskID);
+	request->_tempObject = beginJobResponse(request, jobID);
+}
+
+void srv::Server::handleBatch(AsyncWebServerRequest* request, uint8_t* data, size_t len, size_t index, size_t total)
+{
+	JsonBody body = m_batchBodies.receive(request, data, len, index, total);
+	if (!body)
+		return;
+
+	std::int64_t userID = getUserId(request);
+
+	// The whole array is parsed once before anything runs: a rollback only restores rows, so a malformed tail
+	// must be refused while no operation has yet renamed or created anything on the disks
+	body.forEachElement(MaxBatchOperations, [](JsonVariant) {});
+
+	JsonDocument responseDoc;
+	JsonArray results = responseDoc["data"].to<JsonArray>();
+	{
+		// One commit for the whole batch; each operation gets a nested savepoint so a failure only undoes itself.
+		// Operations that fail have already put the disks back, so their savepoint rollback leaves both in step.
+		Transaction batch(m_statements);
+		body.forEachElement(MaxBatchOperations, [&](JsonVariant operation)
+			{
+				JsonObject result = results.add<JsonObject>();
+				try
+				{
+					Transaction step(m_statements);
+					std::optional<std::int64_t> jobID = runBatchOperation(operation, userID);
+					step.commit();
+					result["code"] = jobID ? 202 : 200;
+					if (jobID)
+						result["job"] = *jobID;
+				}
+				catch (...)
+				{
+					describeCurrentException(result);
+				}
+			});
+		batch.commit();
+	}
+
+	responseDoc.shrinkToFit();
+	String response;
+	serializeJson(responseDoc, response);
+	request->_tempObject = request->beginResponse(200, "application/json", response);
+}
+
+void srv::Server::handleCreateUploadSession(AsyncWebServerRequest* request, uint8_t* data, size_t len, size_t index, size_t total)
+{
+	JsonBody body = m_jsonBodies.receive(request, data, len, index, total);
+	if (!body)
+		return;
+	JsonDocument& doc = *body;
+	if (!doc.containsKey("parentID"))
+		throw std::invalid_argument("Missing parentID field in request body");
+	if (!doc.containsKey("name"))
+		throw std::invalid_argument("Missing name field in request body");
+	if (!doc.containsKey("size"))
+		throw std::invalid_argument("Missing size field in request body");
+
+	std::int64_t parentID = doc["parentID"];
+	std::string name = doc["name"];
+	std::uint64_t size = doc["size"];
+
+	std::int64_t userID = getUserId(request);
+	m_permissions.require(userID, parentID, PermissionCache::Write);
+	m_usage.requireQuota(userID, size);
+	std::int64_t sessionID = m_uploadSessions.create(userID, parentID, name, size);
+
+	JsonDocument responseDoc;
+	JsonObject session = responseDoc["data"].to<JsonObject>();
+	session["id"] = sessionID;
+	session["chunkAlignment"] = UploadSessions::ChunkAlignment;
+	responseDoc.shrinkToFit();
+	String response;
+	serializeJson(responseDoc, response);
+	request->_tempObject = request->beginResponse(200, "application/json", response);
+}
+
+void srv::Server::handleGetUploadSession(AsyncWebServerRequest* request)
+{
+	std::int64_t id = getRequestItemId(request);
+	std::int64_t userID = getUserId(request);
+	UploadSessions::Session session = m_uploadSessions.get(id, userID);
+
+	JsonDocument doc;
+	JsonObject data = doc["data"].to<JsonObject>();
+	data["id"] = session.id;
+	data["parentID"] = session.parentID;
+	data["name"] = session.name;
+	data["size"] = session.size;
+	JsonArray received = data["received"].to<JsonArray>();
+	for (const UploadSessions::Chunk& chunk : m_uploadSessions.getReceivedChunks(id))
+	{
+		JsonObject obj = received.add<JsonObject>();
+		obj["offset"] = chunk.offset;
+		obj["length"] = chunk.length;
+	}
+	doc.shrinkToFit();
+	String response;
+	serializeJson(doc, response);
+	request->send(200, "application/json", response);
+}
+
+void srv::Server::handleUploadChunk(AsyncWebServerRequest* request, uint8_t* data, size_t len, size_t index, size_t total)
+{
+	if (!index)
+	{
+		std::uint64_t offset = getRequestSizeParam(request, "offset");
+		std::int64_t id = getRequestItemId(request);
+		std::int64_t userID = getUserId(request);
+
+		const std::int64_t diskID = m_uploadSessions.get(id, userID).diskID;
+		AdmissionControl::Ticket ticket = m_admission.admit(userID, AdmissionControl::Transfer::Upload);
+		beginUpload(request, m_uploadSessions.openChunk(id, userID, offset, total), diskID, total, std::move(ticket), userID);
+	}
+
+	if (!writeUpload(request, data, len))
+		return;
+
+	if (index + len == total)
+	{
+		std::uint64_t written = finishUpload(request);
+		m_uploadSessions.recordChunk(getRequestItemId(request), getRequestSizeParam(request, "offset"), written);
+		request->_tempObject = request->beginResponse(200);
+	}
+}
+
+void srv::Server::handleCommitUploadSession(AsyncWebServerRequest* request)
+{
+	std::int64_t id = getRequestItemId(request);
+	std::int64_t userID = getUserId(request);
+	std::int64_t fileID = m_uploadSessions.commit(id, userID);
+
+	JsonDocument doc;
+	doc["data"]["id"] = fileID;
+	doc.shrinkToFit();
+	String response;
+	serializeJson(doc, response);
+	request->send(200, "application/json", response);
+}
+
+void srv::Server::handleAbortUploadSession(AsyncWebServerRequest* request)
+{
+	std::int64_t id = getRequestItemId(request);
+	std::int64_t userID = getUserId(request);
+	m_uploadSessions.abort(id, userID);
+	request->send(200);
 }
 
 void srv::Server::handleLogin(AsyncWebServerRequest* request, uint8_t* data, size_t len, size_t index, size_t total)
 {
-	JsonDocument doc = parseJson(data, len);
+	JsonBody body = m_jsonBodies.receive(request, data, len, index, total);
+	if (!body)
+		return;
+	JsonDocument& doc = *body;
 	if (!doc.containsKey("username"))
 		throw std::invalid_argument("Missing username field in request body");
 	if (!doc.containsKey("password"))
@@ -175,13 +480,21 @@ void srv::Server::handleLogin(AsyncWebServerRequest* request, uint8_t* data, siz
 	std::string username = doc["username"];
 	std::string password = doc["password"];
 
-	std::optional<Authentication::UserData> userData = m_auth.authenticate(username, password);
-	if (!userData)
-		throw std::invalid_argument("Invalid username or password"); // TODO: new error type for this
-
-	const std::string JWTContent = generateJWT(*userData);
-
-	request->_tempObject = request->beginResponse(200, "application/json", JWTContent.c_str());
+	// Password hashing and RS256 signing take long enough to stall every other connection on the TCP task.
+	// Authentication verifies and reads the user's row in one call, so the lock covers the hash; signing runs without it.
+	request->_tempObject = defer([this, username, password](DeferredResponse::Result& result)
+		{
+			std::optional<Authentication::UserData> userData;
+			{
+				DatabaseLock lock(m_statements.getMutex());
+				userData = m_auth.authenticate(username, password);
+			}
+			if (!userData)
+				throw std::invalid_argument("Invalid username or password"); // TODO: new error type for this
+
+			const std::string JWTContent = generateJWT(*userData);
+			result.send(200, "application/json", JWTContent.c_str());
+		});
 }
 
 void srv::Server::handleDeleteUser(AsyncWebServerRequest* request)
@@ -192,6 +505,7 @@ void srv::Server::handleDeleteUser(AsyncWebServerRequest* request)
 		throw std::invalid_argument("Cannot delete another user");
 
 	m_auth.deleteUser(id);
+	m_tokenCache.eraseUser(id);
 	request->send(200);
 }
 
@@ -220,30 +534,38 @@ void srv::Server::handleGetUser(AsyncWebServerRequest* request)
 
 void srv::Server::handleUpdateUser(AsyncWebServerRequest* request, uint8_t* data, size_t len, size_t index, size_t total)
 {
+	JsonBody body = m_jsonBodies.receive(request, data, len, index, total);
+	if (!body)
+		return;
+	JsonDocument& doc = *body;
+
 	std::int64_t id = getRequestItemId(request);
 	std::int64_t requestUserID = getUserId(request);
 	if (requestUserID != id)
 		throw std::invalid_argument("Cannot update another user");
 
-	JsonDocument doc = parseJson(data, len);
+	std::optional<std::string> username, password;
 	if (doc.containsKey("username"))
-	{
-		std::string username = doc["username"];
-		m_auth.updateUserUsername(id, username);
-	}
-
+		username = doc["username"].as<std::string>();
 	if (doc.containsKey("password"))
-	{
-		std::string password = doc["password"];
-		m_auth.updateUserPassword(id, password);
-	}
+		password = doc["password"].as<std::string>();
 
-	request->_tempObject = request->beginResponse(200);
+	request->_tempObject = defer([this, id, username, password](DeferredResponse::Result& result)
+		{
+			DatabaseLock lock(m_statements.getMutex());
+			if (username)
+				m_auth.updateUserUsername(id, *username);
+			if (password)
+				m_auth.updateUserPassword(id, *password);
+		});
 }
 
 void srv::Server::handleCreateUser(AsyncWebServerRequest* request, uint8_t* data, size_t len, size_t index, size_t total)
 {
-	JsonDocument doc = parseJson(data, len);
+	JsonBody body = m_jsonBodies.receive(request, data, len, index, total);
+	if (!body)
+		return;
+	JsonDocument& doc = *body;
 	if (!doc.containsKey("username"))
 		throw std::invalid_argument("Missing username field in request body");
 	if (!doc.containsKey("password"))
@@ -252,8 +574,192 @@ void srv::Server::handleCreateUser(AsyncWebServerRequest* request, uint8_t* data
 	std::string username = doc["username"];
 	std::string password = doc["password"];
 
-	m_auth.createUser(username, password);
-	request->_tempObject = request->beginResponse(200);
+	request->_tempObject = defer([this, username, password](DeferredResponse::Result& result)
+		{
+			DatabaseLock lock(m_statements.getMutex());
+			m_auth.createUser(username, password);
+		});
+}
+
+void srv::Server::handleGetJob(AsyncWebServerRequest* request)
+{
+	std::int64_t id = getRequestItemId(request);
+	std::int64_t userID = getUserId(request);
+	JobManager::Job job = m_jobs.get(id, userID);
+
+	JsonDocument doc;
+	JsonObject data = doc["data"].to<JsonObject>();
+	data["id"] = job.id;
+	data["type"] = job.type;
+	data["fileID"] = job.fileID;
+	data["targetID"] = job.targetID;
+	data["state"] = job.state;
+	data["total"] = job.total;
+	data["done"] = job.done;
+	if (!job.error.empty())
+		data["error"] = job.error;
+	doc.shrinkToFit();
+	String response;
+	serializeJson(doc, response);
+	request->send(200, "application/json", response);
+}
+
+void srv::Server::handleGetUsage(AsyncWebServerRequest* request)
+{
+	std::int64_t userID = getUserId(request);
+	const UsageTracker::Usage usage = m_usage.getUserUsage(userID);
+
+	// Counters only; the disks' own used-bytes figures would mean a FAT scan
+	JsonDocument doc;
+	JsonObject data = doc["data"].to<JsonObject>();
+	data["used"] = usage.used;
+	if (usage.quota)
+		data["quota"] = *usage.quota;
+	else
+		data["quota"] = nullptr;
+	data["isSettled"] = m_usage.isSettled();
+
+	JsonArray disks = data["disks"].to<JsonArray>();
+	for (std::int64_t diskID : m_placement.getDisks())
+	{
+		JsonObject disk = disks.add<JsonObject>();
+		disk["id"] = diskID;
+		disk["total"] = m_vfs.getDiskMap().getDiskByID(diskID).getTotalBytes();
+		disk["used"] = m_usage.getDiskUsed(diskID);
+	}
+
+	doc.shrinkToFit();
+	String response;
+	serializeJson(doc, response);
+	request->send(200, "application/json", response);
+}
+
+void srv::Server::handleGetChanges(AsyncWebServerRequest* request)
+{
+	std::int64_t userID = getUserId(request);
+
+	// Without an epoch the client has no cursor yet and is told to resync from a full listing
+	const std::uint64_t since = request->hasParam("since") ? getRequestSizeParam(request, "since") : 0;
+	std::optional<std::uint32_t> epoch;
+	if (request->hasParam("epoch"))
+		epoch = getRequestSizeParam(request, "epoch");
+	const std::uint64_t limit = request->hasParam("limit") ? getRequestSizeParam(request, "limit") : MaxChangesPerPoll;
+	const std::uint64_t wait = request->hasParam("wait") ? getRequestSizeParam(request, "wait") : 0;
+	if (!limit)
+		throw HTTPError(400, "Invalid limit parameter");
+
+	auto poll = std::make_shared<ChangePoll>(m_statements, m_permissions, m_changes, userID, epoch, since,
+		std::min<std::uint64_t>(limit, MaxChangesPerPoll), std::min<std::uint64_t>(wait, MaxChangesWait) * 1000);
+	request->send(request->beginChunkedResponse("application/json", [poll](uint8_t* buffer, size_t maxLen, size_t index)
+		{
+			return poll->read(buffer, maxLen);
+		}));
+}
+
+void srv::Server::handleSearch(AsyncWebServerRequest* request)
+{
+	std::int64_t userID = getUserId(request);
+
+	if (!request->hasParam("q"))
+		throw std::invalid_argument("Missing q parameter");
+	const std::string query = request->getParam("q")->value().c_str();
+
+	SearchIndex::Mode mode = SearchIndex::Mode::Substring;
+	if (request->hasParam("mode"))
+	{
+		const String& value = request->getParam("mode")->value();
+		if (value == "prefix")
+			mode = SearchIndex::Mode::Prefix;
+		else if (value != "substring")
+			throw HTTPError(400, "Invalid mode parameter");
+	}
+	if (!SearchIndex::isSearchable(query, mode))
+		throw HTTPError(400, "Query too short");
+
+	const std::uint64_t limit = request->hasParam("limit") ? getRequestSizeParam(request, "limit") : MaxSearchResults;
+	const std::uint64_t after = request->hasParam("after") ? getRequestSizeParam(request, "after") : 0;
+	if (!limit)
+		throw HTTPError(400, "Invalid limit parameter");
+
+	m_search.flush(); // changes made since the last maintenance pass
+
+	JsonDocument doc;
+	JsonArray data = doc["data"].to<JsonArray>();
+	size_t found = 0;
+	const std::int64_t next = m_search.search(query, mode, after, MaxSearchScanned, [&](const SearchIndex::Match& match)
+		{
+			if (!m_permissions.hasPermission(userID, match.id, PermissionCache::Read))
+				return true;
+
+			bool isDirectory;
+			try
+			{
+				isDirectory = m_inodes.isDirectory(match.id);
+			}
+			catch (const std::invalid_argument&)
+			{
+				return true; // queued for background deletion
+			}
+
+			JsonObject entry = data.add<JsonObject>();
+			entry["id"] = match.id;
+			entry["parentID"] = match.parentID;
+			entry["name"] = match.name;
+			entry["isDirectory"] = isDirectory;
+			return ++found < std::min<std::uint64_t>(limit, MaxSearchResults);
+		});
+	if (next)
+		doc["next"] = next;
+	else
+		doc["next"] = nullptr;
+
+	doc.shrinkToFit();
+	String response;
+	serializeJson(doc, response);
+	request->send(200, "application/json", response);
+}
+
+void srv::Server::handleGetCacheStats(AsyncWebServerRequest* request)
+{
+	getUserId(request); // authenticated users only
+
+	JsonDocument doc;
+	JsonObject inodes = doc["data"]["inodes"].to<JsonObject>();
+	inodes["hits"] = m_inodes.getHits();
+	inodes["misses"] = m_inodes.getMisses();
+	inodes["size"] = m_inodes.getSize();
+	inodes["capacity"] = m_inodes.getCapacity();
+	JsonObject permissions = doc["data"]["permissions"].to<JsonObject>();
+	permissions["hits"] = m_permissions.getHits();
+	permissions["misses"] = m_permissions.getMisses();
+	permissions["size"] = m_permissions.getSize();
+	doc.shrinkToFit();
+	String response;
+	serializeJson(doc, response);
+	request->send(200, "application/json", response);
+}
+
+void srv::Server::handleGetMetrics(AsyncWebServerRequest* request)
+{
+	// Streamed, since with every route's histograms the text runs to tens of kilobytes
+	auto reader = std::make_shared<Metrics::Reader>(m_metrics, [this](String& response)
+		{
+			static const char* transfers[] = { "download", "upload", "listing" };
+			response += "# TYPE nas_admission_in_flight gauge\n";
+			for (size_t i = 0; i < AdmissionControl::TransferKinds; ++i)
+			{
+				response += "nas_admission_in_flight{transfer=\"";
+				response += transfers[i];
+				response += "\"} ";
+				response += m_admission.getInFlight(static_cast<AdmissionControl::Transfer>(i));
+				response += "\n";
+			}
+			response += "# TYPE nas_admission_rejected_total counter\nnas_admission_rejected_total ";
+			response += m_admission.getRejected();
+			response += "\n";
+		});
+	request->send(request->beginChunkedResponse("text/plain; version=0.0.4",
+		[reader](uint8_t* buffer, size_t maxLen, size_t index) { return reader->read(buffer, maxLen); }));
 }
 
 void srv::Server::placeholder(AsyncWebServerRequest* request)
@@ -281,27 +787,56 @@ void srv::Server::handleNotFound(AsyncWebServerRequest* request)
 	request->send(404, "application/json", response);
 }
 
+// Handlers run with the database lock held: worker jobs may be stepping statements on the same connection
 ArRequestHandlerFunction srv::Server::fn(void(Server::* func)(AsyncWebServerRequest* request))
 {
-	return std::bind(func, this, std::placeholders::_1);
+	return [this, func](AsyncWebServerRequest* request)
+		{
+			DatabaseLock lock(m_statements.getMutex());
+			(this->*func)(request);
+		};
 }
 
 ArUploadHandlerFunction srv::Server::fn(void(Server::* func)(AsyncWebServerRequest* request, const String& filename, size_t index, uint8_t* data, size_t len, bool final))
 {
-	return std::bind(func, this, std::placeholders::_1, std::placeholders::_2, std::placeholders::_3, std::placeholders::_4, std::placeholders::_5, std::placeholders::_6);
-	//return [this, func](AsyncWebServerRequest* request, const String& filename, size_t index, uint8_t* data, size_t len, bool final)
-	//	{
-	//		(this->*func)(request, filename, index, data, len, final);
-	//	};
+	return [this, func](AsyncWebServerRequest* request, const String& filename, size_t index, uint8_t* data, size_t len, bool final)
+		{
+			DatabaseLock lock(m_statements.getMutex());
+			(this->*func)(request, filename, index, data, len, final);
+		};
 }
 
 ArBodyHandlerFunction srv::Server::fn(void(Server::* func)(AsyncWebServerRequest* request, uint8_t* data, size_t len, size_t index, size_t total))
 {
-	return std::bind(func, this, std::placeholders::_1, std::placeholders::_2, std::placeholders::_3, std::placeholders::_4, std::placeholders::_5);
-	//return [this, func](AsyncWebServerRequest* request, uint8_t* data, size_t len, size_t index, size_t total)
-	//	{
-	//		(this->*func)(request, data, len, index, total);
-	//	};
+	return [this, func](AsyncWebServerRequest* request, uint8_t* data, size_t len, size_t index, size_t total)
+		{
+			DatabaseLock lock(m_statements.getMutex());
+			(this->*func)(request, data, len, index, total);
+		};
+}
+
+AsyncWebServerResponse* srv::Server::beginJobResponse(AsyncWebServerRequest* request, std::int64_t jobID)
+{
+	JsonDocument doc;
+	doc["data"]["job"] = jobID;
+	String response;
+	serializeJson(doc, response);
+	AsyncWebServerResponse* accepted = request->beginResponse(202, "application/json", response);
+	accepted->addHeader("Location", ("/api/jobs/" + std::to_string(jobID)).c_str());
+	return accepted;
+}
+
+AsyncWebServerResponse* srv::Server::defer(std::function<void(DeferredResponse::Result&)> job)
+{
+	auto result = std::make_shared<DeferredResponse::Result>(m_metrics);
+	const bool isQueued = m_workers.post([result, job = std::move(job)]
+		{
+			result->run(job);
+		});
+	if (!isQueued)
+		throw HTTPError(503, "Server busy, try again later", 1);
+
+	return new DeferredResponse(result);
 }
 
 std::int64_t srv::Server::getUserId(AsyncWebServerRequest* request)
@@ -311,10 +846,15 @@ std::int64_t srv::Server::getUserId(AsyncWebServerRequest* request)
 
 	const String& header = request->header("Authorization");
 	const String token = header.substring(strlen("Bearer "));
+
+	const TokenCache::Digest digest = TokenCache::digest(token.c_str(), token.length());
+	if (std::optional<std::int64_t> cachedID = m_tokenCache.find(digest))
+		return *cachedID;
+
 	const JWT::JWTContent jwtContent = JWT::parse(token.c_str());
 
 	const std::string jwtBody = token.substring(0, token.lastIndexOf('.')).c_str();
-	const bool isValid = JWT::verifyWithKeyFile({ jwtBody.begin(), jwtBody.end() }, jwtContent.signature, m_publicKeyFile);
+	const bool isValid = m_publicKey.verify({ jwtBody.begin(), jwtBody.end() }, jwtContent.signature);
 	if (!isValid)
 		throw std::invalid_argument("Invalid JWT signature");
 
@@ -325,15 +865,245 @@ std::int64_t srv::Server::getUserId(AsyncWebServerRequest* request)
 	if (!doc.containsKey("id"))
 		throw std::invalid_argument("Missing sub field in JWT payload");
 
-	return doc["id"];
+	const std::int64_t userID = doc["id"];
+	m_tokenCache.insert(digest, userID);
+	return userID;
+}
+
+std::int64_t srv::Server::getAdmissionKey(AsyncWebServerRequest* request)
+{
+	if (request->hasHeader("Authorization"))
+		return getUserId(request);
+
+	// Negative so an anonymous client never shares a fair-share bucket with a user
+	return -static_cast<std::int64_t>(static_cast<std::uint32_t>(request->client()->remoteIP())) - 1;
 }
 
 std::int64_t srv::Server::getRequestItemId(AsyncWebServerRequest* request)
 {
-	const String& idStr = request->pathArg(0);
-	std::int64_t id;
-	std::istringstream(idStr.c_str()) >> id;
-	return id;
+	return m_router->getParam(request, 0);
+}
+
+void srv::Server::reloadKeys()
+{
+	m_privateKey.loadPrivateKeyFile(m_privateKeyFile);
+	m_publicKey.loadPublicKeyFile(m_publicKeyFile);
+	m_tokenCache.clear();
+}
+
+std::optional<std::int64_t> srv::Server::runBatchOperation(JsonVariant operation, std::int64_t userID)
+{
+	const std::string type = operation["op"] | "";
+
+	if (type == "mkdir")
+	{
+		if (!operation.containsKey("parentID") || !operation.containsKey("name"))
+			throw HTTPError(400, "mkdir requires parentID and name");
+		std::int64_t parentID = operation["parentID"];
+		std::string name = operation["name"];
+		m_permissions.require(userID, parentID, PermissionCache::Write);
+		requireFreeName(parentID, name);
+		m_vfs.createNewDirectoryEntry(parentID, name, userID);
+		return std::nullopt;
+	}
+
+	if (!operation.containsKey("id"))
+		throw HTTPError(400, "Missing id field in operation");
+	std::int64_t id = operation["id"];
+
+	if (type == "delete")
+	{
+		// Large subtrees become a background job, exactly as a single DELETE would
+		m_permissions.require(userID, id, PermissionCache::Owner);
+		return m_deletes.remove(id, userID);
+	}
+
+	if (type == "rename")
+	{
+		if (!operation.containsKey("newName"))
+			throw HTTPError(400, "Missing newName field in operation");
+		std::string newName = operation["newName"];
+		m_permissions.require(userID, id, PermissionCache::Owner);
+		requireNotRelocating(id);
+		requireFreeName(m_inodes.get(id).parentID, newName, id);
+		m_placement.rename(id, newName, userID);
+		return std::nullopt;
+	}
+
+	if (type == "move")
+	{
+		if (!operation.containsKey("parentID"))
+			throw HTTPError(400, "Missing parentID field in operation");
+		moveFileEntry(id, operation["parentID"], userID);
+		return std::nullopt;
+	}
+
+	throw HTTPError(400, "Unknown operation: " + type);
+}
+
+void srv::Server::moveFileEntry(std::int64_t id, std::int64_t parentID, std::int64_t userID)
+{
+	requireMovable(id, parentID, userID);
+	requireNotRelocating(id);
+	const std::string name = m_inodes.get(id).name;
+	requireFreeName(parentID, name, id);
+
+	// Internal paths follow the ParentID chain, so the entry is renamed on disk along with the row
+	m_placement.move(id, parentID, name);
+}
+
+void srv::Server::requireMovable(std::int64_t id, std::int64_t parentID, std::int64_t userID)
+{
+	m_permissions.require(userID, id, PermissionCache::Owner);
+	m_permissions.require(userID, parentID, PermissionCache::Write);
+
+	if (!m_inodes.isDirectory(parentID))
+		throw HTTPError(400, "Destination is not a directory");
+	if (isWithin(parentID, id))
+		throw HTTPError(400, "Cannot move a directory into itself");
+}
+
+void srv::Server::requireNotRelocating(std::int64_t id)
+{
+	// A relocation works out internal paths afresh at every step, so neither its entry nor anything above or
+	// below it may change path until the job ends
+	CachedStatement statement = m_statements.prepare(
+		"SELECT FileID FROM BackgroundJobs WHERE Type = 'relocate' AND State = 'running'"
+	);
+	while (statement.evaluate())
+	{
+		const std::int64_t relocatingID = statement.getColumnValue<std::int64_t>(0);
+		bool isAffected;
+		try
+		{
+			isAffected = isWithin(id, relocatingID) || isWithin(relocatingID, id);
+		}
+		catch (const std::invalid_argument&)
+		{
+			continue; // deleted since; its job fails on the next step
+		}
+		if (isAffected)
+			throw HTTPError(409, "Entry is being relocated, try again once the job finishes");
+	}
+}
+
+void srv::Server::requireFreeName(std::int64_t parentID, const std::string& name, std::int64_t exceptID)
+{
+	CachedStatement statement = m_statements.prepare(
+		"SELECT 1 FROM FileEntries WHERE ParentID = ? AND Name = ? AND ID != ?"
+	);
+	statement.bind(1, parentID);
+	statement.bind(2, name);
+	statement.bind(3, exceptID);
+	if (statement.evaluate())
+		throw HTTPError(409, "An entry named " + name + " already exists");
+}
+
+bool srv::Server::isWithin(std::int64_t id, std::int64_t ancestorID)
+{
+	const std::vector<std::int64_t>& ancestors = m_inodes.get(id).ancestors;
+	return id == ancestorID || std::find(ancestors.begin(), ancestors.end(), ancestorID) != ancestors.end();
+}
+
+std::uint64_t srv::Server::getRequestSizeParam(AsyncWebServerRequest* request, const String& name)
+{
+	if (!request->hasParam(name))
+		throw std::invalid_argument(std::string("Missing ") + name.c_str() + " parameter");
+
+	const String& valueStr = request->getParam(name)->value();
+	std::uint64_t value;
+	if (!Router::parseInteger(std::string_view(valueStr.c_str(), valueStr.length()), value))
+		throw HTTPError(400, std::string("Malformed ") + name.c_str() + " parameter");
+	return value;
+}
+
+void srv::Server::beginUpload(AsyncWebServerRequest* request, File file, std::int64_t diskID, std::uint64_t expectedSize, AdmissionControl::Ticket ticket, std::int64_t userID, std::optional<std::int64_t> fileID)
+{
+	Upload upload{ nullptr, std::move(ticket), fileID, userID };
+	if (fileID)
+		upload.directory = Reconciler::Writer(m_reconciler, m_inodes.get(*fileID).parentID);
+	try
+	{
+		upload.writer = std::make_unique<UploadWriter>(file, diskID, m_uploadBuffers, m_metrics, expectedSize);
+	}
+	catch (...)
+	{
+		abortUpload(upload);
+		throw;
+	}
+
+	m_uploads[request] = std::move(upload);
+	request->onDisconnect([this, request]()
+		{
+			// Still registered means the final fragment never arrived
+			auto upload = m_uploads.find(request);
+			if (upload == m_uploads.end())
+				return;
+			Upload abandoned = std::move(upload->second);
+			m_uploads.erase(upload);
+			abortUpload(abandoned);
+		});
+}
+
+bool srv::Server::writeUpload(AsyncWebServerRequest* request, uint8_t* data, size_t len)
+{
+	auto upload = m_uploads.find(request);
+	if (upload == m_uploads.end())
+		return false;
+
+	if (!len)
+		return true;
+
+	try
+	{
+		upload->second.writer->write(data, len);
+	}
+	catch (...)
+	{
+		Upload failed = std::move(upload->second);
+		m_uploads.erase(upload);
+		abortUpload(failed);
+		throw;
+	}
+	return true;
+}
+
+std::uint64_t srv::Server::finishUpload(AsyncWebServerRequest* request)
+{
+	auto upload = m_uploads.find(request);
+	Upload finished = std::move(upload->second); // keeps the slot until the data is on disk
+	m_uploads.erase(upload);
+	try
+	{
+		finished.writer->finish();
+	}
+	catch (...)
+	{
+		abortUpload(finished);
+		throw;
+	}
+
+	const std::uint64_t written = finished.writer->getBytesWritten();
+	if (finished.fileID)
+		m_usage.setSize(*finished.fileID, written); // replaces the declared size
+	return written;
+}
+
+void srv::Server::abortUpload(Upload& upload)
+{
+	upload.writer.reset(); // closes the file before it is removed
+	if (!upload.fileID)
+		return; // a session chunk is simply not recorded, and the client sends it again
+
+	try
+	{
+		DatabaseLock lock(m_statements.getMutex());
+		m_vfs.removeFileEntry(*upload.fileID, upload.userID);
+	}
+	catch (const std::exception& e)
+	{
+		log_e("Failed to remove abandoned upload %lld: %s", *upload.fileID, e.what());
+	}
 }
 
 std::string srv::Server::generateJWT(Authentication::UserData& user)
@@ -361,18 +1131,8 @@ std::string srv::Server::generateJWT(Authentication::UserData& user)
 	const std::string base64Payload = JWT::base64URLEncode({ payload.begin(), payload.end() });
 	const std::string JWTBody = base64Header + '.' + base64Payload;
 
-	const JWT::ByteData signature = JWT::signWithKeyFile({ JWTBody.begin(), JWTBody.end() }, m_privateKeyFile);
+	const JWT::ByteData signature = m_privateKey.sign({ JWTBody.begin(), JWTBody.end() });
 	const std::string base64Signature = JWT::base64URLEncode(signature);
 
 	return JWTBody + '.' + base64Signature;
 }
-
-JsonDocument srv::Server::parseJson(uint8_t* data, size_t len)
-{
-	std::string body(reinterpret_cast<char*>(data), len);
-	JsonDocument doc;
-	DeserializationError error = deserializeJson(doc, body);
-	if (error)
-		throw error; // TODO: implement wrapper class inheriting from std::exception
-	return doc;
-}
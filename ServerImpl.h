@@ -11,9 +11,36 @@
 
 #include "VFS.h"
 #include "Authentication.h"
+#include "RSAKey.h"
+#include "TokenCache.h"
+#include "BufferPool.h"
+#include "JsonBody.h"
+#include "StatementCache.h"
+#include "PreupdateHook.h"
+#include "InodeCache.h"
+#include "PermissionCache.h"
+#include "Router.h"
+#include "StaticAssetCache.h"
+#include "UploadWriter.h"
+#include "UsageTracker.h"
+#include "DiskPlacement.h"
+#include "UploadSessions.h"
+#include "WorkerPool.h"
+#include "AdmissionControl.h"
+#include "DeferredResponse.h"
+#include "JobManager.h"
+#include "RecursiveDelete.h"
+#include "FileCopy.h"
+#include "Reconciler.h"
+#include "ChangeFeed.h"
+#include "SearchIndex.h"
+#include "Metrics.h"
 #include <ESPAsyncWebServer.h>
 #include <ArduinoJson.h>
+#include <memory>
+#include <optional>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 namespace srv {
@@ -41,15 +68,36 @@ public:
 		BodyHandler bodyHandler;
 	};
 
-	Server(vfs::Filesystem& vfs, Authentication& auth, const std::string& privateKeyPath, const std::string& publicKeyPath, uint16_t port = 80);
+	static constexpr size_t DefaultUploadBlockSize = 16 * 1024; // multiple of every FAT cluster size up to 16 KB
+	static constexpr size_t DefaultUploadBlockCount = 4; // two concurrent double-buffered uploads
+	static constexpr size_t DefaultJsonBlockSize = 16 * 1024; // body plus the arena its document is parsed into
+	static constexpr size_t DefaultJsonBlockCount = 4; // JSON requests receiving at once
+	static constexpr size_t MaxJsonBodySize = 8 * 1024;
+	static constexpr size_t MaxBatchOperations = 512;
+	static constexpr size_t BatchOperationBudget = 64; // average bytes per operation, e.g. {"op":"move","id":123456,"parentID":123456},
+	static constexpr size_t MaxBatchBodySize = MaxBatchOperations * BatchOperationBudget;
+	static constexpr size_t BatchJsonBlockSize = MaxBatchBodySize + 4 * 1024; // body plus the arena one operation is parsed into
+	static constexpr size_t BatchJsonBlockCount = 1;
+	static constexpr size_t DefaultAssetCacheBudget = 512 * 1024; // web interface held in RAM/PSRAM
+
+	Server(SQLite::DbConnection& db, vfs::Filesystem& vfs, Authentication& auth, PreupdateHook& preupdateHook, WorkerPool& workers, Metrics& metrics, const std::string& privateKeyPath, const std::string& publicKeyPath, uint16_t port = 80);
 
 	// REST API
 	void handleGetFile(AsyncWebServerRequest* request); // GET
+	void handleGetArchive(AsyncWebServerRequest* request); // GET, directory subtree as ZIP
 	void handleUploadFile(AsyncWebServerRequest* request, const String& filename, size_t index, uint8_t* data, size_t len, bool final); // PUT
 	void handleUploadEnd(AsyncWebServerRequest* request);
 	void handleDeleteFile(AsyncWebServerRequest* request); // DELETE
 	void handleCreateDirectory(AsyncWebServerRequest* request, uint8_t* data, size_t len, size_t index, size_t total); // POST
-	void handleRenameFile(AsyncWebServerRequest* request, uint8_t* data, size_t len, size_t index, size_t total); // PATCH
+	void handleRenameFile(AsyncWebServerRequest* request, uint8_t* data, size_t len, size_t index, size_t total); // PATCH, also moves and relocates
+	void handleCopyFile(AsyncWebServerRequest* request, uint8_t* data, size_t len, size_t index, size_t total); // POST
+	void handleBatch(AsyncWebServerRequest* request, uint8_t* data, size_t len, size_t index, size_t total); // POST
+
+	void handleCreateUploadSession(AsyncWebServerRequest* request, uint8_t* data, size_t len, size_t index, size_t total); // POST
+	void handleGetUploadSession(AsyncWebServerRequest* request); // GET
+	void handleUploadChunk(AsyncWebServerRequest* request, uint8_t* data, size_t len, size_t index, size_t total); // PUT
+	void handleCommitUploadSession(AsyncWebServerRequest* request); // POST
+	void handleAbortUploadSession(AsyncWebServerRequest* request); // DELETE
 
 	void handleLogin(AsyncWebServerRequest* request, uint8_t* data, size_t len, size_t index, size_t total); // POST
 	void handleDeleteUser(AsyncWebServerRequest* request); // DELETE
@@ -57,28 +105,98 @@ public:
 	void handleUpdateUser(AsyncWebServerRequest* request, uint8_t* data, size_t len, size_t index, size_t total); // PATCH
 	void handleCreateUser(AsyncWebServerRequest* request, uint8_t* data, size_t len, size_t index, size_t total); // POST
 
+	void handleGetJob(AsyncWebServerRequest* request); // GET
+	void handleGetUsage(AsyncWebServerRequest* request); // GET
+	void handleGetChanges(AsyncWebServerRequest* request); // GET
+	void handleSearch(AsyncWebServerRequest* request); // GET
+
+	void handleGetCacheStats(AsyncWebServerRequest* request); // GET
+	void handleGetMetrics(AsyncWebServerRequest* request); // GET, Prometheus text format
+
 	void placeholder(AsyncWebServerRequest* request);
 	void handleNotFound(AsyncWebServerRequest* request);
 
 	void setPrivateKeyFile(const std::string& path) { m_privateKeyFile = path; }
 	void setPublicKeyFile(const std::string& path) { m_publicKeyFile = path; }
+	void reloadKeys(); // re-parses both key files, e.g. after key rotation
+	void setUploadBuffering(size_t blockSize, size_t blockCount) { m_uploadBuffers.configure(blockSize, blockCount); }
+	void setAssetCacheBudget(size_t budget) { m_assets->load(budget); } // reloads; call before clients connect
+	void addDisk(std::int64_t diskID); // must already be mounted in the VFS
+	void setAdmissionLimits(const AdmissionControl::Limits& limits) { m_admission.setLimits(limits); }
+	void setPlacementPolicy(DiskPlacement::Policy policy) { m_placement.setPolicy(policy); }
+	void setDefaultQuota(std::optional<std::uint64_t> quota) { m_usage.setDefaultQuota(quota); } // bytes; nullopt is unlimited
+	void setUserQuota(std::int64_t userID, std::optional<std::uint64_t> quota) { m_usage.setQuota(userID, quota); } // nullopt uses the default
+	void runMaintenance(); // from loop()
 
 private:
+	struct Upload
+	{
+		std::unique_ptr<UploadWriter> writer;
+		AdmissionControl::Ticket ticket;
+		std::optional<std::int64_t> fileID; // whose Size is settled when the data is written, or removed on failure
+		std::int64_t userID;
+		Reconciler::Writer directory; // keeps the parent's checkpoint from being recorded until the file is complete
+	};
+
+	Metrics& m_metrics;
+	StatementCache m_statements;
 	vfs::Filesystem& m_vfs;
+	InodeCache m_inodes;
+	PermissionCache m_permissions;
 	Authentication& m_auth;
+	WorkerPool& m_workers;
+	AdmissionControl m_admission; // outlives m_server, whose responses hold tickets
 	AsyncWebServer m_server;
+	Router* m_router; // owned by m_server
+	StaticAssetCache* m_assets; // owned by m_server
 	std::string m_privateKeyFile;
 	std::string m_publicKeyFile;
+	RSAKey m_privateKey;
+	RSAKey m_publicKey;
+	TokenCache m_tokenCache;
+	BufferPool m_uploadBuffers;
+	JsonBodyPool m_jsonBodies;
+	JsonBodyPool m_batchBodies; // batches are walked one operation at a time
+	UsageTracker m_usage;
+	DiskPlacement m_placement;
+	UploadSessions m_uploadSessions;
+	JobManager m_jobs;
+	RecursiveDelete m_deletes;
+	FileCopy m_copies;
+	Reconciler m_reconciler;
+	ChangeFeed m_changes;
+	SearchIndex m_search;
+	std::unordered_map<AsyncWebServerRequest*, Upload> m_uploads; // after m_reconciler, which its entries refer to
 
 	ArRequestHandlerFunction fn(void (Server::* func)(AsyncWebServerRequest* request));
 	ArUploadHandlerFunction fn(void (Server::* func)(AsyncWebServerRequest* request, const String& filename, size_t index, uint8_t* data, size_t len, bool final));
 	ArBodyHandlerFunction fn(void (Server::* func)(AsyncWebServerRequest* request, uint8_t* data, size_t len, size_t index, size_t total));
 
+	AsyncWebServerResponse* defer(std::function<void(DeferredResponse::Result&)> job);
+	AsyncWebServerResponse* beginJobResponse(AsyncWebServerRequest* request, std::int64_t jobID); // 202 pointing at the job
+
 	std::int64_t getUserId(AsyncWebServerRequest* request);
+	std::int64_t getAdmissionKey(AsyncWebServerRequest* request); // the user, or the client address when anonymous
+	static constexpr size_t MaxChangesPerPoll = 256;
+	static constexpr std::uint32_t MaxChangesWait = 30; // seconds
+	static constexpr size_t MaxSearchResults = 100;
+	static constexpr size_t MaxSearchScanned = 512; // candidates examined per request before a cursor is returned
+
 	std::int64_t getRequestItemId(AsyncWebServerRequest* request);
+	std::uint64_t getRequestSizeParam(AsyncWebServerRequest* request, const String& name);
+	void beginUpload(AsyncWebServerRequest* request, File file, std::int64_t diskID, std::uint64_t expectedSize, AdmissionControl::Ticket ticket, std::int64_t userID, std::optional<std::int64_t> fileID = std::nullopt);
+	bool writeUpload(AsyncWebServerRequest* request, uint8_t* data, size_t len);
+	std::uint64_t finishUpload(AsyncWebServerRequest* request);
+	void abortUpload(Upload& upload); // drops a partial file and its entry, and with it the quota charge
 	String generateErrorResponse(int code, const std::string& domain, const std::string& message);
 	std::string generateJWT(Authentication::UserData& user);
-	JsonDocument parseJson(uint8_t* data, size_t len);
+
+	std::optional<std::int64_t> runBatchOperation(JsonVariant operation, std::int64_t userID); // the job ID when one was started
+	void moveFileEntry(std::int64_t id, std::int64_t parentID, std::int64_t userID);
+	void requireMovable(std::int64_t id, std::int64_t parentID, std::int64_t userID); // permissions and shape, not the name
+	void requireNotRelocating(std::int64_t id); // 409 while a relocation runs on the entry, inside it or above it
+	void requireFreeName(std::int64_t parentID, const std::string& name, std::int64_t exceptID = -1); // 409 when another entry holds the name
+	bool isWithin(std::int64_t id, std::int64_t ancestorID); // true for the ancestor itself
 };
 
 #endif
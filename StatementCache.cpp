@@ -0,0 +1,131 @@
+// 
+// 
+// 
+
+#include "StatementCache.h"
+#include "Metrics.h"
+#include <iterator>
+
+srv::StatementCache::StatementCache(SQLite::DbConnection& db, Metrics& metrics, size_t capacity)
+	:m_db(db), m_metrics(metrics), m_capacity(capacity), m_uses(0)
+{
+}
+
+srv::CachedStatement srv::StatementCache::prepare(std::string_view sql)
+{
+	auto it = m_statements.find(sql);
+	if (it != m_statements.end())
+	{
+		if (it->second.isInUse)
+			return CachedStatement(*this, prepareUncached(std::string(sql))); // e.g. a lookup recursing into itself
+
+		m_metrics.countStatementCacheHit();
+		it->second.isInUse = true;
+		it->second.lastUsed = ++m_uses;
+		return CachedStatement(*this, it->second);
+	}
+
+	// The set of SQL strings is fixed at compile time; overflowing means dynamic SQL is being cached
+	if (m_statements.size() >= m_capacity)
+		evictLeastRecentlyUsed();
+
+	std::string key(sql);
+	Statement statement = prepareUncached(key);
+	Entry& entry = m_statements.emplace(std::move(key), Entry{ std::move(statement), true, ++m_uses }).first->second;
+	return CachedStatement(*this, entry);
+}
+
+void srv::StatementCache::clear()
+{
+	for (auto it = m_statements.begin(); it != m_statements.end();)
+		it = it->second.isInUse ? std::next(it) : m_statements.erase(it);
+}
+
+srv::Statement srv::StatementCache::prepareUncached(const std::string& sql)
+{
+	const std::uint32_t start = micros();
+	Statement statement = m_db.prepare(sql);
+	m_metrics.getPrepareTimes().observe(micros() - start);
+	return statement;
+}
+
+void srv::StatementCache::evictLeastRecentlyUsed()
+{
+	auto victim = m_statements.end();
+	for (auto it = m_statements.begin(); it != m_statements.end(); ++it)
+		if (!it->second.isInUse && (victim == m_statements.end() || it->second.lastUsed < victim->second.lastUsed))
+			victim = it;
+
+	// With every statement lent out the cache briefly grows past capacity instead
+	if (victim != m_statements.end())
+		m_statements.erase(victim);
+}
+
+srv::CachedStatement::CachedStatement(StatementCache& cache, StatementCache::Entry& entry)
+	:m_cache(cache), m_entry(&entry), m_isStepping(false), m_start(0)
+{
+}
+
+srv::CachedStatement::CachedStatement(StatementCache& cache, Statement&& owned)
+	:m_cache(cache), m_entry(nullptr), m_owned(std::move(owned)), m_isStepping(false), m_start(0)
+{
+}
+
+srv::CachedStatement::CachedStatement(CachedStatement&& other) noexcept
+	:m_cache(other.m_cache), m_entry(other.m_entry), m_owned(std::move(other.m_owned)), m_isStepping(other.m_isStepping), m_start(other.m_start)
+{
+	other.m_entry = nullptr;
+	other.m_owned.reset();
+	other.m_isStepping = false;
+}
+
+srv::CachedStatement::~CachedStatement()
+{
+	if (m_isStepping)
+		m_cache.m_metrics.getStatementTimes().observe(micros() - m_start);
+	if (!m_entry)
+		return; // an uncached statement is finalised with m_owned
+
+	try
+	{
+		m_entry->statement.reset();
+	}
+	catch (const std::exception& e)
+	{
+		log_e("Statement reset failed: %s", e.what()); // reports the last step's error, already thrown to the caller
+	}
+	m_entry->isInUse = false;
+}
+
+srv::Transaction::Transaction(StatementCache& statements)
+	:m_statements(statements), m_isOpen(true), m_start(micros())
+{
+	m_statements.prepare("SAVEPOINT Batch").evaluate();
+}
+
+srv::Transaction::~Transaction()
+{
+	if (!m_isOpen)
+		return;
+
+	try
+	{
+		m_statements.prepare("ROLLBACK TO Batch").evaluate();
+		m_statements.prepare("RELEASE Batch").evaluate();
+	}
+	catch (const std::exception& e)
+	{
+		log_e("Transaction rollback failed: %s", e.what());
+	}
+
+	for (const std::function<void()>& listener : m_statements.m_rollbackListeners)
+		listener();
+	m_statements.getMetrics().getTransactionTimes().observe(micros() - m_start);
+}
+
+void srv::Transaction::commit()
+{
+	m_statements.prepare("RELEASE Batch").evaluate();
+	m_isOpen = false;
+	m_statements.getMetrics().getTransactionTimes().observe(micros() - m_start);
+}
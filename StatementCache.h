@@ -0,0 +1,134 @@
+// StatementCache.h
+
+#ifndef _StatementCache_h
+#define _StatementCache_h
+
+#if defined(ARDUINO) && ARDUINO >= 100
+#include "arduino.h"
+#else
+#include "WProgram.h"
+#endif
+
+#include "SQLiteError.h"
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace srv {
+	class StatementCache;
+	class CachedStatement;
+	class Transaction;
+	class Metrics;
+
+	using Statement = decltype(std::declval<SQLite::DbConnection&>().prepare(std::string()));
+	using DatabaseLock = std::lock_guard<std::recursive_mutex>;
+}
+
+// Prepared statements keyed by their SQL text, handed out again instead of being re-prepared per call. Each
+// is lent through a CachedStatement that resets it when it goes out of scope, so no read transaction outlives
+// its caller and holds back WAL checkpoints. SQL already lent out is prepared afresh for the nested caller.
+// Every task running SQL on the connection holds getMutex() for the duration, since the preupdate hook runs
+// on whichever task steps a statement and feeds caches that are not otherwise synchronised. Each loan is timed
+// from its first step to its reset, so the time spent walking rows counts along with the query itself.
+// SQLite's preupdate hook does not fire for ROLLBACK TO, so caches filled from rows read inside a transaction
+// register a rollback listener and drop what they hold whenever a Transaction is rolled back.
+class srv::StatementCache
+{
+public:
+	StatementCache(SQLite::DbConnection& db, Metrics& metrics, size_t capacity = 48);
+
+	CachedStatement prepare(std::string_view sql);
+	void clear(); // drops every statement not lent out
+	void addRollbackListener(std::function<void()> listener) { m_rollbackListeners.push_back(std::move(listener)); }
+
+	SQLite::DbConnection& getConnection() { return m_db; }
+	Metrics& getMetrics() { return m_metrics; }
+	std::recursive_mutex& getMutex() { return m_mutex; }
+
+private:
+	friend class CachedStatement;
+	friend class Transaction;
+
+	struct Entry
+	{
+		Statement statement;
+		bool isInUse;
+		std::uint32_t lastUsed; // m_uses when last lent out
+	};
+
+	SQLite::DbConnection& m_db;
+	Metrics& m_metrics;
+	std::recursive_mutex m_mutex;
+	size_t m_capacity;
+	std::uint32_t m_uses;
+	std::map<std::string, Entry, std::less<>> m_statements;
+	std::vector<std::function<void()>> m_rollbackListeners;
+
+	Statement prepareUncached(const std::string& sql);
+	void evictLeastRecentlyUsed();
+};
+
+// A statement on loan from the cache, reset when the scope ends; forwards the Statement interface
+class srv::CachedStatement
+{
+public:
+	~CachedStatement();
+
+	CachedStatement(CachedStatement&& other) noexcept;
+	CachedStatement(const CachedStatement&) = delete;
+	CachedStatement& operator=(const CachedStatement&) = delete;
+
+	template<typename... Args>
+	decltype(auto) bind(Args&&... args) { return get().bind(std::forward<Args>(args)...); }
+	decltype(auto) evaluate()
+	{
+		if (!m_isStepping)
+		{
+			m_isStepping = true;
+			m_start = micros();
+		}
+		return get().evaluate();
+	}
+	template<typename T, typename... Args>
+	T getColumnValue(Args&&... args) { return get().template getColumnValue<T>(std::forward<Args>(args)...); }
+
+	Statement& get() { return m_entry ? m_entry->statement : *m_owned; }
+
+private:
+	friend class StatementCache;
+
+	StatementCache& m_cache;
+	StatementCache::Entry* m_entry; // null when the SQL was already lent out and m_owned holds a fresh copy
+	std::optional<Statement> m_owned;
+	bool m_isStepping;
+	std::uint32_t m_start; // micros() at the first step, for the statement time histogram
+
+	CachedStatement(StatementCache& cache, StatementCache::Entry& entry);
+	CachedStatement(StatementCache& cache, Statement&& owned);
+};
+
+// RAII transaction scope, rolled back unless commit() is called. Implemented with savepoints so scopes nest.
+class srv::Transaction
+{
+public:
+	explicit Transaction(StatementCache& statements);
+	~Transaction();
+
+	Transaction(const Transaction&) = delete;
+	Transaction& operator=(const Transaction&) = delete;
+
+	void commit();
+
+private:
+	StatementCache& m_statements;
+	bool m_isOpen;
+	std::uint32_t m_start; // micros(), for the transaction time histogram
+};
+
+#endif
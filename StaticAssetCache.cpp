@@ -0,0 +1,233 @@
+// 
+// 
+// 
+
+#include "StaticAssetCache.h"
+#include <esp_heap_caps.h>
+#include <mbedtls/sha256.h>
+#include <algorithm>
+#include <cstdio>
+#include <utility>
+#include <vector>
+
+namespace {
+	bool endsWith(const std::string& value, const std::string& suffix)
+	{
+		return value.size() >= suffix.size() && value.compare(value.size() - suffix.size(), suffix.size(), suffix) == 0;
+	}
+}
+
+void srv::StaticAssetCache::HeapDeleter::operator()(uint8_t* data) const
+{
+	heap_caps_free(data);
+}
+
+srv::StaticAssetCache::StaticAssetCache(fs::FS& fs, const std::string& root, size_t budget)
+	:m_fs(fs), m_root(root), m_used(0), m_internalUsed(0)
+{
+	if (!m_root.empty() && m_root.back() == '/')
+		m_root.pop_back();
+
+	load(budget);
+}
+
+void srv::StaticAssetCache::load(size_t budget)
+{
+	m_assets.clear();
+	m_used = 0;
+	m_internalUsed = 0;
+
+	std::vector<std::pair<std::string, size_t>> files; // path relative to the root, size
+	std::vector<std::string> directories{ "" };
+	while (!directories.empty())
+	{
+		const std::string directory = std::move(directories.back());
+		directories.pop_back();
+
+		File dir = m_fs.open((m_root + directory).c_str());
+		if (!dir || !dir.isDirectory())
+			continue;
+
+		for (File file = dir.openNextFile(); file; file = dir.openNextFile())
+		{
+			const std::string path = directory + "/" + file.name();
+			if (file.isDirectory())
+				directories.push_back(path);
+			else
+				files.emplace_back(path, file.size());
+			file.close();
+		}
+	}
+
+	// Compressed variants first, then smallest first, so a tight budget still covers the most requests
+	std::sort(files.begin(), files.end(), [](const auto& a, const auto& b)
+		{
+			const bool aIsGzip = endsWith(a.first, ".gz");
+			const bool bIsGzip = endsWith(b.first, ".gz");
+			if (aIsGzip != bIsGzip)
+				return aIsGzip;
+			return a.second < b.second;
+		});
+
+	for (const auto& [path, size] : files)
+	{
+		if (m_used + size > budget)
+		{
+			log_i("Static asset %s left on the card, cache budget exhausted", path.c_str());
+			continue;
+		}
+
+		const bool isGzip = endsWith(path, ".gz");
+		const std::string url = isGzip ? path.substr(0, path.size() - 3) : path;
+		Asset& asset = m_assets[url];
+		if (!isGzip && asset.gzip.data)
+			continue; // sorted after every .gz, so the compressed sibling is already in
+		if (!loadVariant(path, size, isGzip ? asset.gzip : asset.plain))
+			continue;
+
+		asset.contentType = getContentType(url);
+		m_used += size;
+	}
+
+	log_i("Cached %u static assets in %u bytes", m_assets.size(), m_used);
+}
+
+bool srv::StaticAssetCache::canHandle(AsyncWebServerRequest* request)
+{
+	if (!(request->method() & (HTTP_GET | HTTP_HEAD)))
+		return false;
+
+	const Asset* asset = find(request);
+	if (!asset)
+		return false;
+
+	// Called before the headers are parsed, so the variant is only chosen in handleRequest
+	request->addInterestingHeader("Accept-Encoding");
+	request->addInterestingHeader("If-None-Match");
+	return true;
+}
+
+void srv::StaticAssetCache::handleRequest(AsyncWebServerRequest* request)
+{
+	const Asset* asset = find(request);
+	if (!asset)
+		return request->send(404);
+
+	const Variant* variant = select(*asset, request);
+	if (!variant)
+	{
+		// Only the gzip variant fit in the budget and the client refuses gzip
+		std::string url = request->url().c_str();
+		if (url.back() == '/')
+			url += "index.html";
+		return request->send(m_fs, (m_root + url).c_str(), asset->contentType);
+	}
+
+	AsyncWebServerResponse* response;
+	if (request->hasHeader("If-None-Match") && request->header("If-None-Match").indexOf(variant->etag) >= 0)
+		response = request->beginResponse(304);
+	else
+	{
+		response = request->beginResponse_P(200, asset->contentType, variant->data.get(), variant->size);
+		if (variant == &asset->gzip)
+			response->addHeader("Content-Encoding", "gzip");
+	}
+
+	response->addHeader("ETag", variant->etag);
+	response->addHeader("Cache-Control", "no-cache"); // always revalidate; a match costs one round trip, no body
+	response->addHeader("Vary", "Accept-Encoding");
+	request->send(response);
+}
+
+const srv::StaticAssetCache::Asset* srv::StaticAssetCache::find(AsyncWebServerRequest* request) const
+{
+	std::string url = request->url().c_str();
+	if (url.empty() || url.back() == '/')
+		url += "index.html";
+
+	auto it = m_assets.find(url);
+	return it == m_assets.end() ? nullptr : &it->second;
+}
+
+const srv::StaticAssetCache::Variant* srv::StaticAssetCache::select(const Asset& asset, AsyncWebServerRequest* request)
+{
+	const bool acceptsGzip = request->hasHeader("Accept-Encoding") && request->header("Accept-Encoding").indexOf("gzip") >= 0;
+	if (acceptsGzip && asset.gzip.data)
+		return &asset.gzip;
+	if (asset.plain.data)
+		return &asset.plain;
+	return nullptr;
+}
+
+bool srv::StaticAssetCache::loadVariant(const std::string& path, size_t size, Variant& variant)
+{
+	uint8_t* data = static_cast<uint8_t*>(heap_caps_malloc(size ? size : 1, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT));
+	if (!data && m_internalUsed + size <= InternalBudget && heap_caps_get_free_size(MALLOC_CAP_INTERNAL) >= InternalReserve + size)
+	{
+		data = static_cast<uint8_t*>(heap_caps_malloc(size ? size : 1, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT));
+		if (data)
+			m_internalUsed += size;
+	}
+	if (!data)
+	{
+		log_w("Not enough memory to cache %s", path.c_str());
+		return false;
+	}
+	variant.data.reset(data);
+
+	File file = m_fs.open((m_root + path).c_str());
+	const bool isRead = file && file.read(data, size) == size;
+	if (file)
+		file.close();
+	if (!isRead)
+	{
+		log_w("Failed to read static asset %s", path.c_str());
+		variant.data.reset();
+		return false;
+	}
+
+	variant.size = size;
+	variant.etag = computeETag(data, size);
+	return true;
+}
+
+String srv::StaticAssetCache::computeETag(const uint8_t* data, size_t size)
+{
+	unsigned char digest[32];
+	mbedtls_sha256(data, size, digest, 0);
+
+	char etag[19] = "\"";
+	for (size_t i = 0; i < 8; ++i)
+		std::snprintf(etag + 1 + i * 2, 3, "%02x", digest[i]);
+	etag[17] = '"';
+	etag[18] = '\0';
+	return etag;
+}
+
+String srv::StaticAssetCache::getContentType(const std::string& path)
+{
+	static const std::pair<const char*, const char*> types[] = {
+		{ ".html", "text/html" },
+		{ ".htm", "text/html" },
+		{ ".css", "text/css" },
+		{ ".js", "application/javascript" },
+		{ ".mjs", "application/javascript" },
+		{ ".json", "application/json" },
+		{ ".webmanifest", "application/manifest+json" },
+		{ ".svg", "image/svg+xml" },
+		{ ".png", "image/png" },
+		{ ".jpg", "image/jpeg" },
+		{ ".jpeg", "image/jpeg" },
+		{ ".gif", "image/gif" },
+		{ ".ico", "image/x-icon" },
+		{ ".woff", "font/woff" },
+		{ ".woff2", "font/woff2" },
+		{ ".wasm", "application/wasm" },
+		{ ".txt", "text/plain" }
+	};
+
+	for (const auto& [extension, type] : types)
+		if (endsWith(path, extension))
+			return type;
+	return "application/octet-stream";
+}
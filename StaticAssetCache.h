@@ -0,0 +1,78 @@
+// StaticAssetCache.h
+
+#ifndef _StaticAssetCache_h
+#define _StaticAssetCache_h
+
+#if defined(ARDUINO) && ARDUINO >= 100
+#include "arduino.h"
+#else
+#include "WProgram.h"
+#endif
+
+#include <ESPAsyncWebServer.h>
+#include <FS.h>
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+namespace srv {
+	class StaticAssetCache;
+}
+
+// Serves the web interface from RAM (PSRAM when present), loaded once from the card within a byte budget.
+// Precompressed .gz siblings are preferred for clients accepting gzip, and each variant carries an ETag
+// derived from its content so revalidation is a 304 without touching the card. A plain file whose .gz
+// sibling is cached stays on the card for the rare client refusing gzip. Without PSRAM only InternalBudget
+// bytes are taken from internal RAM, and never below InternalReserve free. Anything that did not fit falls
+// through to the static file handler behind it.
+class srv::StaticAssetCache : public AsyncWebHandler
+{
+public:
+	static constexpr size_t InternalBudget = 64 * 1024; // bytes cached in internal RAM when PSRAM is short
+	static constexpr size_t InternalReserve = 96 * 1024; // internal RAM left free for connections and the database
+
+	StaticAssetCache(fs::FS& fs, const std::string& root, size_t budget);
+
+	void load(size_t budget); // replaces the cache; only while no requests are being served
+
+	bool canHandle(AsyncWebServerRequest* request) override;
+	void handleRequest(AsyncWebServerRequest* request) override;
+	bool isRequestHandlerTrivial() override { return false; }
+
+	size_t getUsedBytes() const { return m_used; }
+	size_t getAssetCount() const { return m_assets.size(); }
+
+private:
+	struct HeapDeleter
+	{
+		void operator()(uint8_t* data) const;
+	};
+
+	struct Variant
+	{
+		std::unique_ptr<uint8_t, HeapDeleter> data;
+		size_t size = 0;
+		String etag;
+	};
+
+	struct Asset
+	{
+		String contentType;
+		Variant plain;
+		Variant gzip;
+	};
+
+	fs::FS& m_fs;
+	std::string m_root;
+	size_t m_used;
+	size_t m_internalUsed;
+	std::unordered_map<std::string, Asset> m_assets; // keyed by request path
+
+	const Asset* find(AsyncWebServerRequest* request) const;
+	static const Variant* select(const Asset& asset, AsyncWebServerRequest* request);
+	bool loadVariant(const std::string& path, size_t size, Variant& variant);
+	static String computeETag(const uint8_t* data, size_t size);
+	static String getContentType(const std::string& path);
+};
+
+#endif
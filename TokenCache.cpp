@@ -0,0 +1,80 @@
+// 
+// 
+// 
+
+#include "TokenCache.h"
+#include <mbedtls/sha256.h>
+
+srv::TokenCache::TokenCache(size_t capacity, std::uint32_t timeToLive)
+	:m_capacity(capacity), m_timeToLive(timeToLive)
+{
+	m_index.reserve(capacity);
+}
+
+srv::TokenCache::Digest srv::TokenCache::digest(const char* token, size_t len)
+{
+	Digest digest;
+	mbedtls_sha256(reinterpret_cast<const unsigned char*>(token), len, digest.data(), 0);
+	return digest;
+}
+
+std::optional<std::int64_t> srv::TokenCache::find(const Digest& digest)
+{
+	auto it = m_index.find(digest);
+	if (it == m_index.end())
+		return std::nullopt;
+
+	auto entry = it->second;
+	if (static_cast<std::int32_t>(millis() - entry->expiresAt) >= 0)
+	{
+		m_entries.erase(entry);
+		m_index.erase(it);
+		return std::nullopt;
+	}
+
+	m_entries.splice(m_entries.begin(), m_entries, entry);
+	return entry->userID;
+}
+
+void srv::TokenCache::insert(const Digest& digest, std::int64_t userID)
+{
+	if (!m_capacity)
+		return;
+
+	auto it = m_index.find(digest);
+	if (it != m_index.end())
+	{
+		m_entries.erase(it->second);
+		m_index.erase(it);
+	}
+
+	if (m_entries.size() >= m_capacity)
+	{
+		m_index.erase(m_entries.back().digest);
+		m_entries.pop_back();
+	}
+
+	m_entries.push_front({ digest, userID, millis() + m_timeToLive });
+	m_index.emplace(digest, m_entries.begin());
+}
+
+void srv::TokenCache::eraseUser(std::int64_t userID)
+{
+	for (auto it = m_entries.begin(); it != m_entries.end();)
+	{
+		if (it->userID != userID)
+		{
+			++it;
+			continue;
+		}
+
+		m_index.erase(it->digest);
+		it = m_entries.erase(it);
+	}
+}
+
+void srv::TokenCache::clear()
+{
+	m_entries.clear();
+	m_index.clear();
+}
@@ -0,0 +1,62 @@
+// TokenCache.h
+
+#ifndef _TokenCache_h
+#define _TokenCache_h
+
+#if defined(ARDUINO) && ARDUINO >= 100
+#include "arduino.h"
+#else
+#include "WProgram.h"
+#endif
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <list>
+#include <optional>
+#include <unordered_map>
+
+namespace srv {
+	class TokenCache;
+}
+
+// Bounded LRU of JWTs whose signature has already been verified, keyed by the SHA-256 digest of the token
+class srv::TokenCache
+{
+public:
+	using Digest = std::array<std::uint8_t, 32>;
+
+	TokenCache(size_t capacity = 16, std::uint32_t timeToLive = 10 * 60 * 1000);
+
+	static Digest digest(const char* token, size_t len);
+
+	std::optional<std::int64_t> find(const Digest& digest);
+	void insert(const Digest& digest, std::int64_t userID);
+	void eraseUser(std::int64_t userID);
+	void clear();
+
+private:
+	struct Entry
+	{
+		Digest digest;
+		std::int64_t userID;
+		std::uint32_t expiresAt; // millis()
+	};
+
+	struct DigestHash
+	{
+		size_t operator()(const Digest& digest) const
+		{
+			size_t hash;
+			std::memcpy(&hash, digest.data(), sizeof(hash));
+			return hash;
+		}
+	};
+
+	size_t m_capacity;
+	std::uint32_t m_timeToLive;
+	std::list<Entry> m_entries; // most recently used first
+	std::unordered_map<Digest, std::list<Entry>::iterator, DigestHash> m_index;
+};
+
+#endif
@@ -0,0 +1,257 @@
+// 
+// 
+// 
+
+#include "UploadSessions.h"
+#include <stdexcept>
+
+srv::UploadSessions::UploadSessions(StatementCache& statements, vfs::Filesystem& vfs, DiskPlacement& placement)
+	:m_statements(statements), m_vfs(vfs), m_placement(placement), m_lastReap(0)
+{
+}
+
+std::int64_t srv::UploadSessions::create(std::int64_t ownerID, std::int64_t parentID, const std::string& name, std::uint64_t size)
+{
+	if (name.empty())
+		throw std::invalid_argument("Missing name");
+	if (!m_vfs.isDirectory(parentID))
+		throw std::invalid_argument("Parent is not a directory");
+
+	const std::int64_t diskID = m_placement.choose(size);
+
+	CachedStatement insert = m_statements.prepare(
+		"INSERT INTO UploadSessions (OwnerID, ParentID, Name, Size, DiskID, UpdatedAt) VALUES (?, ?, ?, ?, ?, strftime('%s', 'now'))"
+	);
+	insert.bind(1, ownerID);
+	insert.bind(2, parentID);
+	insert.bind(3, name);
+	insert.bind(4, static_cast<std::int64_t>(size));
+	insert.bind(5, diskID);
+	insert.evaluate();
+
+	CachedStatement lastID = m_statements.prepare("SELECT last_insert_rowid()");
+	lastID.evaluate();
+	const std::int64_t sessionID = lastID.getColumnValue<std::int64_t>(0);
+
+	Session session{ sessionID, ownerID, parentID, name, size, diskID };
+	fs::FS& fs = getPartFS(session);
+	fs.mkdir("/.uploads");
+
+	// Sizing the part file up front fixes its cluster chain, so concurrent chunk writers never extend it
+	File part = fs.open(getPartPath(sessionID).c_str(), FILE_WRITE);
+	const bool isAllocated = part && (!size || (part.seek(size - 1) && part.write(static_cast<uint8_t>(0)) == 1));
+	if (part)
+		part.close();
+
+	if (!isAllocated)
+	{
+		erase(session);
+		throw std::runtime_error("Failed to allocate upload part file");
+	}
+
+	return sessionID;
+}
+
+srv::UploadSessions::Session srv::UploadSessions::get(std::int64_t sessionID, std::int64_t ownerID)
+{
+	CachedStatement statement = m_statements.prepare(
+		"SELECT ParentID, Name, Size, DiskID FROM UploadSessions WHERE ID = ? AND OwnerID = ?"
+	);
+	statement.bind(1, sessionID);
+	statement.bind(2, ownerID);
+	if (!statement.evaluate())
+		throw std::invalid_argument("Upload session not found");
+
+	return {
+		sessionID,
+		ownerID,
+		statement.getColumnValue<std::int64_t>(0),
+		statement.getColumnValue<std::string>(1),
+		static_cast<std::uint64_t>(statement.getColumnValue<std::int64_t>(2)),
+		statement.getColumnValue<std::int64_t>(3)
+	};
+}
+
+std::vector<srv::UploadSessions::Chunk> srv::UploadSessions::getReceivedChunks(std::int64_t sessionID)
+{
+	CachedStatement statement = m_statements.prepare(
+		"SELECT Offset, Length FROM UploadChunks WHERE SessionID = ? ORDER BY Offset"
+	);
+	statement.bind(1, sessionID);
+
+	std::vector<Chunk> chunks;
+	while (statement.evaluate())
+		chunks.push_back({
+			static_cast<std::uint64_t>(statement.getColumnValue<std::int64_t>(0)),
+			static_cast<std::uint64_t>(statement.getColumnValue<std::int64_t>(1))
+			});
+	return chunks;
+}
+
+File srv::UploadSessions::openChunk(std::int64_t sessionID, std::int64_t ownerID, std::uint64_t offset, std::uint64_t length)
+{
+	const Session session = get(sessionID, ownerID);
+
+	if (!length || offset + length > session.size)
+		throw std::invalid_argument("Chunk lies outside the upload");
+	if (offset % ChunkAlignment || ((offset + length) % ChunkAlignment && offset + length != session.size))
+		throw std::invalid_argument("Chunk is not aligned to 4096 bytes");
+
+	File part = getPartFS(session).open(getPartPath(sessionID).c_str(), "r+");
+	if (!part)
+		throw std::runtime_error("Failed to open upload part file");
+	if (!part.seek(offset))
+		throw std::runtime_error("Failed to seek in upload part file");
+
+	return part;
+}
+
+void srv::UploadSessions::recordChunk(std::int64_t sessionID, std::uint64_t offset, std::uint64_t length)
+{
+	CachedStatement statement = m_statements.prepare(
+		"INSERT OR REPLACE INTO UploadChunks (SessionID, Offset, Length) VALUES (?, ?, ?)"
+	);
+	statement.bind(1, sessionID);
+	statement.bind(2, static_cast<std::int64_t>(offset));
+	statement.bind(3, static_cast<std::int64_t>(length));
+	statement.evaluate();
+
+	CachedStatement touch = m_statements.prepare("UPDATE UploadSessions SET UpdatedAt = strftime('%s', 'now') WHERE ID = ?");
+	touch.bind(1, sessionID);
+	touch.evaluate();
+}
+
+std::int64_t srv::UploadSessions::commit(std::int64_t sessionID, std::int64_t ownerID)
+{
+	const Session session = get(sessionID, ownerID);
+
+	std::uint64_t covered = 0;
+	for (const Chunk& chunk : getReceivedChunks(sessionID))
+	{
+		if (chunk.offset > covered)
+			break;
+		covered = std::max(covered, chunk.offset + chunk.length);
+	}
+	if (covered < session.size)
+		throw std::invalid_argument("Upload is incomplete");
+
+	// Placed on the part file's disk, so moving it into place is a rename rather than a copy
+	Transaction transaction(m_statements);
+	m_placement.create(session.parentID, session.name, session.size, ownerID, session.diskID).close();
+	const std::int64_t fileID = m_placement.findEntry(session.parentID, session.name);
+
+	try
+	{
+		moveIntoPlace(session, fileID);
+	}
+	catch (...)
+	{
+		m_vfs.removeFileEntry(fileID, ownerID);
+		throw;
+	}
+
+	erase(session);
+	transaction.commit();
+	return fileID;
+}
+
+void srv::UploadSessions::abort(std::int64_t sessionID, std::int64_t ownerID)
+{
+	erase(get(sessionID, ownerID));
+}
+
+void srv::UploadSessions::runMaintenance()
+{
+	if (millis() - m_lastReap < ReapInterval)
+		return;
+	m_lastReap = millis();
+
+	DatabaseLock lock(m_statements.getMutex());
+	try
+	{
+		reapStale();
+	}
+	catch (const std::exception& e)
+	{
+		log_e("Failed to reap stale upload sessions: %s", e.what());
+	}
+}
+
+void srv::UploadSessions::reapStale()
+{
+	m_statements.prepare(
+		"UPDATE UploadSessions SET UpdatedAt = strftime('%s', 'now') WHERE UpdatedAt > strftime('%s', 'now')"
+	).evaluate();
+
+	std::vector<Session> stale;
+	{
+		CachedStatement statement = m_statements.prepare(
+			"SELECT ID, OwnerID, ParentID, Name, Size, DiskID FROM UploadSessions "
+			"WHERE UpdatedAt < strftime('%s', 'now') - ? LIMIT ?"
+		);
+		statement.bind(1, SessionTimeout);
+		statement.bind(2, ReapBatch);
+		while (statement.evaluate())
+			stale.push_back({
+				statement.getColumnValue<std::int64_t>(0),
+				statement.getColumnValue<std::int64_t>(1),
+				statement.getColumnValue<std::int64_t>(2),
+				statement.getColumnValue<std::string>(3),
+				static_cast<std::uint64_t>(statement.getColumnValue<std::int64_t>(4)),
+				statement.getColumnValue<std::int64_t>(5)
+				});
+	}
+
+	for (const Session& session : stale)
+	{
+		log_i("Upload session %lld expired, removing its part file", session.id);
+		erase(session);
+	}
+}
+
+std::string srv::UploadSessions::getPartPath(std::int64_t sessionID)
+{
+	return "/.uploads/" + std::to_string(sessionID) + ".part";
+}
+
+fs::FS& srv::UploadSessions::getPartFS(const Session& session)
+{
+	return m_vfs.getDiskMap().getDiskByID(session.diskID).getFS();
+}
+
+void srv::UploadSessions::moveIntoPlace(const Session& session, std::int64_t fileID)
+{
+	fs::FS& source = getPartFS(session);
+	fs::FS& destination = m_vfs.getDisk(fileID).getFS();
+	const std::string partPath = getPartPath(session.id);
+	const std::string path = m_vfs.getInternalPath(fileID);
+
+	if (&source == &destination)
+	{
+		// Same volume: a directory-entry rename, no data is copied
+		destination.remove(path.c_str());
+		if (!destination.rename(partPath.c_str(), path.c_str()))
+			throw std::runtime_error("Failed to move upload into place");
+		return;
+	}
+
+	File in = source.open(partPath.c_str());
+	File out = destination.open(path.c_str(), FILE_WRITE);
+	if (!in || !out)
+		throw std::runtime_error("Failed to open upload for copying");
+
+	uint8_t buffer[1024];
+	size_t count;
+	while ((count = in.read(buffer, sizeof(buffer))))
+		if (out.write(buffer, count) != count)
+			throw std::runtime_error("Failed to copy upload into place");
+}
+
+void srv::UploadSessions::erase(const Session& session)
+{
+	getPartFS(session).remove(getPartPath(session.id).c_str());
+
+	CachedStatement statement = m_statements.prepare("DELETE FROM UploadSessions WHERE ID = ?");
+	statement.bind(1, session.id);
+	statement.evaluate();
+}
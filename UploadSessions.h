@@ -0,0 +1,79 @@
+// UploadSessions.h
+
+#ifndef _UploadSessions_h
+#define _UploadSessions_h
+
+#if defined(ARDUINO) && ARDUINO >= 100
+#include "arduino.h"
+#else
+#include "WProgram.h"
+#endif
+
+#include "VFS.h"
+#include "StatementCache.h"
+#include "DiskPlacement.h"
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace srv {
+	class UploadSessions;
+}
+
+// Resumable uploads: chunks are written at their offset into a hidden part file, tracked in the
+// UploadSessions/UploadChunks tables, and the file only enters FileEntries when the session is committed.
+// Sessions that receive nothing for SessionTimeout are reaped from loop() along with their part files. The
+// clock is wall time when NTP has set it; a session stamped ahead of the clock, as after a reboot without
+// it, has its timer restarted rather than being reaped.
+class srv::UploadSessions
+{
+public:
+	struct Session
+	{
+		std::int64_t id;
+		std::int64_t ownerID;
+		std::int64_t parentID;
+		std::string name;
+		std::uint64_t size;
+		std::int64_t diskID;
+	};
+
+	struct Chunk
+	{
+		std::uint64_t offset;
+		std::uint64_t length;
+	};
+
+	// Chunks on separate connections must never share a sector of the part file
+	static constexpr std::uint64_t ChunkAlignment = 4096;
+	static constexpr std::int64_t SessionTimeout = 24 * 60 * 60; // seconds without a chunk
+	static constexpr std::int64_t ReapBatch = 8; // sessions removed per maintenance pass
+	static constexpr std::uint32_t ReapInterval = 60 * 1000; // ms
+
+	UploadSessions(StatementCache& statements, vfs::Filesystem& vfs, DiskPlacement& placement);
+
+	std::int64_t create(std::int64_t ownerID, std::int64_t parentID, const std::string& name, std::uint64_t size);
+	Session get(std::int64_t sessionID, std::int64_t ownerID);
+	std::vector<Chunk> getReceivedChunks(std::int64_t sessionID);
+
+	File openChunk(std::int64_t sessionID, std::int64_t ownerID, std::uint64_t offset, std::uint64_t length);
+	void recordChunk(std::int64_t sessionID, std::uint64_t offset, std::uint64_t length);
+
+	std::int64_t commit(std::int64_t sessionID, std::int64_t ownerID); // returns the new file ID
+	void abort(std::int64_t sessionID, std::int64_t ownerID);
+	void runMaintenance();
+
+private:
+	StatementCache& m_statements;
+	vfs::Filesystem& m_vfs;
+	DiskPlacement& m_placement;
+	std::uint32_t m_lastReap;
+
+	static std::string getPartPath(std::int64_t sessionID);
+	fs::FS& getPartFS(const Session& session);
+	void moveIntoPlace(const Session& session, std::int64_t fileID);
+	void erase(const Session& session);
+	void reapStale();
+};
+
+#endif
@@ -0,0 +1,190 @@
+// 
+// 
+// 
+
+#include "UploadWriter.h"
+#include "HTTPError.h"
+#include <freertos/task.h>
+#include <algorithm>
+#include <stdexcept>
+
+std::map<std::int64_t, QueueHandle_t> srv::UploadWriter::s_queues;
+std::mutex srv::UploadWriter::s_handoff;
+
+srv::UploadWriter::Target::Target(File file, std::int64_t diskID, BufferPool& pool, Metrics& metrics)
+	:file(file), diskID(diskID), pool(pool), metrics(metrics), blocks{ nullptr, nullptr }, hasFailed(false), idle(xSemaphoreCreateBinary()), isAbandoned(false)
+{
+	if (!idle)
+		throw std::runtime_error("Failed to create upload semaphore");
+}
+
+srv::UploadWriter::Target::~Target()
+{
+	pool.release(blocks[0]);
+	pool.release(blocks[1]);
+	if (file)
+		file.close();
+	vSemaphoreDelete(idle);
+}
+
+srv::UploadWriter::UploadWriter(File file, std::int64_t diskID, BufferPool& pool, Metrics& metrics, std::uint64_t expectedSize)
+	:m_target(new Target(file, diskID, pool, metrics)), m_queue(nullptr), m_expectedSize(expectedSize), m_bytesWritten(0),
+	m_activeBlock(0), m_fill(0), m_isInFlight(false)
+{
+	auto queue = s_queues.find(diskID);
+	if (queue != s_queues.end())
+	{
+		m_queue = queue->second;
+		m_target->blocks[0] = pool.acquire();
+		m_target->blocks[1] = m_target->blocks[0] ? pool.acquire() : nullptr;
+		if (!m_target->blocks[1])
+		{
+			pool.release(m_target->blocks[0]);
+			m_target->blocks[0] = nullptr;
+		}
+	}
+
+	preallocate();
+}
+
+srv::UploadWriter::~UploadWriter()
+{
+	if (!waitIdle(MaxWriteWait))
+	{
+		std::lock_guard<std::mutex> lock(s_handoff);
+		if (xSemaphoreTake(m_target->idle, 0) != pdTRUE)
+		{
+			log_w("Upload block still being written after %u ms, leaving it to the writer task", pdTICKS_TO_MS(MaxWriteWait));
+			m_target->isAbandoned = true;
+			return;
+		}
+	}
+	delete m_target;
+}
+
+void srv::UploadWriter::write(const uint8_t* data, size_t len)
+{
+	if (m_target->hasFailed)
+		throw std::runtime_error("Failed to write upload to disk");
+
+	if (!m_target->blocks[0])
+		return writeDirect(data, len);
+
+	const size_t blockSize = m_target->pool.getBlockSize();
+	while (len)
+	{
+		const size_t count = std::min(len, blockSize - m_fill);
+		std::memcpy(m_target->blocks[m_activeBlock] + m_fill, data, count);
+		m_fill += count;
+		data += count;
+		len -= count;
+
+		if (m_fill == blockSize)
+			submitActiveBlock();
+	}
+}
+
+void srv::UploadWriter::finish()
+{
+	if (m_target->blocks[0] && m_fill)
+		submitActiveBlock();
+	if (!waitIdle(MaxWriteWait))
+		throw HTTPError(503, "Disk busy, try again later", 1);
+
+	if (m_target->hasFailed)
+		throw std::runtime_error("Failed to write upload to disk");
+
+	m_target->file.flush();
+	m_target->file.close();
+
+	if (m_expectedSize && m_bytesWritten != m_expectedSize)
+		throw std::invalid_argument("Uploaded size does not match size parameter");
+}
+
+void srv::UploadWriter::startWriterTask(std::int64_t diskID, UBaseType_t priority, size_t queueDepth)
+{
+	if (s_queues.count(diskID))
+		return;
+
+	QueueHandle_t queue = xQueueCreate(queueDepth, sizeof(WriteJob));
+	if (!queue)
+		throw std::runtime_error("Failed to create upload writer queue");
+
+	if (xTaskCreate(&UploadWriter::writerTask, "upload_writer", 4096, queue, priority, nullptr) != pdPASS)
+	{
+		vQueueDelete(queue);
+		throw std::runtime_error("Failed to start upload writer task");
+	}
+	s_queues[diskID] = queue;
+}
+
+void srv::UploadWriter::preallocate()
+{
+	// Extending the file once lets FAT allocate the cluster chain up front instead of on every block
+	File& file = m_target->file;
+	if (!m_expectedSize || file.size() >= m_expectedSize)
+		return;
+
+	if (!file.seek(m_expectedSize - 1) || file.write(static_cast<uint8_t>(0)) != 1 || !file.seek(0))
+		log_w("Failed to preallocate %llu bytes", m_expectedSize);
+}
+
+void srv::UploadWriter::submitActiveBlock()
+{
+	// Double buffering: at most one block is in flight while the other one fills
+	if (!waitIdle(MaxWriteWait))
+		throw HTTPError(503, "Disk busy, try again later", 1);
+
+	WriteJob job{ m_target, m_target->blocks[m_activeBlock], m_fill };
+	m_isInFlight = true;
+	if (xQueueSend(m_queue, &job, MaxWriteWait) != pdTRUE)
+	{
+		m_isInFlight = false;
+		throw HTTPError(503, "Disk busy, try again later", 1); // other uploads to the disk fill the queue
+	}
+
+	m_bytesWritten += m_fill;
+	m_activeBlock ^= 1;
+	m_fill = 0;
+}
+
+bool srv::UploadWriter::waitIdle(TickType_t timeout)
+{
+	if (!m_isInFlight)
+		return true;
+
+	if (xSemaphoreTake(m_target->idle, timeout) != pdTRUE)
+		return false;
+	m_isInFlight = false;
+	return true;
+}
+
+void srv::UploadWriter::writeDirect(const uint8_t* data, size_t len)
+{
+	if (m_target->file.write(data, len) != len)
+		throw std::runtime_error("Failed to write upload to disk");
+	m_bytesWritten += len;
+	m_target->metrics.addDiskWrite(m_target->diskID, len);
+}
+
+void srv::UploadWriter::writerTask(void* queue)
+{
+	WriteJob job;
+	for (;;)
+	{
+		if (xQueueReceive(static_cast<QueueHandle_t>(queue), &job, portMAX_DELAY) != pdTRUE)
+			continue;
+
+		Target& target = *job.target;
+		if (target.file.write(job.block, job.len) != job.len)
+			target.hasFailed = true;
+		else
+			target.metrics.addDiskWrite(target.diskID, job.len);
+
+		std::lock_guard<std::mutex> lock(s_handoff);
+		if (target.isAbandoned)
+			delete &target;
+		else
+			xSemaphoreGive(target.idle);
+	}
+}
@@ -0,0 +1,94 @@
+// UploadWriter.h
+
+#ifndef _UploadWriter_h
+#define _UploadWriter_h
+
+#if defined(ARDUINO) && ARDUINO >= 100
+#include "arduino.h"
+#else
+#include "WProgram.h"
+#endif
+
+#include "BufferPool.h"
+#include "Metrics.h"
+#include <FS.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <mutex>
+
+namespace srv {
+	class UploadWriter;
+}
+
+// Collects upload fragments into pool blocks and commits full blocks from the disk's writer task,
+// so the network task keeps receiving while the previous block is written to the card.
+// Falls back to writing fragments directly when the pool has no blocks to spare. The network task, which also
+// holds the database lock, never waits longer than MaxWriteWait for the writer: a card that stalls past it fails
+// the upload with a retryable 503, and a writer destroyed with a block still in flight leaves the file and blocks
+// for the writer task to release.
+class srv::UploadWriter
+{
+public:
+	static constexpr TickType_t MaxWriteWait = pdMS_TO_TICKS(200); // per wait; a block submit waits at most twice
+
+	UploadWriter(File file, std::int64_t diskID, BufferPool& pool, Metrics& metrics, std::uint64_t expectedSize);
+	~UploadWriter();
+
+	UploadWriter(const UploadWriter&) = delete;
+	UploadWriter& operator=(const UploadWriter&) = delete;
+
+	void write(const uint8_t* data, size_t len);
+	void finish(); // flushes, closes and checks the final size
+
+	std::uint64_t getBytesWritten() const { return m_bytesWritten; }
+
+	static void startWriterTask(std::int64_t diskID, UBaseType_t priority = 2, size_t queueDepth = 8); // one per disk
+
+private:
+	// Everything the writer task touches, so it can outlive an abandoned UploadWriter
+	struct Target
+	{
+		File file;
+		std::int64_t diskID;
+		BufferPool& pool;
+		Metrics& metrics;
+		uint8_t* blocks[2];
+		std::atomic<bool> hasFailed;
+		SemaphoreHandle_t idle;
+		bool isAbandoned; // guarded by s_handoff
+
+		Target(File file, std::int64_t diskID, BufferPool& pool, Metrics& metrics);
+		~Target();
+	};
+
+	struct WriteJob
+	{
+		Target* target;
+		uint8_t* block;
+		size_t len;
+	};
+
+	static std::map<std::int64_t, QueueHandle_t> s_queues; // filled at startup, read-only afterwards
+	static std::mutex s_handoff; // orders a writer giving up on a block against the task finishing it
+
+	Target* m_target;
+	QueueHandle_t m_queue;
+	std::uint64_t m_expectedSize;
+	std::uint64_t m_bytesWritten;
+	size_t m_activeBlock;
+	size_t m_fill;
+	bool m_isInFlight;
+
+	void preallocate();
+	void submitActiveBlock();
+	bool waitIdle(TickType_t timeout); // false if a block is still in flight after timeout
+	void writeDirect(const uint8_t* data, size_t len);
+
+	static void writerTask(void* queue);
+};
+
+#endif
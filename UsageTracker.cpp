@@ -0,0 +1,135 @@
+// 
+// 
+// 
+
+#include "UsageTracker.h"
+#include "HTTPError.h"
+#include <algorithm>
+#include <stdexcept>
+#include <vector>
+
+srv::UsageTracker::UsageTracker(StatementCache& statements, InodeCache& inodes)
+	:m_statements(statements), m_inodes(inodes), m_isSettled(false), m_isStamped(false)
+{
+}
+
+void srv::UsageTracker::setSize(std::int64_t fileID, std::uint64_t size)
+{
+	CachedStatement update = m_statements.prepare("UPDATE FileEntries SET Size = ?, MTime = strftime('%s', 'now') WHERE ID = ?");
+	update.bind(1, static_cast<std::int64_t>(size));
+	update.bind(2, fileID);
+	update.evaluate();
+}
+
+std::uint64_t srv::UsageTracker::getDiskUsed(std::int64_t diskID)
+{
+	CachedStatement statement = m_statements.prepare("SELECT UsedBytes FROM DiskUsage WHERE DiskID = ?");
+	statement.bind(1, diskID);
+	if (!statement.evaluate())
+		return 0;
+	return std::max<std::int64_t>(statement.getColumnValue<std::int64_t>(0), 0);
+}
+
+srv::UsageTracker::Usage srv::UsageTracker::getUserUsage(std::int64_t userID)
+{
+	Usage usage{ 0, m_defaultQuota };
+
+	CachedStatement statement = m_statements.prepare("SELECT UsedBytes, Quota FROM UserUsage WHERE UserID = ?");
+	statement.bind(1, userID);
+	if (!statement.evaluate())
+		return usage;
+
+	usage.used = std::max<std::int64_t>(statement.getColumnValue<std::int64_t>(0), 0);
+	const std::int64_t quota = statement.getColumnValue<std::int64_t>(1);
+	if (quota >= 0)
+		usage.quota = quota;
+	return usage;
+}
+
+void srv::UsageTracker::requireQuota(std::int64_t userID, std::uint64_t size)
+{
+	const Usage usage = getUserUsage(userID);
+	if (usage.quota && (usage.used > *usage.quota || size > *usage.quota - usage.used))
+		throw HTTPError(507, "Quota exceeded");
+}
+
+void srv::UsageTracker::setQuota(std::int64_t userID, std::optional<std::uint64_t> quota)
+{
+	DatabaseLock lock(m_statements.getMutex());
+	Transaction transaction(m_statements);
+
+	CachedStatement insert = m_statements.prepare("INSERT OR IGNORE INTO UserUsage (UserID) VALUES (?)");
+	insert.bind(1, userID);
+	insert.evaluate();
+
+	CachedStatement update = m_statements.prepare("UPDATE UserUsage SET Quota = ? WHERE UserID = ?");
+	update.bind(1, quota ? static_cast<std::int64_t>(*quota) : -1);
+	update.bind(2, userID);
+	update.evaluate();
+	transaction.commit();
+}
+
+void srv::UsageTracker::runMaintenance()
+{
+	if (m_isSettled && m_isStamped)
+		return;
+
+	DatabaseLock lock(m_statements.getMutex());
+	// Through the partial indexes, so each batch costs the same however many files are already measured.
+	// Sizes come first, since placement and quotas wait for them.
+	std::vector<std::int64_t> unknown;
+	{
+		CachedStatement statement = m_statements.prepare(m_isSettled
+			? "SELECT ID FROM FileEntries INDEXED BY FileEntriesUnstamped WHERE MTime < 0 AND DiskID IS NOT NULL LIMIT ?"
+			: "SELECT ID FROM FileEntries INDEXED BY FileEntriesUnsized WHERE Size < 0 LIMIT ?");
+		statement.bind(1, BackfillBatch);
+		while (statement.evaluate())
+			unknown.push_back(statement.getColumnValue<std::int64_t>(0));
+	}
+
+	if (unknown.empty())
+	{
+		if (m_isSettled)
+			m_isStamped = true;
+		else
+			log_i("Disk usage accounting is complete");
+		m_isSettled = true;
+		return;
+	}
+
+	Transaction transaction(m_statements);
+	for (std::int64_t fileID : unknown)
+	{
+		// A size already known stays, since a copy still in progress would be measured short
+		const Measurement measurement = measure(fileID);
+		CachedStatement update = m_statements.prepare(
+			"UPDATE FileEntries SET Size = CASE WHEN Size < 0 THEN ? ELSE Size END, MTime = ? WHERE ID = ?"
+		);
+		update.bind(1, static_cast<std::int64_t>(measurement.size));
+		update.bind(2, static_cast<std::int64_t>(measurement.lastWrite));
+		update.bind(3, fileID);
+		update.evaluate();
+	}
+	transaction.commit();
+}
+
+srv::UsageTracker::Measurement srv::UsageTracker::measure(std::int64_t fileID)
+{
+	try
+	{
+		const InodeCache::Inode& inode = m_inodes.get(fileID);
+		if (inode.isDirectory)
+			return { 0, 0 };
+
+		File file = inode.disk->getFS().open(inode.path.c_str());
+		if (!file)
+			return { 0, 0 }; // missing data is the reconciler's concern
+		const Measurement measurement{ file.size(), file.getLastWrite() };
+		file.close();
+		return measurement;
+	}
+	catch (const std::invalid_argument&)
+	{
+		return { 0, 0 }; // queued for background deletion
+	}
+}
@@ -0,0 +1,68 @@
+// UsageTracker.h
+
+#ifndef _UsageTracker_h
+#define _UsageTracker_h
+
+#if defined(ARDUINO) && ARDUINO >= 100
+#include "arduino.h"
+#else
+#include "WProgram.h"
+#endif
+
+#include "StatementCache.h"
+#include "InodeCache.h"
+#include <cstdint>
+#include <ctime>
+#include <optional>
+
+namespace srv {
+	class UsageTracker;
+}
+
+// Bytes stored per disk and per owner, kept in the DiskUsage and UserUsage tables by triggers on
+// FileEntries.Size, DiskID and OwnerID, so reading them never walks the tree or scans the FAT. A new file's
+// Size is its declared size until the data is written, which counts uploads in flight against the quota.
+// Files stored before accounting existed start at -1 and are measured a batch at a time from loop().
+// FileEntries.MTime, which listings read instead of the card, is stamped with every size and backfilled
+// the same way once all sizes are known.
+class srv::UsageTracker
+{
+public:
+	struct Usage
+	{
+		std::uint64_t used;
+		std::optional<std::uint64_t> quota;
+	};
+
+	static constexpr std::int64_t BackfillBatch = 16; // files of unknown size measured per maintenance pass
+
+	UsageTracker(StatementCache& statements, InodeCache& inodes);
+
+	void setSize(std::int64_t fileID, std::uint64_t size); // also stamps the write time as now
+	std::uint64_t getDiskUsed(std::int64_t diskID); // tracked files only
+	Usage getUserUsage(std::int64_t userID);
+	void requireQuota(std::int64_t userID, std::uint64_t size); // throws HTTPError 507 when size does not fit
+
+	void setQuota(std::int64_t userID, std::optional<std::uint64_t> quota); // nullopt falls back to the default
+	void setDefaultQuota(std::optional<std::uint64_t> quota) { m_defaultQuota = quota; }
+
+	bool isSettled() const { return m_isSettled; } // every file has a known size
+	void runMaintenance(); // from loop()
+
+private:
+	struct Measurement
+	{
+		std::uint64_t size;
+		std::time_t lastWrite;
+	};
+
+	StatementCache& m_statements;
+	InodeCache& m_inodes;
+	std::optional<std::uint64_t> m_defaultQuota;
+	bool m_isSettled;
+	bool m_isStamped; // every file has a known write time
+
+	Measurement measure(std::int64_t fileID);
+};
+
+#endif
@@ -0,0 +1,54 @@
+// 
+// 
+// 
+
+#include "WorkerPool.h"
+#include <freertos/task.h>
+#include <stdexcept>
+
+srv::WorkerPool::WorkerPool(Metrics& metrics, size_t workerCount, size_t queueDepth, UBaseType_t priority, uint32_t stackSize)
+	:m_metrics(metrics), m_queue(xQueueCreate(queueDepth, sizeof(Job*))), m_queueDepth(queueDepth), m_busyWorkers(0)
+{
+	if (!m_queue)
+		throw std::runtime_error("Failed to create worker queue");
+
+	for (size_t i = 0; i < workerCount; ++i)
+		if (xTaskCreate(&WorkerPool::workerTask, "worker", stackSize, this, priority, nullptr) != pdPASS)
+			throw std::runtime_error("Failed to start worker task");
+}
+
+bool srv::WorkerPool::post(Job job)
+{
+	Job* queued = new Job(std::move(job));
+	if (xQueueSend(m_queue, &queued, 0) == pdTRUE)
+		return true;
+
+	delete queued;
+	m_metrics.countWorkerRejection();
+	return false;
+}
+
+void srv::WorkerPool::workerTask(void* pool)
+{
+	WorkerPool& self = *static_cast<WorkerPool*>(pool);
+	Job* job;
+	for (;;)
+	{
+		if (xQueueReceive(self.m_queue, &job, portMAX_DELAY) != pdTRUE)
+			continue;
+
+		++self.m_busyWorkers;
+		const std::uint32_t start = micros();
+		try
+		{
+			(*job)();
+		}
+		catch (const std::exception& e)
+		{
+			log_e("Worker job failed: %s", e.what());
+		}
+		self.m_metrics.getWorkerJobTimes().observe(micros() - start);
+		delete job;
+		--self.m_busyWorkers;
+	}
+}
@@ -0,0 +1,48 @@
+// WorkerPool.h
+
+#ifndef _WorkerPool_h
+#define _WorkerPool_h
+
+#if defined(ARDUINO) && ARDUINO >= 100
+#include "arduino.h"
+#else
+#include "WProgram.h"
+#endif
+
+#include "Metrics.h"
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <atomic>
+#include <functional>
+
+namespace srv {
+	class WorkerPool;
+}
+
+// Bounded job queue drained by a small pool of FreeRTOS tasks, for work too slow for the async TCP task
+class srv::WorkerPool
+{
+public:
+	using Job = std::function<void()>;
+
+	WorkerPool(Metrics& metrics, size_t workerCount = 2, size_t queueDepth = 8, UBaseType_t priority = 2, uint32_t stackSize = 8192);
+
+	WorkerPool(const WorkerPool&) = delete;
+	WorkerPool& operator=(const WorkerPool&) = delete;
+
+	bool post(Job job); // false when the queue is full; never blocks
+
+	size_t getQueueDepth() const { return m_queueDepth; }
+	size_t getPending() const { return uxQueueMessagesWaiting(m_queue); }
+	size_t getBusyWorkers() const { return m_busyWorkers; }
+
+private:
+	Metrics& m_metrics;
+	QueueHandle_t m_queue;
+	size_t m_queueDepth;
+	std::atomic<size_t> m_busyWorkers;
+
+	static void workerTask(void* pool);
+};
+
+#endif
@@ -0,0 +1,399 @@
+// 
+// 
+// 
+
+#include "ZipStream.h"
+#include <esp_random.h>
+#include <esp_rom_crc.h>
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+namespace {
+	constexpr std::uint32_t LocalHeaderSignature = 0x04034b50;
+	constexpr std::uint32_t DataDescriptorSignature = 0x08074b50;
+	constexpr std::uint32_t CentralHeaderSignature = 0x02014b50;
+	constexpr std::uint32_t Zip64EndSignature = 0x06064b50;
+	constexpr std::uint32_t Zip64LocatorSignature = 0x07064b50;
+	constexpr std::uint32_t EndSignature = 0x06054b50;
+
+	constexpr std::uint16_t Version = 20;
+	constexpr std::uint16_t VersionZip64 = 45;
+	constexpr std::uint16_t FlagDataDescriptor = 0x0008;
+	constexpr std::uint16_t FlagUTF8 = 0x0800;
+	constexpr std::uint16_t Zip64ExtraTag = 0x0001;
+	constexpr std::uint32_t DirectoryAttribute = 0x10;
+
+	constexpr std::uint32_t Max32 = 0xFFFFFFFF;
+	constexpr std::uint16_t Max16 = 0xFFFF;
+}
+
+srv::ZipStream::ZipStream(StatementCache& statements, InodeCache& inodes, Metrics& metrics, fs::FS& spoolFS, std::int64_t rootID, const std::string& rootName)
+	:m_statements(statements), m_inodes(inodes), m_metrics(metrics), m_spoolFS(spoolFS), m_state(State::Walk), m_diskID(-1),
+	m_offset(0), m_entryCount(0), m_centralOffset(0), m_centralSize(0), m_pendingOffset(0)
+{
+	m_spoolFS.mkdir(SpoolDirectory); // fails harmlessly when it exists
+
+	char name[24];
+	snprintf(name, sizeof(name), "/%08x%08x.cd", esp_random(), esp_random());
+	m_spoolPath = std::string(SpoolDirectory) + name;
+	m_spool = m_spoolFS.open(m_spoolPath.c_str(), FILE_WRITE);
+	if (!m_spool)
+		throw std::runtime_error("Failed to create archive spool file");
+	m_spoolBuffer.reserve(SpoolBufferSize + 128);
+
+	const std::string rootPath = rootName + "/";
+	addDirectory(rootPath);
+	m_stack.push_back({ rootID, rootPath, std::string() });
+}
+
+srv::ZipStream::~ZipStream()
+{
+	if (m_file)
+		m_file.close();
+	if (m_spool)
+		m_spool.close();
+	m_spoolFS.remove(m_spoolPath.c_str());
+}
+
+size_t srv::ZipStream::read(uint8_t* buffer, size_t maxLen)
+{
+	try
+	{
+		size_t written = 0;
+		while (written < maxLen)
+		{
+			if (m_pendingOffset < m_pending.size())
+			{
+				const size_t count = std::min(maxLen - written, m_pending.size() - m_pendingOffset);
+				std::memcpy(buffer + written, m_pending.data() + m_pendingOffset, count);
+				m_pendingOffset += count;
+				written += count;
+				continue;
+			}
+			m_pending.clear();
+			m_pendingOffset = 0;
+
+			if (m_state == State::FileData)
+			{
+				// File data goes straight from the disk into the response buffer
+				const int count = m_file.read(buffer + written, maxLen - written);
+				if (count <= 0)
+				{
+					endFile();
+					continue;
+				}
+
+				m_entry.crc = esp_rom_crc32_le(m_entry.crc, buffer + written, count);
+				m_entry.size += count;
+				m_offset += count;
+				written += count;
+				m_metrics.addDiskRead(m_diskID, count);
+				continue;
+			}
+
+			if (m_state == State::CentralDirectory)
+			{
+				const int count = m_spool.read(buffer + written, maxLen - written);
+				if (count <= 0)
+				{
+					finishCentralDirectory();
+					continue;
+				}
+
+				m_centralSize += count;
+				m_offset += count;
+				written += count;
+				continue;
+			}
+
+			if (!advance())
+				break;
+		}
+		return written;
+	}
+	catch (const std::exception& e)
+	{
+		// Headers are already on the wire; the truncated archive is the only signal left to the client
+		log_e("Archive stream failed: %s", e.what());
+		m_state = State::Done;
+		return 0;
+	}
+}
+
+void srv::ZipStream::removeSpools(fs::FS& spoolFS)
+{
+	File directory = spoolFS.open(SpoolDirectory);
+	if (!directory || !directory.isDirectory())
+		return;
+
+	std::vector<std::string> paths;
+	for (File file = directory.openNextFile(); file; file = directory.openNextFile())
+		paths.push_back(file.path());
+	directory.close();
+
+	for (const std::string& path : paths)
+		spoolFS.remove(path.c_str());
+}
+
+bool srv::ZipStream::advance()
+{
+	if (m_state == State::Done)
+		return false;
+
+	DatabaseLock lock(m_statements.getMutex()); // the filler runs outside the router's locked dispatch
+	if (nextEntry())
+		return true;
+
+	// Tree exhausted: replay the spooled central directory
+	if (!m_spoolBuffer.empty() && m_spool.write(reinterpret_cast<const uint8_t*>(m_spoolBuffer.data()), m_spoolBuffer.size()) != m_spoolBuffer.size())
+		throw std::runtime_error("Failed to write archive spool file");
+	m_spoolBuffer.clear();
+	m_spool.close();
+
+	m_spool = m_spoolFS.open(m_spoolPath.c_str(), FILE_READ);
+	if (!m_spool)
+		throw std::runtime_error("Failed to reopen archive spool file");
+
+	m_centralOffset = m_offset;
+	m_state = State::CentralDirectory;
+	return true;
+}
+
+bool srv::ZipStream::nextEntry()
+{
+	while (!m_stack.empty())
+	{
+		CachedStatement statement = m_statements.prepare(
+			"SELECT ID, Name FROM FileEntries "
+			"WHERE ParentID = ? AND Name > ? "
+			"AND ID NOT IN (SELECT FileID FROM BackgroundJobs WHERE Type = 'delete' AND State = 'running') "
+			"ORDER BY Name LIMIT 1"
+		);
+		statement.bind(1, m_stack.back().directoryID);
+		statement.bind(2, m_stack.back().cursor);
+		if (!statement.evaluate())
+		{
+			m_stack.pop_back();
+			continue;
+		}
+
+		const std::int64_t id = statement.getColumnValue<std::int64_t>(0);
+		const std::string name = statement.getColumnValue<std::string>(1);
+		m_stack.back().cursor = name;
+		const std::string path = m_stack.back().path + name;
+
+		const InodeCache::Inode& inode = m_inodes.get(id);
+		if (inode.isDirectory)
+		{
+			addDirectory(path + "/");
+			m_stack.push_back({ id, path + "/", std::string() });
+			return true;
+		}
+
+		File file = inode.disk->getFS().open(inode.path.c_str());
+		if (!file)
+		{
+			log_w("Skipping %s in archive: failed to open %s", path.c_str(), inode.path.c_str());
+			continue;
+		}
+
+		beginFile(path, file, inode.diskID);
+		return true;
+	}
+	return false;
+}
+
+void srv::ZipStream::beginFile(const std::string& name, File file, std::int64_t diskID)
+{
+	m_entry = Entry{ name, m_offset, 0, 0, 0, 0, false, file.size() >= Max32 };
+	toDosTime(file.getLastWrite(), m_entry.dosTime, m_entry.dosDate);
+	appendLocalHeader(m_entry);
+
+	m_file = file;
+	m_diskID = diskID;
+	m_state = State::FileData;
+}
+
+void srv::ZipStream::endFile()
+{
+	m_file.close();
+	m_state = State::Walk;
+
+	std::string descriptor;
+	put32(descriptor, DataDescriptorSignature);
+	put32(descriptor, m_entry.crc);
+	if (m_entry.isZip64)
+	{
+		put64(descriptor, m_entry.size); // compressed
+		put64(descriptor, m_entry.size);
+	}
+	else
+	{
+		put32(descriptor, m_entry.size);
+		put32(descriptor, m_entry.size);
+	}
+	appendPending(descriptor);
+	recordCentralEntry(m_entry);
+}
+
+void srv::ZipStream::addDirectory(const std::string& name)
+{
+	Entry entry{ name, m_offset, 0, 0, 0, 0, true, false };
+	toDosTime(0, entry.dosTime, entry.dosDate);
+	appendLocalHeader(entry);
+	recordCentralEntry(entry);
+}
+
+void srv::ZipStream::finishCentralDirectory()
+{
+	m_spool.close();
+	m_state = State::Done;
+
+	std::string end;
+	const bool isZip64 = m_entryCount >= Max16 || m_centralSize >= Max32 || m_centralOffset >= Max32;
+	if (isZip64)
+	{
+		const std::uint64_t zip64EndOffset = m_offset;
+		put32(end, Zip64EndSignature);
+		put64(end, 44); // size of the rest of this record
+		put16(end, VersionZip64);
+		put16(end, VersionZip64);
+		put32(end, 0); // this disk
+		put32(end, 0); // disk with the central directory
+		put64(end, m_entryCount);
+		put64(end, m_entryCount);
+		put64(end, m_centralSize);
+		put64(end, m_centralOffset);
+
+		put32(end, Zip64LocatorSignature);
+		put32(end, 0);
+		put64(end, zip64EndOffset);
+		put32(end, 1); // total disks
+	}
+
+	put32(end, EndSignature);
+	put16(end, 0);
+	put16(end, 0);
+	put16(end, static_cast<std::uint16_t>(std::min<std::uint64_t>(m_entryCount, Max16)));
+	put16(end, static_cast<std::uint16_t>(std::min<std::uint64_t>(m_entryCount, Max16)));
+	put32(end, static_cast<std::uint32_t>(std::min<std::uint64_t>(m_centralSize, Max32)));
+	put32(end, static_cast<std::uint32_t>(std::min<std::uint64_t>(m_centralOffset, Max32)));
+	put16(end, 0); // comment length
+	appendPending(end);
+}
+
+void srv::ZipStream::appendPending(const std::string& bytes)
+{
+	m_pending += bytes;
+	m_offset += bytes.size();
+}
+
+void srv::ZipStream::appendLocalHeader(const Entry& entry)
+{
+	// Sizes and CRC follow the data in a descriptor; ZIP64 entries flag that with an extra field of zeros
+	std::string header;
+	put32(header, LocalHeaderSignature);
+	put16(header, entry.isZip64 ? VersionZip64 : Version);
+	put16(header, FlagUTF8 | (entry.isDirectory ? 0 : FlagDataDescriptor));
+	put16(header, 0); // stored
+	put16(header, entry.dosTime);
+	put16(header, entry.dosDate);
+	put32(header, 0);
+	put32(header, entry.isZip64 ? Max32 : 0);
+	put32(header, entry.isZip64 ? Max32 : 0);
+	put16(header, entry.name.size());
+	put16(header, entry.isZip64 ? 20 : 0);
+	header += entry.name;
+	if (entry.isZip64)
+	{
+		put16(header, Zip64ExtraTag);
+		put16(header, 16);
+		put64(header, 0);
+		put64(header, 0);
+	}
+	appendPending(header);
+}
+
+void srv::ZipStream::recordCentralEntry(const Entry& entry)
+{
+	const bool isLargeSize = entry.size >= Max32;
+	const bool isLargeOffset = entry.offset >= Max32;
+
+	std::string extra;
+	if (isLargeSize || isLargeOffset)
+	{
+		put16(extra, Zip64ExtraTag);
+		put16(extra, (isLargeSize ? 16 : 0) + (isLargeOffset ? 8 : 0));
+		if (isLargeSize)
+		{
+			put64(extra, entry.size);
+			put64(extra, entry.size);
+		}
+		if (isLargeOffset)
+			put64(extra, entry.offset);
+	}
+
+	std::string& out = m_spoolBuffer;
+	put32(out, CentralHeaderSignature);
+	put16(out, VersionZip64); // made by
+	put16(out, entry.isZip64 || !extra.empty() ? VersionZip64 : Version);
+	put16(out, FlagUTF8 | (entry.isDirectory ? 0 : FlagDataDescriptor));
+	put16(out, 0); // stored
+	put16(out, entry.dosTime);
+	put16(out, entry.dosDate);
+	put32(out, entry.crc);
+	put32(out, isLargeSize ? Max32 : entry.size);
+	put32(out, isLargeSize ? Max32 : entry.size);
+	put16(out, entry.name.size());
+	put16(out, extra.size());
+	put16(out, 0); // comment length
+	put16(out, 0); // disk number start
+	put16(out, 0); // internal attributes
+	put32(out, entry.isDirectory ? DirectoryAttribute : 0);
+	put32(out, isLargeOffset ? Max32 : entry.offset);
+	out += entry.name;
+	out += extra;
+	++m_entryCount;
+
+	if (out.size() < SpoolBufferSize)
+		return;
+
+	if (m_spool.write(reinterpret_cast<const uint8_t*>(out.data()), out.size()) != out.size())
+		throw std::runtime_error("Failed to write archive spool file");
+	out.clear();
+}
+
+void srv::ZipStream::toDosTime(std::time_t time, std::uint16_t& dosTime, std::uint16_t& dosDate)
+{
+	std::tm local{};
+	localtime_r(&time, &local);
+	if (local.tm_year < 80)
+	{
+		// Before the DOS epoch, e.g. a card without a clock: 1980-01-01 00:00
+		dosTime = 0;
+		dosDate = (1 << 5) | 1;
+		return;
+	}
+
+	dosTime = (local.tm_hour << 11) | (local.tm_min << 5) | (local.tm_sec / 2);
+	dosDate = ((local.tm_year - 80) << 9) | ((local.tm_mon + 1) << 5) | local.tm_mday;
+}
+
+void srv::ZipStream::put16(std::string& out, std::uint16_t value)
+{
+	out += static_cast<char>(value & 0xFF);
+	out += static_cast<char>(value >> 8);
+}
+
+void srv::ZipStream::put32(std::string& out, std::uint32_t value)
+{
+	put16(out, value & 0xFFFF);
+	put16(out, value >> 16);
+}
+
+void srv::ZipStream::put64(std::string& out, std::uint64_t value)
+{
+	put32(out, value & 0xFFFFFFFF);
+	put32(out, value >> 32);
+}
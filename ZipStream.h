@@ -0,0 +1,113 @@
+// ZipStream.h
+
+#ifndef _ZipStream_h
+#define _ZipStream_h
+
+#if defined(ARDUINO) && ARDUINO >= 100
+#include "arduino.h"
+#else
+#include "WProgram.h"
+#endif
+
+#include "StatementCache.h"
+#include "InodeCache.h"
+#include "Metrics.h"
+#include <FS.h>
+#include <cstdint>
+#include <ctime>
+#include <string>
+#include <vector>
+
+namespace srv {
+	class ZipStream;
+}
+
+// Streams a directory subtree as a store-mode ZIP archive, straight from the disks into the response buffer.
+// The tree is walked depth first by (ParentID, Name) keyset, one row per step, so RAM depends on the depth of
+// the tree and not its size. CRCs are computed as data passes through and written in data descriptors; the
+// central directory is spooled to a scratch file and replayed at the end. ZIP64 records are used per entry
+// and for the end of central directory once sizes, offsets or the entry count exceed the classic limits.
+class srv::ZipStream
+{
+public:
+	static constexpr const char* SpoolDirectory = "/.zipspool";
+
+	ZipStream(StatementCache& statements, InodeCache& inodes, Metrics& metrics, fs::FS& spoolFS, std::int64_t rootID, const std::string& rootName);
+	~ZipStream();
+
+	ZipStream(const ZipStream&) = delete;
+	ZipStream& operator=(const ZipStream&) = delete;
+
+	size_t read(uint8_t* buffer, size_t maxLen); // AwsResponseFiller
+
+	static void removeSpools(fs::FS& spoolFS); // leftovers of streams cut short by a reboot
+
+private:
+	enum class State
+	{
+		Walk,
+		FileData,
+		CentralDirectory,
+		Done
+	};
+
+	struct Frame
+	{
+		std::int64_t directoryID;
+		std::string path; // archive path of the directory, with a trailing slash
+		std::string cursor; // Name of the last child visited
+	};
+
+	struct Entry
+	{
+		std::string name;
+		std::uint64_t offset; // of the local file header
+		std::uint64_t size;
+		std::uint32_t crc;
+		std::uint16_t dosTime;
+		std::uint16_t dosDate;
+		bool isDirectory;
+		bool isZip64;
+	};
+
+	static constexpr size_t SpoolBufferSize = 1024;
+
+	StatementCache& m_statements;
+	InodeCache& m_inodes;
+	Metrics& m_metrics;
+	fs::FS& m_spoolFS;
+	std::string m_spoolPath;
+	File m_spool;
+	std::string m_spoolBuffer; // central directory records not yet written to the spool
+
+	State m_state;
+	std::vector<Frame> m_stack;
+	Entry m_entry; // the file whose data is being sent
+	File m_file;
+	std::int64_t m_diskID;
+
+	std::uint64_t m_offset; // bytes produced so far
+	std::uint64_t m_entryCount;
+	std::uint64_t m_centralOffset;
+	std::uint64_t m_centralSize;
+
+	std::string m_pending; // headers and descriptors not yet handed to the response
+	size_t m_pendingOffset;
+
+	bool advance(); // queues the next piece of the archive; false once everything is out
+	bool nextEntry();
+	void beginFile(const std::string& name, File file, std::int64_t diskID);
+	void endFile();
+	void addDirectory(const std::string& name);
+	void finishCentralDirectory();
+	void appendPending(const std::string& bytes);
+	void appendLocalHeader(const Entry& entry);
+	void recordCentralEntry(const Entry& entry);
+
+	static void toDosTime(std::time_t time, std::uint16_t& dosTime, std::uint16_t& dosDate);
+	static void put16(std::string& out, std::uint16_t value);
+	static void put32(std::string& out, std::uint32_t value);
+	static void put64(std::string& out, std::uint64_t value);
+};
+
+#endif
@@ -0,0 +1,472 @@
+#!/usr/bin/env python3
+"""Load generator for the ESP32 NAS REST API.
+
+Drives login, listing, upload, download, rename and delete against a running server with a
+number of concurrent clients and prints one JSON document with throughput and p50/p99 latency
+per operation, so runs can be diffed or plotted against each other. Operations refused with
+503 are retried after the Retry-After the server sent and counted as "rejected"; for overload runs
+raise --clients well past the configured admission limits. The exit status is 1 when an operation
+failed outright, the server restarted during the run or a --max-p99-ms bound was exceeded.
+
+--login-storm N adds N clients that do nothing but log in until the workload finishes, recorded as
+"storm_login". Comparing the list and download p99 of a run with and without it shows whether
+password hashing still stalls unrelated requests.
+
+--range-checks N follows every download with N GETs for random byte ranges of the file, alternating
+single ranges and multipart/byteranges requests, recorded as "range". A reply whose bytes differ
+from the uploaded copy counts as an error, so the exit status also covers range correctness.
+
+--bench NAME replaces the workflow with a microbenchmark: each client logs in once and repeats one
+narrow operation --iterations times. Run it against two firmware builds on the same card and network
+and diff the results; a single run only gives the absolute cost.
+
+    auth      GET /api/cache, which does nothing but authenticate, recorded as "auth". Every request
+              after the first is answered by the verified-token cache, so the p50 gap to a build
+              without it is the per-request cost of RS256 verification and payload parsing. A user's
+              logins all return the same token, so one run cannot force cache misses.
+    upload    PUT of --size bytes, recorded as "upload", each file deleted again untimed. Its
+              bytes_per_busy_s, bytes over time spent inside uploads, is the card's write rate
+              through the upload writer; vary --size around the writer's block size as well.
+    metadata  mkdir, rename and a --list-limit listing in --root, recorded as "mkdir", "rename" and
+              "list", each directory deleted again untimed. Combine with --populate so the rates
+              are taken on a database of realistic size.
+    dispatch  Requests the router settles with next to no handler work, recorded as "dispatch": a
+              malformed id on the deepest pattern (400), an unknown path (404) and GET /api/cache
+              (200). The network round trip dominates, so only the p50 gap between two builds
+              measured back to back says anything about the cost of matching a route.
+
+--populate N first makes sure a directory "loadtest-populate-N" with N empty subdirectories exists
+under --root, created through /api/files/batch in groups of 500 and renamed into place only once
+complete, so later runs reuse it. 100000 matches the database the statement cache was tuned for.
+
+    python3 tools/loadtest.py --url http://nas.local --user bench --password bench --root 1 \
+        --clients 4 --iterations 20 --size 262144 > run.json
+
+Every run reads /api/metrics before and after and reports a "device" section: requests the
+routes served, the heap low-water mark and admission rejections. If the server counted fewer
+requests than the run completed it restarted in between, which is reported as "reset" and fails
+the run, as does any operation whose p99 exceeds --max-p99-ms. For the overload check run the
+workflow at four times the admission limits, e.g. --clients 16 against the default 4 download
+slots, with a --max-p99-ms bound: a pass means no reset, no outright failures and bounded latency.
+
+--root is the ID of a directory the user can write to (e.g. the user's root directory).
+Only the Python standard library is used.
+
+Runs target real hardware only. A host-native Linux build of the server was dropped on purpose:
+vfs::Filesystem, Authentication and the SQLite wrapper are libraries outside this tree, so a host
+build would mean stand-ins for those as well as for AsyncWebServer and SD, and its numbers would
+measure the stand-ins rather than the card and the SPI bus the optimisations are aimed at.
+"""
+
+import argparse
+import http.client
+import json
+import os
+import random
+import re
+import statistics
+import sys
+import threading
+import time
+import urllib.parse
+import uuid
+
+OPERATIONS = ("login", "list", "upload", "download", "range", "rename", "delete", "storm_login", "auth", "mkdir", "dispatch")
+DISPATCH_PATHS = (("/api/files/12x/archive", 400), ("/api/no/such/route", 404), ("/api/cache", 200))
+POPULATE_GROUP = 500
+
+
+class Client:
+    def __init__(self, url, timeout):
+        parsed = urllib.parse.urlsplit(url)
+        self.host = parsed.hostname
+        self.port = parsed.port or 80
+        self.timeout = timeout
+        self.token = None
+        self.connection = None
+        self.retry_after = None
+        self.content_type = None
+
+    def request(self, method, path, body=None, headers=None):
+        headers = dict(headers or {})
+        if self.token:
+            headers["Authorization"] = "Bearer " + self.token
+        for attempt in range(2):
+            if self.connection is None:
+                self.connection = http.client.HTTPConnection(self.host, self.port, timeout=self.timeout)
+            try:
+                self.connection.request(method, path, body=body, headers=headers)
+                response = self.connection.getresponse()
+                self.retry_after = response.getheader("Retry-After")
+                self.content_type = response.getheader("Content-Type")
+                return response.status, response.read()
+            except (http.client.HTTPException, OSError):
+                # The server closes idle keep-alive connections; retry once on a fresh one
+                self.connection.close()
+                self.connection = None
+                if attempt:
+                    raise
+
+    def json(self, method, path, document):
+        return self.request(method, path, json.dumps(document).encode(), {"Content-Type": "application/json"})
+
+
+class Recorder:
+    def __init__(self, retries):
+        self.lock = threading.Lock()
+        self.retries = retries
+        self.samples = {op: [] for op in OPERATIONS}
+        self.errors = {op: 0 for op in OPERATIONS}
+        self.rejected = {op: 0 for op in OPERATIONS}
+        self.bytes = {op: 0 for op in OPERATIONS}
+
+    def time(self, op, client, call, expected=(200,), transferred=0, verify=None):
+        # Latency spans the whole operation, including waits the server asked for with 503 + Retry-After
+        start = time.perf_counter()
+        for attempt in range(self.retries + 1):
+            try:
+                status, body = call()
+            except (http.client.HTTPException, OSError):
+                status, body = None, b""
+            if status != 503 or attempt == self.retries:
+                break
+            with self.lock:
+                self.rejected[op] += 1
+            time.sleep(float(client.retry_after or 1))
+        elapsed = time.perf_counter() - start
+        with self.lock:
+            if status in expected and (verify is None or verify(body)):
+                self.samples[op].append(elapsed)
+                self.bytes[op] += transferred or len(body)
+            else:
+                self.errors[op] += 1
+        return status, body
+
+
+def percentile(samples, fraction):
+    if not samples:
+        return None
+    ordered = sorted(samples)
+    index = min(len(ordered) - 1, max(0, int(round(fraction * len(ordered) + 0.5)) - 1))
+    return ordered[index]
+
+
+def multipart(filename, payload):
+    boundary = uuid.uuid4().hex
+    head = ('--%s\r\nContent-Disposition: form-data; name="file"; filename="%s"\r\n'
+            "Content-Type: application/octet-stream\r\n\r\n" % (boundary, filename)).encode()
+    tail = ("\r\n--%s--\r\n" % boundary).encode()
+    return head + payload + tail, "multipart/form-data; boundary=" + boundary
+
+
+def parse_byteranges(body, content_type):
+    """Splits a multipart/byteranges body into (first, last, total, data) tuples, or None when malformed"""
+    match = re.search(r"boundary=([^;\s]+)", content_type or "")
+    if not match:
+        return None
+    segments = body.split(b"--" + match.group(1).encode())
+    if len(segments) < 3 or segments[0] or not segments[-1].startswith(b"--"):
+        return None
+    parts = []
+    for segment in segments[1:-1]:
+        # Each part is CRLF, its headers, a blank line, the data, and the CRLF that opens the next delimiter
+        end = segment.find(b"\r\n\r\n")
+        if not segment.startswith(b"\r\n") or end < 0 or not segment.endswith(b"\r\n"):
+            return None
+        content_range = re.search(rb"Content-Range: bytes (\d+)-(\d+)/(\d+)", segment[:end])
+        if not content_range:
+            return None
+        first, last, total = (int(value) for value in content_range.groups())
+        parts.append((first, last, total, segment[end + 4:-2]))
+    return parts
+
+
+def random_range(rng, size):
+    first = rng.randrange(size)
+    return first, min(size - 1, first + rng.randrange(1 + min(size, 64 * 1024)))
+
+
+def check_ranges(args, recorder, client, file_id, payload, rng):
+    size = len(payload)
+    for check in range(args.range_checks):
+        if check % 2 == 0:
+            first, last = random_range(rng, size)
+            recorder.time("range", client, lambda: client.request(
+                "GET", "/api/files/%d" % file_id, headers={"Range": "bytes=%d-%d" % (first, last)}),
+                expected=(206,), verify=lambda body: body == payload[first:last + 1])
+            continue
+
+        requested = sorted(random_range(rng, size) for _ in range(rng.randint(2, 4)))
+
+        def matches(body):
+            parts = parse_byteranges(body, client.content_type)
+            if parts is None:
+                return False
+            for first, last, total, data in parts:
+                if total != size or data != payload[first:last + 1]:
+                    return False
+            # The server may coalesce overlapping ranges, but every requested byte has to arrive
+            return all(any(part[0] <= first and last <= part[1] for part in parts) for first, last in requested)
+
+        recorder.time("range", client, lambda: client.request(
+            "GET", "/api/files/%d" % file_id,
+            headers={"Range": "bytes=" + ",".join("%d-%d" % bounds for bounds in requested)}),
+            expected=(206,), verify=matches)
+
+
+def find_entry(client, root, name):
+    after = None
+    while True:
+        path = "/api/files/%d?limit=256" % root
+        if after is not None:
+            path += "&after=" + urllib.parse.quote(after)
+        status, body = client.request("GET", path)
+        if status != 200:
+            return None
+        listing = json.loads(body)
+        for entry in listing["data"]:
+            if entry["name"] == name:
+                return entry["id"]
+        after = listing.get("next")
+        if after is None:
+            return None
+
+
+def run_client(args, recorder, index, payload, barrier):
+    client = Client(args.url, args.timeout)
+    rng = random.Random(index)
+    barrier.wait()
+    for iteration in range(args.iterations):
+        client.token = None
+        status, body = recorder.time("login", client, lambda: client.json(
+            "POST", "/api/login", {"username": args.user, "password": args.password}))
+        if status != 200:
+            continue
+        client.token = body.decode().strip()
+
+        recorder.time("list", client, lambda: client.request("GET", "/api/files/%d?limit=%d" % (args.root, args.list_limit)))
+
+        name = "loadtest-%d-%d-%s.bin" % (index, iteration, uuid.uuid4().hex[:8])
+        body, content_type = multipart(name, payload)
+        status, _ = recorder.time("upload", client, lambda: client.request(
+            "PUT", "/api/files/%d?size=%d" % (args.root, len(payload)), body, {"Content-Type": content_type}),
+            transferred=len(payload))
+        if status != 200:
+            continue
+
+        file_id = find_entry(client, args.root, name)
+        if file_id is None:
+            with recorder.lock:
+                recorder.errors["download"] += 1
+            continue
+
+        recorder.time("download", client, lambda: client.request("GET", "/api/files/%d" % file_id),
+                      verify=lambda body: body == payload)
+        if payload:
+            check_ranges(args, recorder, client, file_id, payload, rng)
+        recorder.time("rename", client, lambda: client.json("PATCH", "/api/files/%d" % file_id, {"newName": "renamed-" + name}))
+        recorder.time("delete", client, lambda: client.request("DELETE", "/api/files/%d" % file_id), expected=(200, 202))
+
+
+def bench_auth(args, recorder, client, index, payload):
+    for _ in range(args.iterations):
+        recorder.time("auth", client, lambda: client.request("GET", "/api/cache"))
+
+
+def bench_upload(args, recorder, client, index, payload):
+    for iteration in range(args.iterations):
+        name = "bench-upload-%d-%d-%s.bin" % (index, iteration, uuid.uuid4().hex[:8])
+        body, content_type = multipart(name, payload)
+        status, _ = recorder.time("upload", client, lambda: client.request(
+            "PUT", "/api/files/%d?size=%d" % (args.root, len(payload)), body, {"Content-Type": content_type}),
+            transferred=len(payload))
+        file_id = find_entry(client, args.root, name) if status == 200 else None
+        if file_id is not None:
+            client.request("DELETE", "/api/files/%d" % file_id)
+
+
+def bench_metadata(args, recorder, client, index, payload):
+    for iteration in range(args.iterations):
+        name = "bench-dir-%d-%d-%s" % (index, iteration, uuid.uuid4().hex[:8])
+        status, _ = recorder.time("mkdir", client, lambda: client.json("POST", "/api/files/%d" % args.root, {"name": name}))
+        directory_id = find_entry(client, args.root, name) if status == 200 else None
+        if directory_id is None:
+            continue
+        recorder.time("rename", client, lambda: client.json(
+            "PATCH", "/api/files/%d" % directory_id, {"newName": "renamed-" + name}))
+        recorder.time("list", client, lambda: client.request("GET", "/api/files/%d?limit=%d" % (args.root, args.list_limit)))
+        client.request("DELETE", "/api/files/%d" % directory_id)
+
+
+def bench_dispatch(args, recorder, client, index, payload):
+    for iteration in range(args.iterations):
+        path, status = DISPATCH_PATHS[iteration % len(DISPATCH_PATHS)]
+        recorder.time("dispatch", client, lambda: client.request("GET", path), expected=(status,))
+
+
+BENCHMARKS = {
+    "auth": bench_auth,
+    "upload": bench_upload,
+    "metadata": bench_metadata,
+    "dispatch": bench_dispatch,
+}
+
+
+def make_directory(client, parent, name):
+    status, _ = client.json("POST", "/api/files/%d" % parent, {"name": name})
+    directory_id = find_entry(client, parent, name) if status == 200 else None
+    if directory_id is None:
+        raise SystemExit("populate: could not create %s (status %s)" % (name, status))
+    return directory_id
+
+
+def populate(args):
+    client = Client(args.url, args.timeout)
+    status, body = client.json("POST", "/api/login", {"username": args.user, "password": args.password})
+    if status != 200:
+        raise SystemExit("populate: login failed (status %s)" % status)
+    client.token = body.decode().strip()
+
+    name = "loadtest-populate-%d" % args.populate
+    if find_entry(client, args.root, name) is not None:
+        return
+    top = make_directory(client, args.root, "loadtest-populating-" + uuid.uuid4().hex[:8])
+    for first in range(0, args.populate, POPULATE_GROUP):
+        group = make_directory(client, top, "group-%d" % (first // POPULATE_GROUP))
+        operations = [{"op": "mkdir", "parentID": group, "name": "entry-%d" % i}
+                      for i in range(first, min(first + POPULATE_GROUP, args.populate))]
+        status, body = client.json("POST", "/api/files/batch", operations)
+        if status != 200 or any(result["code"] != 200 for result in json.loads(body)["data"]):
+            raise SystemExit("populate: batch for %d failed (status %s)" % (first, status))
+    status, _ = client.json("PATCH", "/api/files/%d" % top, {"newName": name})
+    if status != 200:
+        raise SystemExit("populate: could not rename the populated directory (status %s)" % status)
+
+
+def run_bench_client(args, recorder, index, payload, barrier):
+    client = Client(args.url, args.timeout)
+    barrier.wait()
+    status, body = recorder.time("login", client, lambda: client.json(
+        "POST", "/api/login", {"username": args.user, "password": args.password}))
+    if status != 200:
+        return
+    client.token = body.decode().strip()
+    BENCHMARKS[args.bench](args, recorder, client, index, payload)
+
+
+def device_snapshot(args):
+    """Reads the counters that survive only until a restart, or None when /api/metrics is unreachable"""
+    try:
+        status, body = Client(args.url, args.timeout).request("GET", "/api/metrics")
+    except (http.client.HTTPException, OSError):
+        return None
+    if status != 200:
+        return None
+    snapshot = {"requests": 0, "heap_min_free_bytes": None, "admission_rejected": None}
+    for line in body.decode(errors="replace").splitlines():
+        name, _, value = line.rpartition(" ")
+        if name.startswith("nas_http_handler_seconds_count{") and 'phase="request"' in name:
+            snapshot["requests"] += int(float(value))
+        elif name == "nas_heap_min_free_bytes":
+            snapshot["heap_min_free_bytes"] = int(float(value))
+        elif name == "nas_admission_rejected_total":
+            snapshot["admission_rejected"] = int(float(value))
+    return snapshot
+
+
+def run_login_storm(args, recorder, barrier, done):
+    client = Client(args.url, args.timeout)
+    barrier.wait()
+    while not done.is_set():
+        recorder.time("storm_login", client, lambda: client.json(
+            "POST", "/api/login", {"username": args.user, "password": args.password}))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+    parser.add_argument("--url", required=True, help="server base URL, e.g. http://192.168.1.50")
+    parser.add_argument("--user", required=True)
+    parser.add_argument("--password", required=True)
+    parser.add_argument("--root", type=int, required=True, help="ID of a writable directory")
+    parser.add_argument("--clients", type=int, default=4)
+    parser.add_argument("--iterations", type=int, default=10, help="workflow repetitions per client")
+    parser.add_argument("--size", type=int, default=256 * 1024, help="upload size in bytes")
+    parser.add_argument("--list-limit", type=int, default=100)
+    parser.add_argument("--timeout", type=float, default=60.0)
+    parser.add_argument("--retries", type=int, default=5, help="retries of an operation refused with 503")
+    parser.add_argument("--login-storm", type=int, default=0, help="extra clients that only log in, for tail-latency checks")
+    parser.add_argument("--range-checks", type=int, default=0, help="random range requests verified after each download")
+    parser.add_argument("--bench", choices=sorted(BENCHMARKS), help="run one microbenchmark instead of the workflow")
+    parser.add_argument("--populate", type=int, default=0, help="empty directories to make sure exist before the run")
+    parser.add_argument("--max-p99-ms", type=float, help="fail the run when an operation's p99 exceeds this")
+    parser.add_argument("--label", default="", help="free-form tag stored with the results")
+    args = parser.parse_args()
+
+    if args.populate:
+        populate(args)
+
+    payload = os.urandom(args.size)
+    recorder = Recorder(args.retries)
+    barrier = threading.Barrier(args.clients + args.login_storm + 1)
+    done = threading.Event()
+    target = run_bench_client if args.bench else run_client
+    threads = [threading.Thread(target=target, args=(args, recorder, i, payload, barrier), daemon=True)
+               for i in range(args.clients)]
+    storm = [threading.Thread(target=run_login_storm, args=(args, recorder, barrier, done), daemon=True)
+             for _ in range(args.login_storm)]
+    for thread in threads + storm:
+        thread.start()
+
+    before = device_snapshot(args)
+    barrier.wait()
+    start = time.perf_counter()
+    for thread in threads:
+        thread.join()
+    duration = time.perf_counter() - start
+    done.set()
+    for thread in storm:
+        thread.join()
+    after = device_snapshot(args)
+
+    # Only routed requests are counted on the device, so unrouted dispatch probes are left out
+    completed = sum(len(recorder.samples[op]) for op in OPERATIONS if op != "dispatch")
+    reset = None if before is None or after is None else after["requests"] < before["requests"] + completed
+
+    results = {}
+    for op in OPERATIONS:
+        samples = recorder.samples[op]
+        results[op] = {
+            "count": len(samples),
+            "errors": recorder.errors[op],
+            "rejected": recorder.rejected[op],
+            "throughput_per_s": len(samples) / duration if duration else None,
+            "bytes_per_s": recorder.bytes[op] / duration if duration else None,
+            "bytes_per_busy_s": recorder.bytes[op] / sum(samples) if samples else None,
+            "mean_ms": statistics.fmean(samples) * 1e3 if samples else None,
+            "p50_ms": percentile(samples, 0.50) * 1e3 if samples else None,
+            "p99_ms": percentile(samples, 0.99) * 1e3 if samples else None,
+        }
+
+    json.dump({
+        "label": args.label,
+        "timestamp": time.strftime("%Y-%m-%dT%H:%M:%SZ", time.gmtime()),
+        "url": args.url,
+        "clients": args.clients,
+        "login_storm": args.login_storm,
+        "bench": args.bench,
+        "populate": args.populate,
+        "iterations": args.iterations,
+        "upload_size": args.size,
+        "duration_s": duration,
+        "operations": results,
+        "device": {"before": before, "after": after, "reset": reset},
+    }, sys.stdout, indent=2)
+    sys.stdout.write("\n")
+
+    too_slow = args.max_p99_ms is not None and any(
+        result["p99_ms"] is not None and result["p99_ms"] > args.max_p99_ms for result in results.values())
+    return 1 if any(recorder.errors.values()) or reset or too_slow else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())